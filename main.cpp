@@ -1,13 +1,89 @@
 ﻿#include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <unordered_map>
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <deque>
+#include <queue>
+#include <functional>
 #include <boost/geometry.hpp>
 #include <boost/geometry/geometries/point.hpp>
 #include <boost/geometry/geometries/box.hpp>
-#include <boost/optional.hpp>
+#include <boost/geometry/index/rtree.hpp>
 #include <opencv2/opencv.hpp>
+#if defined(__has_include)
+#if __has_include(<opencv2/freetype.hpp>)
+#include <opencv2/freetype.hpp>
+#define LABEL_PLACER_HAVE_FREETYPE 1
+#endif
+#if __has_include(<zlib.h>)
+#include <zlib.h>
+#define LABEL_PLACER_HAVE_ZLIB 1
+#endif
+#if __has_include(<sqlite3.h>)
+#include <sqlite3.h>
+#define LABEL_PLACER_HAVE_SQLITE 1
+#endif
+#endif
+// Label_placer.vcxproj links these through vcpkg (vcpkg.json) and sets this,
+// so a project build never drops MBTiles, PBF or TrueType support unnoticed
+#if defined(LABEL_PLACER_REQUIRE_DEPENDENCIES) && !(defined(LABEL_PLACER_HAVE_ZLIB) \
+    && defined(LABEL_PLACER_HAVE_SQLITE) && defined(LABEL_PLACER_HAVE_FREETYPE))
+#error "zlib, sqlite3 and opencv_freetype are required: install the vcpkg.json dependencies"
+#endif
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <process.h>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define LABEL_PLACER_HAVE_IO_URING 1
+#endif
+#endif
+#elif defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
 
 namespace bg = boost::geometry;
+namespace bgi = boost::geometry::index;
 
 using point_t = bg::model::point<double, 2, bg::cs::cartesian>;
 using box_t = bg::model::box<point_t>;
@@ -16,167 +92,6764 @@ struct labeled_point {
     point_t point;
     std::string label;
     box_t label_box;
+    // Which candidate of the placement's candidate set produced label_box:
+    // LABEL_SIDES for the plain placements, the layer's offsets, the style's
+    // corner or eight-position set, or the composite candidates. label_box
+    // always holds the real geometry; consumers must not rebuild it from this.
+    uint8_t offset_index = 0;
 };
 
+const int IMAGE_SIZE = 600;  // Reduced image size for better density
+const double SCALE = 80.0;   // Increased scale to spread out points more
+
+// Font for label text: a TrueType/OpenType file drawn through OpenCV's
+// FreeType/HarfBuzz module, or the built-in Hershey font when the path is
+// empty, the module is missing or the file cannot be loaded. height is in
+// pixels; 10 matches the Hershey scale of 0.3 the images used before.
+struct label_font {
+    std::string path;
+    int height = 10;
+};
+
+const int DEFAULT_TEXT_HEIGHT = 10;
+
+// Process-wide font, read when a run is shaped
+inline label_font& labelFont() {
+    static label_font font;
+    return font;
+}
+
+// One shaped and rasterized text run. size and baseline are what
+// cv::getTextSize reports; mask holds its coverage with the baseline at row
+// size.height and the pen start at column 0.
+struct text_run {
+    cv::Size size;
+    int baseline = 0;
+    cv::Mat mask; // CV_8UC1
+};
+
+// Shaped runs by (string, font, size). A label is shaped and rasterized once;
+// collision masks and every later draw reuse the stored run, and placement
+// boxes are sized from the same measurement (see labelExtent).
+//
+// At most MAX_CACHED_RUNS runs are kept. Past that, get() shapes into a
+// per-thread scratch run that stays valid until the thread's next get(), so
+// callers use a run before asking for another.
+class text_run_cache {
+public:
+    static constexpr size_t MAX_CACHED_RUNS = size_t(1) << 16;
+
+    static text_run_cache& instance() {
+        static text_run_cache cache;
+        return cache;
+    }
+
+    const text_run& get(const std::string& text, const label_font& font = labelFont()) {
+        std::string key = text;
+        key.push_back('\0');
+        key += font.path;
+        key.push_back('\0');
+        key += std::to_string(font.height);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto found = runs_.find(key);
+        if (found != runs_.end()) {
+            return *found->second;
+        }
+        if (runs_.size() >= MAX_CACHED_RUNS) {
+            thread_local text_run scratch;
+            scratch = shape(text, font);
+            return scratch;
+        }
+        std::unique_ptr<text_run> run(new text_run(shape(text, font)));
+        return *runs_.emplace(std::move(key), std::move(run)).first->second;
+    }
+
+    // Size and baseline of text exactly as get() shapes it, without
+    // rasterizing it. Hershey text needs no lock, so placement threads
+    // measure concurrently.
+    cv::Size measure(const std::string& text, int* baseline, const label_font& font = labelFont()) {
+        if (font.path.empty()) {
+            return cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, hersheyScale(font), 1, baseline);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+#if defined(LABEL_PLACER_HAVE_FREETYPE)
+        if (cv::freetype::FreeType2* face = trueTypeFont(font.path)) {
+            return face->getTextSize(text, font.height, -1, baseline);
+        }
+#endif
+        return cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, hersheyScale(font), 1, baseline);
+    }
+
+    // Whether font.path loads as a TrueType font; false means the Hershey fallback
+    bool loadsTrueType(const label_font& font) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return trueTypeFont(font.path) != nullptr;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return runs_.size();
+    }
+
+private:
+    static double hersheyScale(const label_font& font) { return 0.3 * font.height / DEFAULT_TEXT_HEIGHT; }
+
+#if defined(LABEL_PLACER_HAVE_FREETYPE)
+    cv::freetype::FreeType2* trueTypeFont(const std::string& path) {
+        if (path.empty()) {
+            return nullptr;
+        }
+        auto found = fonts_.find(path);
+        if (found == fonts_.end()) {
+            cv::Ptr<cv::freetype::FreeType2> font;
+            try {
+                font = cv::freetype::createFreeType2();
+                font->loadFontData(path, 0);
+            } catch (const cv::Exception& error) {
+                std::cerr << "Cannot load font '" << path << "', using Hershey: " << error.what() << "\n";
+                font.reset();
+            }
+            found = fonts_.emplace(path, font).first;
+        }
+        return found->second.get();
+    }
+#else
+    void* trueTypeFont(const std::string&) { return nullptr; }
+#endif
+
+    text_run shape(const std::string& text, const label_font& font) {
+        text_run run;
+#if defined(LABEL_PLACER_HAVE_FREETYPE)
+        if (cv::freetype::FreeType2* face = trueTypeFont(font.path)) {
+            run.size = face->getTextSize(text, font.height, -1, &run.baseline);
+            run.mask = cv::Mat(run.size.height + run.baseline + 1, std::max(run.size.width, 1), CV_8UC1, cv::Scalar(0));
+            face->putText(run.mask, text, cv::Point(0, run.size.height), font.height, cv::Scalar(255), -1, cv::LINE_AA, true);
+            return run;
+        }
+#endif
+        const double scale = hersheyScale(font);
+        run.size = cv::getTextSize(text, cv::FONT_HERSHEY_SIMPLEX, scale, 1, &run.baseline);
+        run.mask = cv::Mat(run.size.height + run.baseline + 1, std::max(run.size.width, 1), CV_8UC1, cv::Scalar(0));
+        cv::putText(run.mask, text, cv::Point(0, run.size.height), cv::FONT_HERSHEY_SIMPLEX, scale, cv::Scalar(255), 1);
+        return run;
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::unique_ptr<text_run>> runs_; // nodes keep returned runs in place
+#if defined(LABEL_PLACER_HAVE_FREETYPE)
+    std::unordered_map<std::string, cv::Ptr<cv::freetype::FreeType2>> fonts_; // null: failed to load
+#endif
+};
+
+// Label box of layers and style rules, which size their labels themselves
+const double LABEL_WIDTH = 0.4;  // Reduced from 6.0
+const double LABEL_HEIGHT = 0.2; // Reduced from 2.0
+
+// Distance from a point to the nearest corner of its label box on both axes
+const double LABEL_GAP = 0.2;
+
+// Candidate positions, tried in this order: the side of the point the box
+// lies on along x and along y
+const std::array<std::pair<double, double>, 4> LABEL_SIDES = { {
+    {1.0, 1.0},     // Top-right
+    {-1.0, 1.0},    // Top-left
+    {1.0, -1.0},    // Bottom-right
+    {-1.0, -1.0}    // Bottom-left
+} };
+
+// Pixels between a label's text and its box edge; the text background
+// drawn behind the text fills exactly the box
+const int LABEL_PADDING = 2;
+
+// World size of a label's placement box: its shaped run at SCALE pixels per
+// unit, descent included, plus LABEL_PADDING pixels on every side
+struct label_extent {
+    double width = 0.0;
+    double height = 0.0;
+};
+
+label_extent labelExtent(const std::string& label) {
+    int baseline = 0;
+    const cv::Size size = text_run_cache::instance().measure(label, &baseline);
+    // A run covers size.height + baseline + 1 rows, see text_run
+    return label_extent{ (size.width + 2 * LABEL_PADDING) / SCALE, (size.height + baseline + 1 + 2 * LABEL_PADDING) / SCALE };
+}
+
+// Furthest any candidate box of a label reaches from its point along either axis
+inline double labelReach(const label_extent& extent) {
+    return LABEL_GAP + std::max(extent.width, extent.height);
+}
+
+// Extents of every input label, and the largest reach among them
+std::vector<label_extent> measureLabels(const std::vector<std::pair<point_t, std::string>>& input_points,
+    double* max_reach = nullptr) {
+    std::vector<label_extent> extents(input_points.size());
+    double reach = LABEL_GAP;
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        extents[i] = labelExtent(input_points[i].second);
+        reach = std::max(reach, labelReach(extents[i]));
+    }
+    if (max_reach) {
+        *max_reach = reach;
+    }
+    return extents;
+}
+
+const size_t NO_OVERLAP = static_cast<size_t>(-1);
+
+inline unsigned lowestSetBit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<unsigned>(index);
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+// Index of the first placed label that intersects the candidate, or NO_OVERLAP
+size_t findOverlap(const box_t& candidate, const std::vector<labeled_point>& placed_labels) {
+    for (size_t i = 0; i < placed_labels.size(); ++i) {
+        if (bg::intersects(candidate, placed_labels[i].label_box)) {
+            return i;
+        }
+    }
+    return NO_OVERLAP;
+}
+
 bool hasOverlap(const box_t& candidate, const std::vector<labeled_point>& placed_labels) {
-    for (const auto& placed : placed_labels) {
-        if (bg::intersects(candidate, placed.label_box)) {
+    return findOverlap(candidate, placed_labels) != NO_OVERLAP;
+}
+
+// Rejection statistics from an instrumented placement run. Every rejected
+// candidate is folded into a coarse congestion grid and a per-blocker counter
+// rather than stored, so memory stays bounded however many rejections occur.
+struct placement_diagnostics {
+    double cell_size = 0.25;          // world units per congestion cell, see initDiagnostics
+    double origin_x = 0.0;            // world position of cell (0, 0)
+    double origin_y = 0.0;
+    int grid_width = 0;
+    int grid_height = 0;
+    std::vector<float> congestion;    // rejected candidates per cell, row-major
+    std::vector<uint32_t> blocked_by; // rejections caused by each placed label, indexed like the result
+    size_t rejected_candidates = 0;
+    size_t unplaced_points = 0;
+};
+
+// Finest congestion cell (about one label height) and the most cells a grid
+// may have; wider inputs get proportionally coarser cells
+const double MIN_CONGESTION_CELL = 0.25;
+const double MAX_CONGESTION_CELLS = 1 << 20;
+
+// Size the congestion grid to cover every candidate box of the input, none
+// of which extends further than reach from its point (see measureLabels)
+void initDiagnostics(placement_diagnostics& diagnostics,
+    const std::vector<std::pair<point_t, std::string>>& input_points, double reach) {
+    box_t bounds;
+    bg::assign_inverse(bounds);
+    for (const auto& input : input_points) {
+        bg::expand(bounds, input.first);
+    }
+    if (input_points.empty()) {
+        bounds = box_t(point_t(0.0, 0.0), point_t(0.0, 0.0));
+    }
+    diagnostics.origin_x = bg::get<0>(bounds.min_corner()) - reach;
+    diagnostics.origin_y = bg::get<1>(bounds.min_corner()) - reach;
+    const double extent_x = bg::get<0>(bounds.max_corner()) + reach - diagnostics.origin_x;
+    const double extent_y = bg::get<1>(bounds.max_corner()) + reach - diagnostics.origin_y;
+    // Smallest cell keeping the grid near MAX_CONGESTION_CELLS, also along
+    // each axis alone for long thin inputs
+    diagnostics.cell_size = std::max({ MIN_CONGESTION_CELL, std::sqrt(extent_x * extent_y / MAX_CONGESTION_CELLS),
+        extent_x / MAX_CONGESTION_CELLS, extent_y / MAX_CONGESTION_CELLS });
+    diagnostics.grid_width = static_cast<int>(std::ceil(extent_x / diagnostics.cell_size)) + 1;
+    diagnostics.grid_height = static_cast<int>(std::ceil(extent_y / diagnostics.cell_size)) + 1;
+    diagnostics.congestion.assign(static_cast<size_t>(diagnostics.grid_width) * diagnostics.grid_height, 0.0f);
+    diagnostics.blocked_by.clear();
+    diagnostics.rejected_candidates = 0;
+    diagnostics.unplaced_points = 0;
+}
+
+void recordRejection(placement_diagnostics& diagnostics, const box_t& candidate, size_t blocker) {
+    double cx = (bg::get<0>(candidate.min_corner()) + bg::get<0>(candidate.max_corner())) / 2.0;
+    double cy = (bg::get<1>(candidate.min_corner()) + bg::get<1>(candidate.max_corner())) / 2.0;
+    // Clamp before converting: a candidate far outside the grid must not overflow int
+    const double fx = std::floor((cx - diagnostics.origin_x) / diagnostics.cell_size);
+    const double fy = std::floor((cy - diagnostics.origin_y) / diagnostics.cell_size);
+    int gx = static_cast<int>(std::max(0.0, std::min(diagnostics.grid_width - 1.0, fx)));
+    int gy = static_cast<int>(std::max(0.0, std::min(diagnostics.grid_height - 1.0, fy)));
+    diagnostics.congestion[static_cast<size_t>(gy) * diagnostics.grid_width + gx] += 1.0f;
+    ++diagnostics.blocked_by[blocker];
+    ++diagnostics.rejected_candidates;
+}
+
+// Min corner offset from the point of a box of the given size on the side of LABEL_SIDES[offset_index]
+inline double candidateOffsetX(size_t offset_index, double width) {
+    return LABEL_SIDES[offset_index].first > 0.0 ? LABEL_GAP : -LABEL_GAP - width;
+}
+
+inline double candidateOffsetY(size_t offset_index, double height) {
+    return LABEL_SIDES[offset_index].second > 0.0 ? LABEL_GAP : -LABEL_GAP - height;
+}
+
+// Label box of the given extent for candidate offset_index around pt
+box_t candidateBox(const point_t& pt, size_t offset_index, const label_extent& extent) {
+    point_t corner1, corner2;
+    // Calculate box corners based on offset from point
+    bg::set<0>(corner1, bg::get<0>(pt) + candidateOffsetX(offset_index, extent.width));
+    bg::set<1>(corner1, bg::get<1>(pt) + candidateOffsetY(offset_index, extent.height));
+    bg::set<0>(corner2, bg::get<0>(corner1) + extent.width);
+    bg::set<1>(corner2, bg::get<1>(corner1) + extent.height);
+    return box_t(corner1, corner2);
+}
+
+// Placed label reduced to what the fixed candidate model needs: the index of
+// its input point and which of the four LABEL_SIDES won, packed into 32 bits.
+// The box is rebuilt on demand from the point and its label's extent, so the
+// result is 4 bytes per label instead of a full labeled_point. Inputs are
+// limited to 2^30 points.
+struct compact_label {
+    uint32_t packed = 0; // input index << 2 | offset index
+
+    // Inputs a compact placement can address; larger inputs are rejected
+    // rather than silently wrapped onto other points
+    static constexpr size_t MAX_INPUTS = size_t(1) << 30;
+
+    compact_label() = default;
+    compact_label(size_t input_index, size_t offset_index) {
+        if (input_index >= MAX_INPUTS || offset_index > 3) {
+            throw std::length_error("compact_label: input index or offset out of range");
+        }
+        packed = static_cast<uint32_t>(input_index << 2 | offset_index);
+    }
+
+    size_t inputIndex() const { return packed >> 2; }
+    uint8_t offsetIndex() const { return static_cast<uint8_t>(packed & 3); }
+};
+static_assert(sizeof(compact_label) == 4, "compact_label must stay 32 bits");
+
+box_t reconstructBox(const std::vector<std::pair<point_t, std::string>>& input_points, compact_label label) {
+    const auto& input = input_points[label.inputIndex()];
+    return candidateBox(input.first, label.offsetIndex(), labelExtent(input.second));
+}
+
+labeled_point expandLabel(const std::vector<std::pair<point_t, std::string>>& input_points, compact_label label) {
+    const auto& input = input_points[label.inputIndex()];
+    return labeled_point{ input.first, input.second, candidateBox(input.first, label.offsetIndex(), labelExtent(input.second)),
+        label.offsetIndex() };
+}
+
+// Intersection area of two boxes, 0 when they only touch or are apart
+double intersectionArea(const box_t& a, const box_t& b) {
+    const double w = std::min(bg::get<0>(a.max_corner()), bg::get<0>(b.max_corner()))
+        - std::max(bg::get<0>(a.min_corner()), bg::get<0>(b.min_corner()));
+    const double h = std::min(bg::get<1>(a.max_corner()), bg::get<1>(b.max_corner()))
+        - std::max(bg::get<1>(a.min_corner()), bg::get<1>(b.min_corner()));
+    return std::max(w, 0.0) * std::max(h, 0.0);
+}
+
+// overlapArea of the indexes that keep exact double boxes: sums
+// intersectionArea over forEachOverlap, see wide_bvh::overlapArea
+template <typename Index, typename Visit>
+double sumOverlapAreas(const Index& index, const box_t& candidate, double budget, Visit visit) {
+    double area = 0.0;
+    index.forEachOverlap(candidate, [&](size_t id, const box_t& placed) {
+        const double share = intersectionArea(candidate, placed);
+        if (share <= 0.0) {
+            return false;
+        }
+        area += share;
+        return visit(id, share) || area > budget;
+    });
+    return area;
+}
+
+// Boxes of the labels placed so far, in placement order. This is the only
+// place boxes are kept during placement; results refer back to the input.
+struct collision_index {
+    std::vector<box_t> boxes;
+
+    size_t size() const { return boxes.size(); }
+    void insert(const box_t& box) { boxes.push_back(box); }
+
+    // Position of the first placed box intersecting the candidate, or NO_OVERLAP
+    size_t findOverlap(const box_t& candidate) const {
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            if (bg::intersects(candidate, boxes[i])) {
+                return i;
+            }
+        }
+        return NO_OVERLAP;
+    }
+
+    // Calls visit(position, box) for placed boxes intersecting query until it returns true
+    template <typename Visit>
+    void forEachOverlap(const box_t& query, Visit visit) const {
+        for (size_t i = 0; i < boxes.size(); ++i) {
+            if (bg::intersects(query, boxes[i]) && visit(i, boxes[i])) {
+                return;
+            }
+        }
+    }
+
+    template <typename Visit>
+    double overlapArea(const box_t& candidate, double budget, Visit visit) const {
+        return sumOverlapAreas(*this, candidate, budget, visit);
+    }
+};
+
+// Nearest floats at or below / at or above a double, so float bounds never
+// shrink a box and a float pre-test cannot miss a real intersection
+inline float floatDown(double v) {
+    float f = static_cast<float>(v);
+    return static_cast<double>(f) > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+inline float floatUp(double v) {
+    float f = static_cast<float>(v);
+    return static_cast<double>(f) < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+// Intersection areas of [bx0, bx1] x [by0, by1] with the first n boxes of
+// float SoA columns, 8 (AVX) or 4 (SSE) at a time: calls visit(position, a)
+// for each box with a positive area a, in order, until it returns true.
+// Returns whether it stopped early.
+template <typename Visit>
+bool forEachOverlapArea(const float* x0, const float* y0, const float* x1, const float* y1, size_t n,
+    float bx0, float by0, float bx1, float by1, Visit visit) {
+    size_t i = 0;
+#if defined(__AVX__)
+    const __m256 cx0 = _mm256_set1_ps(bx0), cy0 = _mm256_set1_ps(by0);
+    const __m256 cx1 = _mm256_set1_ps(bx1), cy1 = _mm256_set1_ps(by1);
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        __m256 w = _mm256_sub_ps(_mm256_min_ps(cx1, _mm256_loadu_ps(x1 + i)), _mm256_max_ps(cx0, _mm256_loadu_ps(x0 + i)));
+        __m256 h = _mm256_sub_ps(_mm256_min_ps(cy1, _mm256_loadu_ps(y1 + i)), _mm256_max_ps(cy0, _mm256_loadu_ps(y0 + i)));
+        __m256 a = _mm256_mul_ps(_mm256_max_ps(w, zero), _mm256_max_ps(h, zero));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_cmp_ps(a, zero, _CMP_GT_OQ)));
+        if (mask) {
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, a);
+            for (; mask; mask &= mask - 1) {
+                const unsigned k = lowestSetBit(mask);
+                if (visit(i + k, lanes[k])) {
+                    return true;
+                }
+            }
+        }
+    }
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    const __m128 cx0 = _mm_set1_ps(bx0), cy0 = _mm_set1_ps(by0);
+    const __m128 cx1 = _mm_set1_ps(bx1), cy1 = _mm_set1_ps(by1);
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= n; i += 4) {
+        __m128 w = _mm_sub_ps(_mm_min_ps(cx1, _mm_loadu_ps(x1 + i)), _mm_max_ps(cx0, _mm_loadu_ps(x0 + i)));
+        __m128 h = _mm_sub_ps(_mm_min_ps(cy1, _mm_loadu_ps(y1 + i)), _mm_max_ps(cy0, _mm_loadu_ps(y0 + i)));
+        __m128 a = _mm_mul_ps(_mm_max_ps(w, zero), _mm_max_ps(h, zero));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_ps(_mm_cmpgt_ps(a, zero)));
+        if (mask) {
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, a);
+            for (; mask; mask &= mask - 1) {
+                const unsigned k = lowestSetBit(mask);
+                if (visit(i + k, lanes[k])) {
+                    return true;
+                }
+            }
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        const float w = std::min(bx1, x1[i]) - std::max(bx0, x0[i]);
+        const float h = std::min(by1, y1[i]) - std::max(by0, y0[i]);
+        const float a = std::max(w, 0.0f) * std::max(h, 0.0f);
+        if (a > 0.0f && visit(i, a)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Backing for the large placement arrays. Scanning multi-GB columns and
+// indices through 4 KiB pages costs a TLB miss every few thousand elements;
+// 2 MiB pages cut that by 512x. Explicit pages come from the hugetlbfs pool
+// (vm.nr_hugepages), transparent ones are requested with madvise. Either
+// falls back to the next option when unavailable, and off Linux to the heap.
+enum class huge_page_mode { off, transparent, explicit_pages };
+
+const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+const size_t HUGE_PAGE_MIN_BYTES = HUGE_PAGE_SIZE; // smaller blocks stay on the heap
+
+// Process-wide setting, read when a block is allocated
+inline huge_page_mode& hugePageMode() {
+    static huge_page_mode mode = huge_page_mode::off;
+    return mode;
+}
+
+// Bytes currently held by each kind of backing, for the benchmark report
+struct huge_page_stats {
+    std::atomic<size_t> explicit_bytes{ 0 };
+    std::atomic<size_t> transparent_bytes{ 0 };
+    std::atomic<size_t> heap_bytes{ 0 };
+};
+
+inline huge_page_stats& hugePageStats() {
+    static huge_page_stats stats;
+    return stats;
+}
+
+// Large blocks carry a header in front of the data recording how they were
+// obtained, so they are released correctly even if the mode changed since.
+struct huge_block_header {
+    huge_page_mode backing;
+    size_t mapped;    // length of the mapping or heap block
+    void* base;
+};
+const size_t HUGE_BLOCK_HEADER = 64; // keeps the data cache-line (and AVX) aligned
+
+inline void* allocateLarge(size_t bytes) {
+    const size_t total = bytes + HUGE_BLOCK_HEADER;
+    huge_block_header header{ huge_page_mode::off, total, nullptr };
+#if defined(__linux__)
+    const size_t mapped = (total + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (hugePageMode() == huge_page_mode::explicit_pages) {
+        void* p = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            header = huge_block_header{ huge_page_mode::explicit_pages, mapped, p };
+        }
+    }
+    if (!header.base && hugePageMode() != huge_page_mode::off) {
+        // Over-map by one huge page so the block can start on a huge page boundary
+        void* p = mmap(nullptr, mapped + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            uintptr_t aligned = (reinterpret_cast<uintptr_t>(p) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            madvise(reinterpret_cast<void*>(aligned), mapped, MADV_HUGEPAGE);
+            header = huge_block_header{ huge_page_mode::transparent, mapped + HUGE_PAGE_SIZE, p };
+            std::memcpy(reinterpret_cast<char*>(aligned), &header, sizeof(header));
+            hugePageStats().transparent_bytes += header.mapped;
+            return reinterpret_cast<char*>(aligned) + HUGE_BLOCK_HEADER;
+        }
+    }
+#endif
+    if (!header.base) {
+        header.base = ::operator new(total, std::align_val_t(HUGE_BLOCK_HEADER));
+        hugePageStats().heap_bytes += header.mapped;
+    } else {
+        hugePageStats().explicit_bytes += header.mapped;
+    }
+    std::memcpy(header.base, &header, sizeof(header));
+    return static_cast<char*>(header.base) + HUGE_BLOCK_HEADER;
+}
+
+inline void releaseLarge(void* data) {
+    huge_block_header header;
+    std::memcpy(&header, static_cast<char*>(data) - HUGE_BLOCK_HEADER, sizeof(header));
+    switch (header.backing) {
+    case huge_page_mode::off:
+        hugePageStats().heap_bytes -= header.mapped;
+        ::operator delete(header.base, std::align_val_t(HUGE_BLOCK_HEADER));
+        break;
+    case huge_page_mode::transparent:
+        hugePageStats().transparent_bytes -= header.mapped;
+#if defined(__linux__)
+        munmap(header.base, header.mapped);
+#endif
+        break;
+    case huge_page_mode::explicit_pages:
+        hugePageStats().explicit_bytes -= header.mapped;
+#if defined(__linux__)
+        munmap(header.base, header.mapped);
+#endif
+        break;
+    }
+}
+
+// Standard allocator over the above: blocks of at least HUGE_PAGE_MIN_BYTES go
+// through allocateLarge, everything else through std::allocator. The choice
+// depends only on the size, which deallocate is given again.
+template<typename T>
+struct huge_page_allocator {
+    using value_type = T;
+
+    huge_page_allocator() = default;
+    template<typename U>
+    huge_page_allocator(const huge_page_allocator<U>&) {}
+
+    T* allocate(size_t n) {
+        static_assert(alignof(T) <= HUGE_BLOCK_HEADER, "over-aligned type");
+        if (n * sizeof(T) < HUGE_PAGE_MIN_BYTES) {
+            return std::allocator<T>().allocate(n);
+        }
+        return static_cast<T*>(allocateLarge(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n) {
+        if (n * sizeof(T) < HUGE_PAGE_MIN_BYTES) {
+            std::allocator<T>().deallocate(p, n);
+        } else {
+            releaseLarge(p);
+        }
+    }
+
+    template<typename U>
+    bool operator==(const huge_page_allocator<U>&) const { return true; }
+    template<typename U>
+    bool operator!=(const huge_page_allocator<U>&) const { return false; }
+};
+
+template<typename T>
+using huge_vector = std::vector<T, huge_page_allocator<T>>;
+
+const int BVH_WIDTH = 8;
+
+// Order of nodes in memory for a packed (bulk built) BVH. Breadth-first keeps
+// each level together; van Emde Boas recursively stores the top half of the
+// tree followed by each bottom subtree, so any root-to-leaf path touches few
+// cache lines and pages at every level of the memory hierarchy, untuned.
+enum class bvh_layout { breadth_first, van_emde_boas };
+
+// Wide bounding volume hierarchy: every node keeps the bounds of up to 8
+// children in SoA float, so a single AVX compare tests all of them. A child
+// slot refers either to another node or directly to an item. Float bounds are
+// rounded outwards and item hits are confirmed against the exact double box.
+// Supports STR bulk build, R-tree style incremental insert with node splits
+// (ancestor bounds are only grown, never shrunk) and a bottom-up refit that
+// tightens every bound afterwards.
+struct wide_bvh {
+    struct alignas(32) node {
+        float min_x[BVH_WIDTH], min_y[BVH_WIDTH], max_x[BVH_WIDTH], max_y[BVH_WIDTH];
+        int32_t child[BVH_WIDTH]; // >= 0: node index, < 0: ~item index
+        int32_t parent = -1;
+        int32_t parent_slot = -1;
+        int32_t count = 0;
+        bool leaf = true;         // children are items rather than nodes
+    };
+
+    huge_vector<node> nodes;
+    std::vector<box_t> items; // exact boxes, by item id (insertion order)
+    int32_t root = -1;
+
+    size_t size() const { return items.size(); }
+
+    void clearNode(int32_t n) {
+        node& nd = nodes[n];
+        for (int k = 0; k < BVH_WIDTH; ++k) {
+            // Empty slots get inverted bounds and never match
+            nd.min_x[k] = nd.min_y[k] = std::numeric_limits<float>::infinity();
+            nd.max_x[k] = nd.max_y[k] = -std::numeric_limits<float>::infinity();
+            nd.child[k] = 0;
+        }
+        nd.count = 0;
+    }
+
+    int32_t newNode(int32_t parent, int32_t parent_slot, bool leaf) {
+        nodes.emplace_back();
+        int32_t n = static_cast<int32_t>(nodes.size() - 1);
+        clearNode(n);
+        nodes[n].parent = parent;
+        nodes[n].parent_slot = parent_slot;
+        nodes[n].leaf = leaf;
+        return n;
+    }
+
+    void setSlot(int32_t n, int slot, const box_t& bounds, int32_t child) {
+        node& nd = nodes[n];
+        nd.min_x[slot] = floatDown(bg::get<0>(bounds.min_corner()));
+        nd.min_y[slot] = floatDown(bg::get<1>(bounds.min_corner()));
+        nd.max_x[slot] = floatUp(bg::get<0>(bounds.max_corner()));
+        nd.max_y[slot] = floatUp(bg::get<1>(bounds.max_corner()));
+        nd.child[slot] = child;
+        if (child >= 0) {
+            nodes[child].parent = n;
+            nodes[child].parent_slot = slot;
+        }
+    }
+
+    box_t slotBounds(int32_t n, int slot) const {
+        const node& nd = nodes[n];
+        return box_t(point_t(nd.min_x[slot], nd.min_y[slot]), point_t(nd.max_x[slot], nd.max_y[slot]));
+    }
+
+    box_t nodeBounds(int32_t n) const {
+        box_t bounds;
+        bg::assign_inverse(bounds);
+        for (int k = 0; k < nodes[n].count; ++k) {
+            bg::expand(bounds, slotBounds(n, k));
+        }
+        return bounds;
+    }
+
+    // Sort-Tile-Recursive packing: full nodes, children close in x and y,
+    // then laid out in memory as requested
+    void build(const std::vector<box_t>& boxes, bvh_layout layout = bvh_layout::breadth_first) {
+        items = boxes;
+        nodes.clear();
+        root = -1;
+        if (items.empty()) {
+            return;
+        }
+
+        struct entry {
+            box_t bounds;
+            int32_t ref;
+            double cx, cy;
+        };
+        std::vector<entry> level(items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            const box_t& b = items[i];
+            level[i] = entry{ b, ~static_cast<int32_t>(i),
+                bg::get<0>(b.min_corner()) + bg::get<0>(b.max_corner()), bg::get<1>(b.min_corner()) + bg::get<1>(b.max_corner()) };
+        }
+        nodes.reserve(items.size() / (BVH_WIDTH - 1) + 1);
+
+        while (true) {
+            const size_t groups = (level.size() + BVH_WIDTH - 1) / BVH_WIDTH;
+            const size_t slices = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(groups))));
+            const size_t slice_size = slices * BVH_WIDTH;
+            std::sort(level.begin(), level.end(), [](const entry& a, const entry& b) { return a.cx < b.cx; });
+            for (size_t s = 0; s < level.size(); s += slice_size) {
+                std::sort(level.begin() + s, level.begin() + std::min(level.size(), s + slice_size),
+                    [](const entry& a, const entry& b) { return a.cy < b.cy; });
+            }
+
+            std::vector<entry> parents;
+            parents.reserve(groups);
+            const bool leaf = level[0].ref < 0;
+            for (size_t g = 0; g < level.size(); g += BVH_WIDTH) {
+                int32_t n = newNode(-1, -1, leaf);
+                box_t bounds;
+                bg::assign_inverse(bounds);
+                for (size_t k = g; k < std::min(level.size(), g + BVH_WIDTH); ++k) {
+                    setSlot(n, nodes[n].count++, level[k].bounds, level[k].ref);
+                    bg::expand(bounds, level[k].bounds);
+                }
+                parents.push_back(entry{ bounds, n,
+                    bg::get<0>(bounds.min_corner()) + bg::get<0>(bounds.max_corner()), bg::get<1>(bounds.min_corner()) + bg::get<1>(bounds.max_corner()) });
+            }
+            if (parents.size() == 1) {
+                root = parents[0].ref;
+                applyLayout(layout);
+                return;
+            }
+            level.swap(parents);
+        }
+    }
+
+    // Tree height below and including n; the tree is balanced, so the leftmost path is enough
+    int height(int32_t n) const {
+        int h = 1;
+        while (!nodes[n].leaf) {
+            n = nodes[n].child[0];
+            ++h;
+        }
+        return h;
+    }
+
+    void vanEmdeBoasOrder(int32_t n, int levels, std::vector<int32_t>& order) const {
+        if (levels == 1) {
+            order.push_back(n);
+            return;
+        }
+        const int top = levels / 2;
+        vanEmdeBoasOrder(n, top, order);
+        std::vector<int32_t> frontier(1, n), next;
+        for (int depth = 0; depth < top; ++depth) {
+            next.clear();
+            for (int32_t f : frontier) {
+                for (int k = 0; k < nodes[f].count; ++k) {
+                    if (nodes[f].child[k] >= 0) {
+                        next.push_back(nodes[f].child[k]);
+                    }
+                }
+            }
+            frontier.swap(next);
+        }
+        for (int32_t subtree : frontier) {
+            vanEmdeBoasOrder(subtree, levels - top, order);
+        }
+    }
+
+    // Renumber the nodes so they are stored in the given layout
+    void applyLayout(bvh_layout layout) {
+        if (root < 0) {
+            return;
+        }
+        std::vector<int32_t> order; // order[k] = current index of the node stored at k
+        order.reserve(nodes.size());
+        if (layout == bvh_layout::van_emde_boas) {
+            vanEmdeBoasOrder(root, height(root), order);
+        } else {
+            order.push_back(root);
+            for (size_t k = 0; k < order.size(); ++k) {
+                const node& nd = nodes[order[k]];
+                for (int c = 0; c < nd.count; ++c) {
+                    if (nd.child[c] >= 0) {
+                        order.push_back(nd.child[c]);
+                    }
+                }
+            }
+        }
+
+        std::vector<int32_t> new_index(nodes.size());
+        for (size_t k = 0; k < order.size(); ++k) {
+            new_index[order[k]] = static_cast<int32_t>(k);
+        }
+        huge_vector<node> reordered(order.size());
+        for (size_t k = 0; k < order.size(); ++k) {
+            node nd = nodes[order[k]];
+            for (int c = 0; c < nd.count; ++c) {
+                if (nd.child[c] >= 0) {
+                    nd.child[c] = new_index[nd.child[c]];
+                }
+            }
+            if (nd.parent >= 0) {
+                nd.parent = new_index[nd.parent];
+            }
+            reordered[k] = nd;
+        }
+        nodes.swap(reordered);
+        root = new_index[root];
+    }
+
+    // Grow the slot bounds on the path from n to the root to include box
+    void growAncestors(int32_t n, const box_t& box) {
+        while (nodes[n].parent >= 0) {
+            int32_t parent = nodes[n].parent;
+            int slot = nodes[n].parent_slot;
+            node& p = nodes[parent];
+            p.min_x[slot] = std::min(p.min_x[slot], floatDown(bg::get<0>(box.min_corner())));
+            p.min_y[slot] = std::min(p.min_y[slot], floatDown(bg::get<1>(box.min_corner())));
+            p.max_x[slot] = std::max(p.max_x[slot], floatUp(bg::get<0>(box.max_corner())));
+            p.max_y[slot] = std::max(p.max_y[slot], floatUp(bg::get<1>(box.max_corner())));
+            n = parent;
+        }
+    }
+
+    static double enlargement(const box_t& bounds, const box_t& box) {
+        box_t grown = bounds;
+        bg::expand(grown, box);
+        return bg::area(grown) - bg::area(bounds);
+    }
+
+    // Add an entry to node n. A full node is split in two along the axis with
+    // the wider spread of centres, and the new half is added to the parent in
+    // turn; a split root gets a new root above it.
+    void addEntry(int32_t n, const box_t& bounds, int32_t ref) {
+        // Whichever half the entry lands in, every ancestor above n must cover it
+        growAncestors(n, bounds);
+        if (nodes[n].count < BVH_WIDTH) {
+            setSlot(n, nodes[n].count++, bounds, ref);
+            return;
+        }
+
+        std::vector<std::pair<box_t, int32_t>> entries;
+        entries.reserve(BVH_WIDTH + 1);
+        for (int k = 0; k < BVH_WIDTH; ++k) {
+            int32_t child = nodes[n].child[k];
+            entries.emplace_back(child < 0 ? items[~child] : slotBounds(n, k), child);
+        }
+        entries.emplace_back(bounds, ref);
+
+        box_t centres;
+        bg::assign_inverse(centres);
+        for (const auto& e : entries) {
+            bg::expand(centres, point_t(bg::get<0>(e.first.min_corner()) + bg::get<0>(e.first.max_corner()),
+                bg::get<1>(e.first.min_corner()) + bg::get<1>(e.first.max_corner())));
+        }
+        const bool split_x = bg::get<0>(centres.max_corner()) - bg::get<0>(centres.min_corner())
+            >= bg::get<1>(centres.max_corner()) - bg::get<1>(centres.min_corner());
+        std::sort(entries.begin(), entries.end(), [split_x](const auto& a, const auto& b) {
+            return split_x
+                ? bg::get<0>(a.first.min_corner()) + bg::get<0>(a.first.max_corner()) < bg::get<0>(b.first.min_corner()) + bg::get<0>(b.first.max_corner())
+                : bg::get<1>(a.first.min_corner()) + bg::get<1>(a.first.max_corner()) < bg::get<1>(b.first.min_corner()) + bg::get<1>(b.first.max_corner());
+        });
+
+        const size_t half = entries.size() / 2;
+        int32_t sibling = newNode(-1, -1, nodes[n].leaf);
+        clearNode(n);
+        for (size_t k = 0; k < entries.size(); ++k) {
+            int32_t target = k < half ? n : sibling;
+            setSlot(target, nodes[target].count++, entries[k].first, entries[k].second);
+        }
+
+        if (nodes[n].parent < 0) {
+            int32_t new_root = newNode(-1, -1, false);
+            setSlot(new_root, nodes[new_root].count++, nodeBounds(n), n);
+            setSlot(new_root, nodes[new_root].count++, nodeBounds(sibling), sibling);
+            root = new_root;
+            return;
+        }
+        // n shrank, so its slot can be tightened; ancestors stay conservative until refit()
+        int32_t parent = nodes[n].parent;
+        setSlot(parent, nodes[n].parent_slot, nodeBounds(n), n);
+        addEntry(parent, nodeBounds(sibling), sibling);
+    }
+
+    // R-tree style insert: descend to the leaf whose bounds grow least
+    void insert(const box_t& box) {
+        const int32_t item = static_cast<int32_t>(items.size());
+        items.push_back(box);
+        if (root < 0) {
+            root = newNode(-1, -1, true);
+        }
+        int32_t n = root;
+        while (!nodes[n].leaf) {
+            int best = 0;
+            double best_cost = std::numeric_limits<double>::max(), best_area = best_cost;
+            for (int k = 0; k < nodes[n].count; ++k) {
+                box_t slot = slotBounds(n, k);
+                double cost = enlargement(slot, box);
+                double area = bg::area(slot);
+                if (cost < best_cost || (cost == best_cost && area < best_area)) {
+                    best = k;
+                    best_cost = cost;
+                    best_area = area;
+                }
+            }
+            n = nodes[n].child[best];
+        }
+        addEntry(n, box, ~item);
+    }
+
+    box_t refitNode(int32_t n) {
+        for (int k = 0; k < nodes[n].count; ++k) {
+            int32_t child = nodes[n].child[k];
+            setSlot(n, k, child < 0 ? items[~child] : refitNode(child), child);
+        }
+        return nodeBounds(n);
+    }
+
+    // Recompute every slot bound from its children, bottom up
+    void refit() {
+        if (root >= 0) {
+            refitNode(root);
+        }
+    }
+
+    // Item id of the first box found intersecting the candidate, or NO_OVERLAP
+    size_t findOverlap(const box_t& candidate) const {
+        size_t found = NO_OVERLAP;
+        forEachOverlap(candidate, [&](size_t id, const box_t&) {
+            found = id;
             return true;
+        });
+        return found;
+    }
+
+    // Calls visit(item id, box) for items intersecting candidate until it returns true
+    template <typename Visit>
+    void forEachOverlap(const box_t& candidate, Visit visit) const {
+        forEachLeafHit(candidate, [&](const node& nd, unsigned mask) {
+            for (; mask; mask &= mask - 1) {
+                const int32_t item = ~nd.child[lowestSetBit(mask)];
+                if (bg::intersects(candidate, items[item]) && visit(static_cast<size_t>(item), items[item])) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Summed intersection area of candidate with the items. Each leaf the
+    // candidate reaches is one forEachOverlapArea step over the leaf's own
+    // float slots; as with hits, the items it finds with a positive float
+    // area get their share from the exact double box, so the sums match the
+    // other indexes. Calls visit(item id, area) for every item with a positive
+    // share and stops once the sum exceeds budget or visit returns true.
+    // Returns the sum so far.
+    template <typename Visit>
+    double overlapArea(const box_t& candidate, double budget, Visit visit) const {
+        const float cx0 = floatDown(bg::get<0>(candidate.min_corner())), cy0 = floatDown(bg::get<1>(candidate.min_corner()));
+        const float cx1 = floatUp(bg::get<0>(candidate.max_corner())), cy1 = floatUp(bg::get<1>(candidate.max_corner()));
+        double area = 0.0;
+        forEachLeafHit(candidate, [&](const node& nd, unsigned) {
+            // Empty slots have inverted bounds and an area of 0
+            return forEachOverlapArea(nd.min_x, nd.min_y, nd.max_x, nd.max_y, BVH_WIDTH, cx0, cy0, cx1, cy1, [&](size_t k, float) {
+                const int32_t item = ~nd.child[k];
+                const double share = intersectionArea(candidate, items[item]);
+                if (share <= 0.0) {
+                    return false; // only touches, or apart once rounding is undone
+                }
+                area += share;
+                return visit(static_cast<size_t>(item), share) || area > budget;
+            });
+        });
+        return area;
+    }
+
+private:
+    // Calls visit_leaf(leaf, mask) for every leaf with slots whose float
+    // bounds intersect candidate, mask holding those slots, until it returns true
+    template <typename VisitLeaf>
+    void forEachLeafHit(const box_t& candidate, VisitLeaf visit_leaf) const {
+        if (root < 0) {
+            return;
+        }
+        const float cx0 = floatDown(bg::get<0>(candidate.min_corner())), cy0 = floatDown(bg::get<1>(candidate.min_corner()));
+        const float cx1 = floatUp(bg::get<0>(candidate.max_corner())), cy1 = floatUp(bg::get<1>(candidate.max_corner()));
+#if defined(__AVX__)
+        const __m256 qx0 = _mm256_set1_ps(cx0), qy0 = _mm256_set1_ps(cy0);
+        const __m256 qx1 = _mm256_set1_ps(cx1), qy1 = _mm256_set1_ps(cy1);
+#endif
+        // Nodes still to visit. The fixed part covers any practical tree; a
+        // deeper one (unbalanced build, huge input) continues on the heap
+        // rather than skipping subtrees.
+        int32_t stack[256];
+        std::vector<int32_t> overflow;
+        int top = 0;
+        stack[top++] = root;
+        while (top > 0 || !overflow.empty()) {
+            int32_t n;
+            if (!overflow.empty()) {
+                n = overflow.back();
+                overflow.pop_back();
+            } else {
+                n = stack[--top];
+            }
+            const node& nd = nodes[n];
+#if defined(__AVX__)
+            __m256 hit = _mm256_and_ps(
+                _mm256_and_ps(_mm256_cmp_ps(qx0, _mm256_load_ps(nd.max_x), _CMP_LE_OQ),
+                    _mm256_cmp_ps(_mm256_load_ps(nd.min_x), qx1, _CMP_LE_OQ)),
+                _mm256_and_ps(_mm256_cmp_ps(qy0, _mm256_load_ps(nd.max_y), _CMP_LE_OQ),
+                    _mm256_cmp_ps(_mm256_load_ps(nd.min_y), qy1, _CMP_LE_OQ)));
+            unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(hit));
+#else
+            unsigned mask = 0;
+            for (int k = 0; k < BVH_WIDTH; ++k) {
+                if (cx0 <= nd.max_x[k] && nd.min_x[k] <= cx1 && cy0 <= nd.max_y[k] && nd.min_y[k] <= cy1) {
+                    mask |= 1u << k;
+                }
+            }
+#endif
+            if (nd.leaf) {
+                if (mask && visit_leaf(nd, mask)) {
+                    return;
+                }
+                continue;
+            }
+            for (; mask; mask &= mask - 1) {
+                int32_t child = nd.child[lowestSetBit(mask)];
+                if (top < 256) {
+                    stack[top++] = child;
+                } else {
+                    overflow.push_back(child);
+                }
+            }
+        }
+    }
+};
+
+// Boost R-tree behind the collision_index interface, for comparison
+struct rtree_collision_index {
+    bgi::rtree<std::pair<box_t, size_t>, bgi::rstar<16>> tree;
+
+    size_t size() const { return tree.size(); }
+    void insert(const box_t& box) { tree.insert(std::make_pair(box, tree.size())); }
+
+    size_t findOverlap(const box_t& candidate) const {
+        auto it = tree.qbegin(bgi::intersects(candidate));
+        return it == tree.qend() ? NO_OVERLAP : it->second;
+    }
+
+    template <typename Visit>
+    void forEachOverlap(const box_t& query, Visit visit) const {
+        for (auto it = tree.qbegin(bgi::intersects(query)); it != tree.qend(); ++it) {
+            if (visit(it->second, it->first)) {
+                return;
+            }
+        }
+    }
+
+    template <typename Visit>
+    double overlapArea(const box_t& candidate, double budget, Visit visit) const {
+        return sumOverlapAreas(*this, candidate, budget, visit);
+    }
+};
+
+// Structure used to look up placed boxes during placement
+enum class collision_backend { linear, rtree, wide_bvh };
+
+// Set from any thread to stop a running placement at its next check
+struct cancellation_token {
+    std::atomic<bool> cancelled{ false };
+
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    bool requested() const { return cancelled.load(std::memory_order_relaxed); }
+};
+
+// Limits for an anytime placement: a deadline, a cancellation token, or both
+struct placement_budget {
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    const cancellation_token* token = nullptr;
+
+    bool exhausted() const {
+        return exhausted(std::chrono::steady_clock::now());
+    }
+
+    bool exhausted(std::chrono::steady_clock::time_point now) const {
+        return (token && token->requested()) || now >= deadline;
+    }
+};
+
+// Most points placed between two budget checks; keeps clock reads off the hot path
+const size_t BUDGET_CHECK_INTERVAL = 256;
+// Share of the time left that may pass before the next check
+const double BUDGET_CHECK_SLICE = 0.125;
+
+// Points to place before the next budget check. The cost per point measured
+// since the previous check sets the interval so that, at that cost, at most
+// BUDGET_CHECK_SLICE of the remaining time passes; slow points (a linear
+// index late in a large input) are therefore checked often, down to every
+// point, and a deadline is overrun by about one point's cost.
+size_t budgetCheckInterval(const placement_budget& budget, size_t points, std::chrono::steady_clock::duration elapsed,
+    std::chrono::steady_clock::time_point now) {
+    if (points == 0) {
+        return 1; // nothing timed yet
+    }
+    if (budget.deadline == std::chrono::steady_clock::time_point::max()) {
+        return BUDGET_CHECK_INTERVAL; // only a cancellation token to poll
+    }
+    const double per_point = std::chrono::duration<double>(elapsed).count() / static_cast<double>(points);
+    const double left = std::chrono::duration<double>(budget.deadline - now).count();
+    if (per_point <= 0.0) {
+        return BUDGET_CHECK_INTERVAL;
+    }
+    const double interval = BUDGET_CHECK_SLICE * left / per_point;
+    return interval >= BUDGET_CHECK_INTERVAL ? BUDGET_CHECK_INTERVAL : std::max<size_t>(1, static_cast<size_t>(interval));
+}
+
+// Greedy placement loop shared by all collision backends. The index must
+// provide findOverlap(box) returning a placement position or NO_OVERLAP, and
+// insert(box). With a budget the loop stops early once it is exhausted and
+// stores in processed how many input points, a prefix, were considered.
+template <typename Index>
+std::vector<compact_label> placeLabelsWithIndex(const std::vector<std::pair<point_t, std::string>>& input_points,
+    Index& index, placement_diagnostics* diagnostics, const placement_budget* budget = nullptr, size_t* processed = nullptr) {
+    std::vector<compact_label> result;
+    double reach = 0.0;
+    const std::vector<label_extent> extents = measureLabels(input_points, &reach);
+    if (diagnostics) {
+        initDiagnostics(*diagnostics, input_points, reach);
+    }
+
+    size_t i = 0;
+    size_t next_check = 0, last_check = 0;
+    std::chrono::steady_clock::time_point last_check_time = std::chrono::steady_clock::now();
+    for (; i < input_points.size(); ++i) {
+        if (budget && i == next_check) {
+            const auto now = std::chrono::steady_clock::now();
+            if (budget->exhausted(now)) {
+                break;
+            }
+            next_check = i + budgetCheckInterval(*budget, i - last_check, now - last_check_time, now);
+            last_check = i;
+            last_check_time = now;
+        }
+        const point_t& pt = input_points[i].first;
+        bool placed = false;
+
+        for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+            box_t candidate_box = candidateBox(pt, j, extents[i]);
+
+            size_t blocker = index.findOverlap(candidate_box);
+            if (blocker == NO_OVERLAP) {
+                index.insert(candidate_box);
+                result.emplace_back(i, j);
+                placed = true;
+                break;
+            }
+            if (diagnostics) {
+                recordRejection(*diagnostics, candidate_box, blocker);
+            }
+        }
+        if (diagnostics) {
+            if (placed) {
+                diagnostics->blocked_by.push_back(0);
+            } else {
+                ++diagnostics->unplaced_points;
+            }
+        }
+    }
+    if (processed) {
+        *processed = i;
+    }
+    return result;
+}
+
+// Greedy placement in input order, producing the compact representation.
+// Passing diagnostics switches on the instrumented mode, which records why
+// each rejected candidate failed.
+std::vector<compact_label> placeLabelsCompact(const std::vector<std::pair<point_t, std::string>>& input_points,
+    placement_diagnostics* diagnostics = nullptr, collision_backend backend = collision_backend::linear) {
+    if (backend == collision_backend::rtree) {
+        rtree_collision_index index;
+        return placeLabelsWithIndex(input_points, index, diagnostics);
+    }
+    if (backend == collision_backend::wide_bvh) {
+        wide_bvh index;
+        return placeLabelsWithIndex(input_points, index, diagnostics);
+    }
+    collision_index index;
+    return placeLabelsWithIndex(input_points, index, diagnostics);
+}
+
+// Outcome of an anytime placement. Input order is priority order, so a partial
+// result is exactly the full greedy result for the processed prefix: every
+// label in it is valid and final, and unprocessed points were simply not
+// reached.
+struct anytime_placement {
+    std::vector<compact_label> labels;
+    bool complete = true;
+    size_t unprocessed = 0;
+};
+
+// Greedy placement that gives up when the budget runs out and returns the
+// best placement reached so far
+anytime_placement placeLabelsAnytime(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const placement_budget& budget, collision_backend backend = collision_backend::wide_bvh,
+    placement_diagnostics* diagnostics = nullptr) {
+    anytime_placement result;
+    size_t processed = 0;
+    if (backend == collision_backend::rtree) {
+        rtree_collision_index index;
+        result.labels = placeLabelsWithIndex(input_points, index, diagnostics, &budget, &processed);
+    } else if (backend == collision_backend::wide_bvh) {
+        wide_bvh index;
+        result.labels = placeLabelsWithIndex(input_points, index, diagnostics, &budget, &processed);
+    } else {
+        collision_index index;
+        result.labels = placeLabelsWithIndex(input_points, index, diagnostics, &budget, &processed);
+    }
+    result.unprocessed = input_points.size() - processed;
+    result.complete = result.unprocessed == 0;
+    return result;
+}
+
+// Key of a sparse tile map entry from signed tile coordinates
+uint64_t viewTileKey(int tx, int ty) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(tx)) << 32) | static_cast<uint32_t>(ty);
+}
+
+// Placed boxes of one tile as float SoA, relative to the tile origin
+struct float_box_columns {
+    huge_vector<float> x0, y0, x1, y1;
+
+    size_t size() const { return x0.size(); }
+    void push_back(float bx0, float by0, float bx1, float by1) {
+        x0.push_back(bx0);
+        y0.push_back(by0);
+        x1.push_back(bx1);
+        y1.push_back(by1);
+    }
+};
+
+// Index of the first box from first on intersecting [bx0, bx1] x [by0, by1],
+// closed like bg::intersects, or NO_OVERLAP. 8 (AVX) or 4 (SSE) boxes per step.
+size_t findFloatOverlap(const float_box_columns& placed, float bx0, float by0, float bx1, float by1, size_t first = 0) {
+    const size_t n = placed.size();
+    size_t i = first;
+#if defined(__AVX__)
+    const __m256 cx0 = _mm256_set1_ps(bx0), cy0 = _mm256_set1_ps(by0);
+    const __m256 cx1 = _mm256_set1_ps(bx1), cy1 = _mm256_set1_ps(by1);
+    for (; i + 8 <= n; i += 8) {
+        __m256 hit = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(cx0, _mm256_loadu_ps(placed.x1.data() + i), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_loadu_ps(placed.x0.data() + i), cx1, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(cy0, _mm256_loadu_ps(placed.y1.data() + i), _CMP_LE_OQ),
+                _mm256_cmp_ps(_mm256_loadu_ps(placed.y0.data() + i), cy1, _CMP_LE_OQ)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(hit));
+        if (mask) {
+            return i + lowestSetBit(mask);
+        }
+    }
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+    const __m128 cx0 = _mm_set1_ps(bx0), cy0 = _mm_set1_ps(by0);
+    const __m128 cx1 = _mm_set1_ps(bx1), cy1 = _mm_set1_ps(by1);
+    for (; i + 4 <= n; i += 4) {
+        __m128 hit = _mm_and_ps(
+            _mm_and_ps(_mm_cmple_ps(cx0, _mm_loadu_ps(placed.x1.data() + i)),
+                _mm_cmple_ps(_mm_loadu_ps(placed.x0.data() + i), cx1)),
+            _mm_and_ps(_mm_cmple_ps(cy0, _mm_loadu_ps(placed.y1.data() + i)),
+                _mm_cmple_ps(_mm_loadu_ps(placed.y0.data() + i), cy1)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_ps(hit));
+        if (mask) {
+            return i + lowestSetBit(mask);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (bx0 <= placed.x1[i] && placed.x0[i] <= bx1 && by0 <= placed.y1[i] && placed.y0[i] <= by1) {
+            return i;
+        }
+    }
+    return NO_OVERLAP;
+}
+
+// Candidate offsets of a width x height box at the four corners
+// of the anchor, gap away from it, in LABEL_SIDES order
+std::vector<std::pair<double, double>> cornerOffsets(double width, double height, double gap = LABEL_GAP) {
+    return { { gap, gap }, { -gap - width, gap }, { gap, -gap - height }, { -gap - width, -gap - height } };
+}
+
+// One layer of a layered placement job: its points in priority order and the
+// label geometry every point of the layer uses
+struct placement_layer {
+    std::string name;
+    std::vector<std::pair<point_t, std::string>> points;
+    double width = LABEL_WIDTH;
+    double height = LABEL_HEIGHT;
+    std::vector<std::pair<double, double>> offsets = cornerOffsets(LABEL_WIDTH, LABEL_HEIGHT); // box min corner from the anchor, in preference order
+    int priority = 0; // lower runs first; equal priorities keep their order
+    double overlap_tolerance = 0.0; // share of a label's area it may overlap earlier labels by, e.g. 0.1
+};
+
+struct layer_stats {
+    std::string name;
+    size_t points = 0;
+    size_t placed = 0;
+    size_t rejected_candidates = 0;
+    size_t blocked_by_earlier_layers = 0; // rejections caused by labels of layers placed before
+    size_t tolerated_overlaps = 0;        // labels placed overlapping others within their budget
+    double place_ms = 0.0;
+};
+
+struct layered_placement {
+    std::vector<std::vector<labeled_point>> labels; // per layer, in the job's layer order
+    std::vector<layer_stats> stats;                  // per layer, in the job's layer order
+};
+
+template <typename Index>
+layered_placement placeLayersWithIndex(const std::vector<placement_layer>& layers, Index& index) {
+    layered_placement result;
+    result.labels.resize(layers.size());
+    result.stats.resize(layers.size());
+
+    std::vector<size_t> order(layers.size());
+    for (size_t l = 0; l < layers.size(); ++l) {
+        order[l] = l;
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return layers[a].priority < layers[b].priority; });
+
+    // Layer of every box in the index, by the id findOverlap returns
+    std::vector<uint32_t> owner;
+    // Overlap area each placed box may take and has taken so far, by the same
+    // id; a box of a layer without tolerance has no budget
+    std::vector<double> overlap_budget, overlap_used;
+    std::vector<std::pair<size_t, double>> overlapped; // (id, area) of one candidate
+    for (size_t l : order) {
+        const placement_layer& layer = layers[l];
+        layer_stats& stats = result.stats[l];
+        stats.name = layer.name;
+        stats.points = layer.points.size();
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& input : layer.points) {
+            const point_t& pt = input.first;
+            for (size_t j = 0; j < layer.offsets.size(); ++j) {
+                point_t corner(bg::get<0>(pt) + layer.offsets[j].first, bg::get<1>(pt) + layer.offsets[j].second);
+                box_t candidate_box(corner, point_t(bg::get<0>(corner) + layer.width, bg::get<1>(corner) + layer.height));
+                const double budget = layer.overlap_tolerance * layer.width * layer.height;
+                size_t blocker = NO_OVERLAP;
+                double used = 0.0;
+                overlapped.clear();
+                if (layer.overlap_tolerance > 0.0) {
+                    // One query sums the overlap area, stopping once it is over
+                    // the candidate's budget or a label it overlaps has no room left
+                    used = index.overlapArea(candidate_box, budget, [&](size_t id, double area) {
+                        overlapped.emplace_back(id, area);
+                        if (overlap_used[id] + area > overlap_budget[id]) {
+                            blocker = id;
+                            return true;
+                        }
+                        return false;
+                    });
+                    if (blocker == NO_OVERLAP && used > budget) {
+                        blocker = overlapped.back().first;
+                    }
+                } else {
+                    blocker = index.findOverlap(candidate_box);
+                }
+                if (blocker == NO_OVERLAP) {
+                    index.insert(candidate_box);
+                    owner.push_back(static_cast<uint32_t>(l));
+                    overlap_budget.push_back(budget);
+                    overlap_used.push_back(used);
+                    for (const auto& hit : overlapped) {
+                        overlap_used[hit.first] += hit.second;
+                    }
+                    stats.tolerated_overlaps += !overlapped.empty();
+                    labeled_point lp;
+                    lp.point = pt;
+                    lp.label = input.second;
+                    lp.label_box = candidate_box;
+                    lp.offset_index = static_cast<uint8_t>(j);
+                    result.labels[l].push_back(lp);
+                    ++stats.placed;
+                    break;
+                }
+                ++stats.rejected_candidates;
+                stats.blocked_by_earlier_layers += owner[blocker] != l;
+            }
+        }
+        stats.place_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+    return result;
+}
+
+// Place several layers in priority order against one collision index that is
+// built up across the layers, never rebuilt: a layer sees every label of the
+// layers before it. Within a layer, points keep their priority order. A layer
+// with an overlap tolerance accepts a candidate whose summed intersection
+// area with placed labels stays within that share of its own area, and only
+// while each label it overlaps stays within its own layer's share too (none
+// for layers without tolerance).
+layered_placement placeLayers(const std::vector<placement_layer>& layers,
+    collision_backend backend = collision_backend::wide_bvh) {
+    if (backend == collision_backend::rtree) {
+        rtree_collision_index index;
+        return placeLayersWithIndex(layers, index);
+    }
+    if (backend == collision_backend::wide_bvh) {
+        wide_bvh index;
+        return placeLayersWithIndex(layers, index);
+    }
+    collision_index index;
+    return placeLayersWithIndex(layers, index);
+}
+
+// Corner candidates followed by the four side-centred ones: right, left,
+// above and below the anchor
+std::vector<std::pair<double, double>> eightOffsets(double width, double height, double gap = 0.2) {
+    std::vector<std::pair<double, double>> offsets = cornerOffsets(width, height, gap);
+    offsets.insert(offsets.end(), { { gap, -height / 2 }, { -gap - width, -height / 2 },
+        { -width / 2, gap }, { -width / 2, -gap - height } });
+    return offsets;
+}
+
+// Numeric feature attributes in SoA form, one column per attribute name
+struct feature_columns {
+    std::vector<std::string> names;
+    std::vector<std::vector<double>> values; // values[column][point]
+
+    size_t size() const { return values.empty() ? 0 : values[0].size(); }
+    size_t column(const std::string& name) const {
+        auto it = std::find(names.begin(), names.end(), name);
+        return it == names.end() ? NO_OVERLAP : static_cast<size_t>(it - names.begin());
+    }
+};
+
+// Style rules compiled to a flat decision table. Source, one rule per line,
+// '#' starts a comment:
+//   when population > 1000000 and capital == 1 then width 0.6 height 0.25 positions 8 priority 0
+//   default then width 0.4 height 0.2 positions 4 priority 10
+// The first rule whose conditions all hold decides a point's label box,
+// candidate set (4 corners or 8 positions) and priority (lower is placed
+// first); points matching no rule use the default rule, or are skipped
+// without one. Attribute names are resolved to column indices at compile
+// time, so evaluation only compares numbers.
+struct style_program {
+    enum class op : uint8_t { lt, le, gt, ge, eq, ne };
+    struct condition {
+        uint32_t column;
+        op comparison;
+        double value;
+    };
+    struct rule {
+        uint32_t first_condition = 0;
+        uint32_t condition_count = 0;
+        float width = static_cast<float>(LABEL_WIDTH);
+        float height = static_cast<float>(LABEL_HEIGHT);
+        uint8_t positions = 4;
+        int32_t priority = 0;
+    };
+
+    std::vector<condition> conditions;
+    std::vector<rule> rules;   // in source order
+    int32_t default_rule = -1; // index into rules
+};
+
+style_program compileStyle(const std::string& source, const feature_columns& features) {
+    style_program program;
+    std::istringstream lines(source);
+    std::string line;
+    for (int line_number = 1; std::getline(lines, line); ++line_number) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string word;
+        if (!(words >> word)) {
+            continue;
+        }
+        auto fail = [&](const std::string& what) {
+            throw std::runtime_error("style line " + std::to_string(line_number) + ": " + what);
+        };
+        style_program::rule rule;
+        rule.first_condition = static_cast<uint32_t>(program.conditions.size());
+        if (word == "default") {
+            if (program.default_rule >= 0) {
+                fail("second default rule");
+            }
+            program.default_rule = static_cast<int32_t>(program.rules.size());
+            if (!(words >> word) || word != "then") {
+                fail("expected 'then'");
+            }
+        } else if (word == "when") {
+            while (true) {
+                std::string name, comparison, connective;
+                double value;
+                if (!(words >> name >> comparison >> value)) {
+                    fail("expected '<attribute> <op> <number>'");
+                }
+                size_t column = features.column(name);
+                if (column == NO_OVERLAP) {
+                    fail("unknown attribute '" + name + "'");
+                }
+                static const std::array<const char*, 6> OPS = { { "<", "<=", ">", ">=", "==", "!=" } };
+                auto found = std::find_if(OPS.begin(), OPS.end(), [&](const char* o) { return comparison == o; });
+                if (found == OPS.end()) {
+                    fail("unknown comparison '" + comparison + "'");
+                }
+                program.conditions.push_back(style_program::condition{ static_cast<uint32_t>(column),
+                    static_cast<style_program::op>(found - OPS.begin()), value });
+                if (!(words >> connective) || (connective != "and" && connective != "then")) {
+                    fail("expected 'and' or 'then'");
+                }
+                if (connective == "then") {
+                    break;
+                }
+            }
+        } else {
+            fail("expected 'when' or 'default'");
+        }
+        rule.condition_count = static_cast<uint32_t>(program.conditions.size()) - rule.first_condition;
+        std::string key;
+        while (words >> key) {
+            double value;
+            if (!(words >> value)) {
+                fail("missing value for '" + key + "'");
+            }
+            if ((key == "width" || key == "height") && !(value > 0.0 && value <= std::numeric_limits<float>::max())) {
+                fail("'" + key + "' must be positive");
+            }
+            if (key == "width") {
+                rule.width = static_cast<float>(value);
+            } else if (key == "height") {
+                rule.height = static_cast<float>(value);
+            } else if (key == "positions" && (value == 4 || value == 8)) {
+                rule.positions = static_cast<uint8_t>(value);
+            } else if (key == "priority") {
+                rule.priority = static_cast<int32_t>(value);
+            } else {
+                fail("bad setting '" + key + "'");
+            }
+        }
+        program.rules.push_back(rule);
+    }
+    return program;
+}
+
+// Per-point result of a style program, SoA. rule is -1 for unstyled points.
+struct styled_points {
+    std::vector<int32_t> rule;
+    std::vector<float> width, height;
+    std::vector<uint8_t> positions;
+    std::vector<int32_t> priority;
+};
+
+const size_t STYLE_BATCH = 256;
+
+// match[k] &= (column[k] <op> value) for one batch
+void styleCompareBatch(const double* column, size_t n, style_program::op comparison, double value, uint8_t* match) {
+    size_t k = 0;
+#if defined(__AVX__)
+    const __m256d v = _mm256_set1_pd(value);
+    for (; k + 4 <= n; k += 4) {
+        const __m256d c = _mm256_loadu_pd(column + k);
+        __m256d hit;
+        switch (comparison) {
+        case style_program::op::lt: hit = _mm256_cmp_pd(c, v, _CMP_LT_OQ); break;
+        case style_program::op::le: hit = _mm256_cmp_pd(c, v, _CMP_LE_OQ); break;
+        case style_program::op::gt: hit = _mm256_cmp_pd(c, v, _CMP_GT_OQ); break;
+        case style_program::op::ge: hit = _mm256_cmp_pd(c, v, _CMP_GE_OQ); break;
+        case style_program::op::eq: hit = _mm256_cmp_pd(c, v, _CMP_EQ_OQ); break;
+        default: hit = _mm256_cmp_pd(c, v, _CMP_NEQ_UQ); break;
+        }
+        const int bits = _mm256_movemask_pd(hit);
+        match[k] &= bits & 1;
+        match[k + 1] &= (bits >> 1) & 1;
+        match[k + 2] &= (bits >> 2) & 1;
+        match[k + 3] &= (bits >> 3) & 1;
+    }
+#endif
+    for (; k < n; ++k) {
+        const double c = column[k];
+        bool hit;
+        switch (comparison) {
+        case style_program::op::lt: hit = c < value; break;
+        case style_program::op::le: hit = c <= value; break;
+        case style_program::op::gt: hit = c > value; break;
+        case style_program::op::ge: hit = c >= value; break;
+        case style_program::op::eq: hit = c == value; break;
+        default: hit = c != value; break;
+        }
+        match[k] &= static_cast<uint8_t>(hit);
+    }
+}
+
+// Run the program over all points in batches: each condition is one SIMD
+// compare over a batch of a column, and rules are applied last to first so
+// the first matching rule is what remains. Every column must have one value
+// per point.
+styled_points evaluateStyle(const style_program& program, const feature_columns& features) {
+    const size_t n = features.size();
+    if (features.values.size() != features.names.size()) {
+        throw std::runtime_error("feature columns: " + std::to_string(features.names.size()) + " names for "
+            + std::to_string(features.values.size()) + " columns");
+    }
+    for (size_t c = 0; c < features.values.size(); ++c) {
+        if (features.values[c].size() != n) {
+            throw std::runtime_error("feature column '" + features.names[c] + "' has " + std::to_string(features.values[c].size())
+                + " values, expected " + std::to_string(n));
+        }
+    }
+    styled_points out;
+    out.rule.assign(n, program.default_rule);
+    uint8_t match[STYLE_BATCH];
+    for (size_t first = 0; first < n; first += STYLE_BATCH) {
+        const size_t count = std::min(STYLE_BATCH, n - first);
+        for (size_t r = program.rules.size(); r-- > 0;) {
+            const style_program::rule& rule = program.rules[r];
+            if (static_cast<int32_t>(r) == program.default_rule) {
+                continue;
+            }
+            std::fill(match, match + count, uint8_t(1));
+            for (uint32_t c = 0; c < rule.condition_count; ++c) {
+                const style_program::condition& cond = program.conditions[rule.first_condition + c];
+                styleCompareBatch(features.values[cond.column].data() + first, count, cond.comparison, cond.value, match);
+            }
+            for (size_t k = 0; k < count; ++k) {
+                out.rule[first + k] = match[k] ? static_cast<int32_t>(r) : out.rule[first + k];
+            }
+        }
+    }
+
+    // Decision table lookup
+    out.width.resize(n);
+    out.height.resize(n);
+    out.positions.resize(n);
+    out.priority.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        const int32_t r = out.rule[i];
+        if (r < 0) {
+            out.width[i] = out.height[i] = 0.0f;
+            out.positions[i] = 0;
+            out.priority[i] = std::numeric_limits<int32_t>::max();
+            continue;
+        }
+        const style_program::rule& rule = program.rules[r];
+        out.width[i] = rule.width;
+        out.height[i] = rule.height;
+        out.positions[i] = rule.positions;
+        out.priority[i] = rule.priority;
+    }
+    return out;
+}
+
+template <typename Index>
+std::vector<labeled_point> placeStyledLabelsWithIndex(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const styled_points& styles, Index& index) {
+    std::vector<uint32_t> order;
+    order.reserve(input_points.size());
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        if (styles.rule[i] >= 0) {
+            order.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    std::stable_sort(order.begin(), order.end(),
+        [&](uint32_t a, uint32_t b) { return styles.priority[a] < styles.priority[b]; });
+
+    std::vector<labeled_point> result;
+    std::vector<std::pair<double, double>> offsets;
+    for (uint32_t i : order) {
+        const point_t& pt = input_points[i].first;
+        const double width = styles.width[i], height = styles.height[i];
+        offsets = styles.positions[i] == 8 ? eightOffsets(width, height) : cornerOffsets(width, height);
+        for (size_t j = 0; j < offsets.size(); ++j) {
+            point_t corner(bg::get<0>(pt) + offsets[j].first, bg::get<1>(pt) + offsets[j].second);
+            box_t candidate_box(corner, point_t(bg::get<0>(corner) + width, bg::get<1>(corner) + height));
+            if (index.findOverlap(candidate_box) == NO_OVERLAP) {
+                index.insert(candidate_box);
+                labeled_point lp;
+                lp.point = pt;
+                lp.label = input_points[i].second;
+                lp.label_box = candidate_box;
+                lp.offset_index = static_cast<uint8_t>(j);
+                result.push_back(lp);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// Greedy placement driven by evaluated styles: points in priority order
+// (ties in input order), each with its own box size and candidate set.
+// offset_index of a result refers to cornerOffsets or eightOffsets.
+std::vector<labeled_point> placeStyledLabels(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const styled_points& styles, collision_backend backend = collision_backend::wide_bvh) {
+    if (styles.rule.size() != input_points.size()) {
+        throw std::runtime_error("styles cover " + std::to_string(styles.rule.size()) + " of "
+            + std::to_string(input_points.size()) + " points");
+    }
+    if (backend == collision_backend::rtree) {
+        rtree_collision_index index;
+        return placeStyledLabelsWithIndex(input_points, styles, index);
+    }
+    if (backend == collision_backend::wide_bvh) {
+        wide_bvh index;
+        return placeStyledLabelsWithIndex(input_points, styles, index);
+    }
+    collision_index index;
+    return placeStyledLabelsWithIndex(input_points, styles, index);
+}
+
+// Icon plus text labels for POIs. A candidate places both boxes relative to
+// the anchor; when no candidate fits as a whole, the icon alone may stay. The
+// text box has the label's labelExtent, so its offset is given in part as a
+// share of that size.
+struct composite_candidate {
+    std::pair<double, double> icon_offset; // box min corners from the anchor
+    std::pair<double, double> text_offset;
+    std::pair<double, double> text_align;  // text box width and height shares subtracted from text_offset
+};
+
+struct composite_style {
+    double icon_size = 0.15;
+    std::vector<composite_candidate> candidates; // in preference order
+    bool allow_icon_only = true;
+};
+
+// Icon centred on the anchor with the text right of, left of, above or below it
+composite_style defaultCompositeStyle(double gap = 0.05) {
+    composite_style style;
+    const double half = style.icon_size / 2;
+    const std::pair<double, double> icon(-half, -half);
+    style.candidates = { { icon, { half + gap, 0.0 }, { 0.0, 0.5 } }, { icon, { -half - gap, 0.0 }, { 1.0, 0.5 } },
+        { icon, { 0.0, half + gap }, { 0.5, 0.0 } }, { icon, { 0.0, -half - gap }, { 0.5, 1.0 } } };
+    return style;
+}
+
+struct composite_label {
+    labeled_point text; // label_box is the text box; offset_index the candidate
+    box_t icon_box;
+    bool has_text = true; // false: icon-only fallback
+};
+
+struct pair_overlap {
+    bool first = false;
+    bool second = false;
+};
+
+// Which of two boxes collide with placed ones, in one traversal of the index
+// with their union. With need_both false it stops at the first hit, which is
+// all a caller needs once it knows the answer for the first box elsewhere.
+template <typename Index>
+pair_overlap findPairOverlap(const Index& index, const box_t& first, const box_t& second, bool need_both) {
+    box_t both = first;
+    bg::expand(both, second);
+    pair_overlap hit;
+    index.forEachOverlap(both, [&](size_t, const box_t& placed) {
+        hit.first = hit.first || bg::intersects(first, placed);
+        hit.second = hit.second || bg::intersects(second, placed);
+        return need_both ? hit.first && hit.second : hit.first || hit.second;
+    });
+    return hit;
+}
+
+template <typename Index>
+std::vector<composite_label> placeCompositeLabelsWithIndex(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const composite_style& style, Index& index) {
+    std::vector<composite_label> result;
+    auto offsetBox = [](const point_t& pt, const std::pair<double, double>& offset, double width, double height) {
+        point_t corner(bg::get<0>(pt) + offset.first, bg::get<1>(pt) + offset.second);
+        return box_t(corner, point_t(bg::get<0>(corner) + width, bg::get<1>(corner) + height));
+    };
+    for (const auto& input : input_points) {
+        const point_t& pt = input.first;
+        const label_extent text = labelExtent(input.second);
+        int fallback = -1; // first candidate whose icon is free
+        bool placed = false;
+        for (size_t j = 0; j < style.candidates.size() && !placed; ++j) {
+            const composite_candidate& candidate = style.candidates[j];
+            box_t icon_box = offsetBox(pt, candidate.icon_offset, style.icon_size, style.icon_size);
+            const std::pair<double, double> text_offset(candidate.text_offset.first - candidate.text_align.first * text.width,
+                candidate.text_offset.second - candidate.text_align.second * text.height);
+            box_t text_box = offsetBox(pt, text_offset, text.width, text.height);
+            // The icon state only matters until a fallback is known
+            pair_overlap hit = findPairOverlap(index, icon_box, text_box, style.allow_icon_only && fallback < 0);
+            if (!hit.first && !hit.second) {
+                index.insert(icon_box);
+                index.insert(text_box);
+                result.push_back(composite_label{ labeled_point{ pt, input.second, text_box, static_cast<uint8_t>(j) }, icon_box, true });
+                placed = true;
+            } else if (!hit.first && fallback < 0) {
+                fallback = static_cast<int>(j);
+            }
+        }
+        if (!placed && style.allow_icon_only && fallback >= 0) {
+            box_t icon_box = offsetBox(pt, style.candidates[fallback].icon_offset, style.icon_size, style.icon_size);
+            index.insert(icon_box);
+            result.push_back(composite_label{ labeled_point{ pt, input.second, icon_box, static_cast<uint8_t>(fallback) }, icon_box, false });
+        }
+    }
+    return result;
+}
+
+// Greedy placement of icon plus text POIs in input order. Each candidate costs
+// one index query for both boxes, and the icon-only fallback reuses the icon
+// results of those queries instead of querying again.
+std::vector<composite_label> placeCompositeLabels(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const composite_style& style = defaultCompositeStyle(), collision_backend backend = collision_backend::wide_bvh) {
+    if (backend == collision_backend::rtree) {
+        rtree_collision_index index;
+        return placeCompositeLabelsWithIndex(input_points, style, index);
+    }
+    if (backend == collision_backend::wide_bvh) {
+        wide_bvh index;
+        return placeCompositeLabelsWithIndex(input_points, style, index);
+    }
+    collision_index index;
+    return placeCompositeLabelsWithIndex(input_points, style, index);
+}
+
+// Greedy placement in input order with full label boxes in the result
+std::vector<labeled_point> placeLabels(const std::vector<std::pair<point_t, std::string>>& input_points,
+    placement_diagnostics* diagnostics = nullptr, collision_backend backend = collision_backend::linear) {
+    std::vector<compact_label> compact = placeLabelsCompact(input_points, diagnostics, backend);
+    std::vector<labeled_point> result;
+    result.reserve(compact.size());
+    for (compact_label label : compact) {
+        result.push_back(expandLabel(input_points, label));
+    }
+    return result;
+}
+
+// Pen start of a run centred in box, its descent included
+cv::Point centredTextOrigin(const cv::Rect& box, const text_run& run) {
+    return cv::Point(box.x + (box.width - run.size.width) / 2, box.y + (box.height - run.mask.rows) / 2 + run.size.height);
+}
+
+// Blend a run into a BGR image in colour, with its baseline start at org
+void drawTextRun(cv::Mat& image, const text_run& run, cv::Point org, const cv::Scalar& colour) {
+    const cv::Rect placed(org.x, org.y - run.size.height, run.mask.cols, run.mask.rows);
+    const cv::Rect visible = placed & cv::Rect(0, 0, image.cols, image.rows);
+    for (int y = visible.y; y < visible.y + visible.height; ++y) {
+        const uint8_t* alpha = run.mask.ptr<uint8_t>(y - placed.y);
+        uint8_t* pixel = image.ptr<uint8_t>(y);
+        for (int x = visible.x; x < visible.x + visible.width; ++x) {
+            const int a = alpha[x - placed.x];
+            if (!a) {
+                continue;
+            }
+            for (int c = 0; c < 3; ++c) {
+                uint8_t& v = pixel[3 * x + c];
+                v = static_cast<uint8_t>((v * (255 - a) + static_cast<int>(colour[c]) * a + 127) / 255);
+            }
+        }
+    }
+}
+
+// Convert from our coordinate system to image coordinates. Snapping uses floor
+// so every pixel column covers the same world interval, also left of zero.
+cv::Point worldToImage(const point_t& world_point, double scale, int image_size) {
+    int x = cvFloor(bg::get<0>(world_point) * scale);
+    int y = image_size - cvFloor(bg::get<1>(world_point) * scale); // Flip Y axis
+    return cv::Point(x, y);
+}
+
+// Get image coordinates for a box
+cv::Rect worldBoxToImageRect(const box_t& box, double scale, int image_size) {
+    cv::Point top_left = worldToImage(box.min_corner(), scale, image_size);
+    cv::Point bottom_right = worldToImage(box.max_corner(), scale, image_size);
+    return cv::Rect(top_left, bottom_right);
+}
+
+// Integer pixel rectangle, half-open like cv::Rect: [x0, x1) x [y0, y1)
+struct pixel_rect {
+    int32_t x0, y0, x1, y1;
+};
+
+// Placed pixel rectangles in SoA form so the collision kernel can load one
+// coordinate of several rectangles with a single instruction
+struct pixel_rect_columns {
+    huge_vector<int32_t> x0, y0, x1, y1;
+
+    size_t size() const { return x0.size(); }
+    void push_back(const pixel_rect& r) {
+        x0.push_back(r.x0);
+        y0.push_back(r.y0);
+        x1.push_back(r.x1);
+        y1.push_back(r.y1);
+    }
+};
+
+pixel_rect toPixelRect(const cv::Rect& r) {
+    return pixel_rect{ r.x, r.y, r.x + r.width, r.y + r.height };
+}
+
+// Index of the first placed rectangle sharing at least one pixel with r, or
+// NO_OVERLAP. Compares 8 (AVX2) or 4 (SSE2) rectangles per step in int32.
+size_t findPixelOverlap(const pixel_rect& r, const pixel_rect_columns& placed) {
+    const size_t n = placed.size();
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i rx0 = _mm256_set1_epi32(r.x0), ry0 = _mm256_set1_epi32(r.y0);
+    const __m256i rx1 = _mm256_set1_epi32(r.x1), ry1 = _mm256_set1_epi32(r.y1);
+    for (; i + 8 <= n; i += 8) {
+        __m256i px0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(placed.x0.data() + i));
+        __m256i py0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(placed.y0.data() + i));
+        __m256i px1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(placed.x1.data() + i));
+        __m256i py1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(placed.y1.data() + i));
+        // r.x0 < px1 && px0 < r.x1 && r.y0 < py1 && py0 < r.y1
+        __m256i hit = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(px1, rx0), _mm256_cmpgt_epi32(rx1, px0)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(py1, ry0), _mm256_cmpgt_epi32(ry1, py0)));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(hit)));
+        if (mask) {
+            return i + lowestSetBit(mask);
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128i rx0 = _mm_set1_epi32(r.x0), ry0 = _mm_set1_epi32(r.y0);
+    const __m128i rx1 = _mm_set1_epi32(r.x1), ry1 = _mm_set1_epi32(r.y1);
+    for (; i + 4 <= n; i += 4) {
+        __m128i px0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(placed.x0.data() + i));
+        __m128i py0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(placed.y0.data() + i));
+        __m128i px1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(placed.x1.data() + i));
+        __m128i py1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(placed.y1.data() + i));
+        __m128i hit = _mm_and_si128(
+            _mm_and_si128(_mm_cmplt_epi32(rx0, px1), _mm_cmplt_epi32(px0, rx1)),
+            _mm_and_si128(_mm_cmplt_epi32(ry0, py1), _mm_cmplt_epi32(py0, ry1)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(hit)));
+        if (mask) {
+            return i + lowestSetBit(mask);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (r.x0 < placed.x1[i] && placed.x0[i] < r.x1 && r.y0 < placed.y1[i] && placed.y0[i] < r.y1) {
+            return i;
+        }
+    }
+    return NO_OVERLAP;
+}
+
+// Placed pixel rectangles on a sparse grid of PIXEL_GRID_CELL pixel cells.
+// A rectangle is stored in every cell it covers, as SoA columns for
+// findPixelOverlap plus its placement index, so a query only scans the
+// rectangles of the few cells under the candidate. An empty rectangle
+// covers the cell of its corner, which keeps the answers of the flat kernel.
+const int32_t PIXEL_GRID_CELL = 64;
+
+class pixel_rect_grid {
+public:
+    // Placement index of a stored rectangle sharing a pixel with r, or NO_OVERLAP
+    size_t findOverlap(const pixel_rect& r) const {
+        const int32_t cx0 = cellOf(r.x0), cx1 = cellOf(std::max(r.x0, r.x1 - 1));
+        const int32_t cy0 = cellOf(r.y0), cy1 = cellOf(std::max(r.y0, r.y1 - 1));
+        for (int32_t cy = cy0; cy <= cy1; ++cy) {
+            for (int32_t cx = cx0; cx <= cx1; ++cx) {
+                auto it = cells_.find(viewTileKey(cx, cy));
+                if (it == cells_.end()) {
+                    continue;
+                }
+                size_t hit = findPixelOverlap(r, it->second.rects);
+                if (hit != NO_OVERLAP) {
+                    return it->second.ids[hit];
+                }
+            }
+        }
+        return NO_OVERLAP;
+    }
+
+    void insert(const pixel_rect& r) {
+        const int32_t cx0 = cellOf(r.x0), cx1 = cellOf(std::max(r.x0, r.x1 - 1));
+        const int32_t cy0 = cellOf(r.y0), cy1 = cellOf(std::max(r.y0, r.y1 - 1));
+        for (int32_t cy = cy0; cy <= cy1; ++cy) {
+            for (int32_t cx = cx0; cx <= cx1; ++cx) {
+                cell& c = cells_[viewTileKey(cx, cy)];
+                c.rects.push_back(r);
+                c.ids.push_back(count_);
+            }
+        }
+        ++count_;
+    }
+
+    size_t size() const { return count_; }
+
+private:
+    struct cell {
+        pixel_rect_columns rects;
+        std::vector<uint32_t> ids; // placement index of each rectangle
+    };
+
+    static int32_t cellOf(int32_t v) {
+        return static_cast<int32_t>((static_cast<int64_t>(v) - (v < 0 ? PIXEL_GRID_CELL - 1 : 0)) / PIXEL_GRID_CELL);
+    }
+
+    std::unordered_map<uint64_t, cell> cells_;
+    uint32_t count_ = 0;
+};
+
+// Point coordinates in SoA form for the batch transform kernels
+struct point_columns {
+    huge_vector<double> x, y;
+
+    size_t size() const { return x.size(); }
+};
+
+point_columns toPointColumns(const std::vector<std::pair<point_t, std::string>>& input_points) {
+    point_columns columns;
+    columns.x.resize(input_points.size());
+    columns.y.resize(input_points.size());
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        columns.x[i] = bg::get<0>(input_points[i].first);
+        columns.y[i] = bg::get<1>(input_points[i].first);
+    }
+    return columns;
+}
+
+const double EARTH_RADIUS = 6378137.0;        // WGS84 semi-major axis, metres
+const double MERCATOR_MAX_LAT = 85.0511287798; // latitude where Web Mercator becomes square
+
+// Web Mercator y is R * ln(tan(pi/4 + lat/2)) = R/2 * ln((1 + s) / (1 - s))
+// with s = sin(lat). Both steps are polynomials here, so SIMD lanes can run
+// them without a vector math library: sin is its Taylor series to x^19
+// (|lat| <= 1.4845 rad, truncation below 2e-15), and ln splits q = m * 2^e
+// with m in [sqrt(1/2), sqrt(2)] and sums the atanh series of
+// z = (m - 1) / (m + 1) to z^21 (|z| <= 0.172, truncation below 1e-17).
+// Over the clamped latitude range the result is within 1e-6 m of
+// EARTH_RADIUS * std::log(std::tan(...)); the error grows towards the clamp,
+// where 1 - s is smallest.
+const std::array<double, 10> MERCATOR_SIN_TERMS = { { 1.0, -1.0 / 6.0, 1.0 / 120.0, -1.0 / 5040.0, 1.0 / 362880.0,
+    -1.0 / 39916800.0, 1.0 / 6227020800.0, -1.0 / 1307674368000.0, 1.0 / 355687428096000.0, -1.0 / 121645100408832000.0 } };
+const double LN_2 = 0.69314718055994530942;
+const double SQRT_2 = 1.41421356237309504880;
+
+// Scalar form of the SIMD Mercator y below, for the tail lanes
+double mercatorY(double lat_degrees) {
+    const double lat = std::max(-MERCATOR_MAX_LAT, std::min(MERCATOR_MAX_LAT, lat_degrees)) * (3.14159265358979323846 / 180.0);
+    const double x2 = lat * lat;
+    double p = MERCATOR_SIN_TERMS[9];
+    for (size_t t = 9; t-- > 0;) {
+        p = p * x2 + MERCATOR_SIN_TERMS[t];
+    }
+    const double s = lat * p;
+    int e;
+    double m = 2.0 * std::frexp((1.0 + s) / (1.0 - s), &e); // [1, 2)
+    double exponent = e - 1;
+    if (m > SQRT_2) {
+        m *= 0.5;
+        exponent += 1.0;
+    }
+    const double z = (m - 1.0) / (m + 1.0), z2 = z * z;
+    double series = 1.0 / 21.0;
+    for (int t = 19; t >= 1; t -= 2) {
+        series = series * z2 + 1.0 / t;
+    }
+    return EARTH_RADIUS * 0.5 * (exponent * LN_2 + 2.0 * z * series);
+}
+
+// WGS84 lon/lat degrees to Web Mercator (EPSG:3857) metres, in place. Longitude
+// is a single multiply, 4 (AVX) or 2 (SSE2) lanes at a time. Latitude runs
+// mercatorY 4 (AVX2) or 2 (SSE2) lanes at a time; the exponent of q is read
+// from its bits and turned into a double with the 2^52 trick, which needs
+// only 64-bit shifts and ors.
+void lonLatToMercator(point_columns& columns) {
+    const size_t n = columns.size();
+    const double x_factor = EARTH_RADIUS * 3.14159265358979323846 / 180.0;
+    double* x = columns.x.data();
+    size_t i = 0;
+#if defined(__AVX__)
+    const __m256d f4 = _mm256_set1_pd(x_factor);
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), f4));
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    const __m128d f2 = _mm_set1_pd(x_factor);
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), f2));
+    }
+#endif
+    for (; i < n; ++i) {
+        x[i] *= x_factor;
+    }
+
+    double* y = columns.y.data();
+    size_t k = 0;
+    const double rad = 3.14159265358979323846 / 180.0;
+    const int64_t MANTISSA_BITS = 0x000fffffffffffffLL, ONE_BITS = 0x3ff0000000000000LL, TWO_52_BITS = 0x4330000000000000LL;
+    const double exponent_bias = 4503599627370496.0 + 1023.0; // 2^52 + bias
+#if defined(__AVX2__)
+    {
+        const __m256d lo = _mm256_set1_pd(-MERCATOR_MAX_LAT), hi = _mm256_set1_pd(MERCATOR_MAX_LAT), rad4 = _mm256_set1_pd(rad);
+        const __m256d one = _mm256_set1_pd(1.0), half = _mm256_set1_pd(0.5), sqrt2 = _mm256_set1_pd(SQRT_2);
+        const __m256i mantissa = _mm256_set1_epi64x(MANTISSA_BITS), one_bits = _mm256_set1_epi64x(ONE_BITS);
+        const __m256i two52 = _mm256_set1_epi64x(TWO_52_BITS);
+        for (; k + 4 <= n; k += 4) {
+            const __m256d lat = _mm256_mul_pd(_mm256_max_pd(_mm256_min_pd(_mm256_loadu_pd(y + k), hi), lo), rad4);
+            const __m256d x2 = _mm256_mul_pd(lat, lat);
+            __m256d p = _mm256_set1_pd(MERCATOR_SIN_TERMS[9]);
+            for (size_t t = 9; t-- > 0;) {
+                p = _mm256_add_pd(_mm256_mul_pd(p, x2), _mm256_set1_pd(MERCATOR_SIN_TERMS[t]));
+            }
+            const __m256d s = _mm256_mul_pd(lat, p);
+            const __m256i bits = _mm256_castpd_si256(_mm256_div_pd(_mm256_add_pd(one, s), _mm256_sub_pd(one, s)));
+            __m256d exponent = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(_mm256_srli_epi64(bits, 52), two52)),
+                _mm256_set1_pd(exponent_bias));
+            __m256d m = _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(bits, mantissa), one_bits));
+            const __m256d big = _mm256_cmp_pd(m, sqrt2, _CMP_GT_OQ);
+            m = _mm256_sub_pd(m, _mm256_and_pd(big, _mm256_mul_pd(m, half)));
+            exponent = _mm256_add_pd(exponent, _mm256_and_pd(big, one));
+            const __m256d z = _mm256_div_pd(_mm256_sub_pd(m, one), _mm256_add_pd(m, one)), z2 = _mm256_mul_pd(z, z);
+            __m256d series = _mm256_set1_pd(1.0 / 21.0);
+            for (int t = 19; t >= 1; t -= 2) {
+                series = _mm256_add_pd(_mm256_mul_pd(series, z2), _mm256_set1_pd(1.0 / t));
+            }
+            const __m256d ln = _mm256_add_pd(_mm256_mul_pd(exponent, _mm256_set1_pd(LN_2)),
+                _mm256_mul_pd(_mm256_add_pd(z, z), series));
+            _mm256_storeu_pd(y + k, _mm256_mul_pd(ln, _mm256_set1_pd(EARTH_RADIUS * 0.5)));
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    {
+        const __m128d lo = _mm_set1_pd(-MERCATOR_MAX_LAT), hi = _mm_set1_pd(MERCATOR_MAX_LAT), rad2 = _mm_set1_pd(rad);
+        const __m128d one = _mm_set1_pd(1.0), half = _mm_set1_pd(0.5), sqrt2 = _mm_set1_pd(SQRT_2);
+        const __m128i mantissa = _mm_set1_epi64x(MANTISSA_BITS), one_bits = _mm_set1_epi64x(ONE_BITS);
+        const __m128i two52 = _mm_set1_epi64x(TWO_52_BITS);
+        for (; k + 2 <= n; k += 2) {
+            const __m128d lat = _mm_mul_pd(_mm_max_pd(_mm_min_pd(_mm_loadu_pd(y + k), hi), lo), rad2);
+            const __m128d x2 = _mm_mul_pd(lat, lat);
+            __m128d p = _mm_set1_pd(MERCATOR_SIN_TERMS[9]);
+            for (size_t t = 9; t-- > 0;) {
+                p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(MERCATOR_SIN_TERMS[t]));
+            }
+            const __m128d s = _mm_mul_pd(lat, p);
+            const __m128i bits = _mm_castpd_si128(_mm_div_pd(_mm_add_pd(one, s), _mm_sub_pd(one, s)));
+            __m128d exponent = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(_mm_srli_epi64(bits, 52), two52)),
+                _mm_set1_pd(exponent_bias));
+            __m128d m = _mm_castsi128_pd(_mm_or_si128(_mm_and_si128(bits, mantissa), one_bits));
+            const __m128d big = _mm_cmpgt_pd(m, sqrt2);
+            m = _mm_sub_pd(m, _mm_and_pd(big, _mm_mul_pd(m, half)));
+            exponent = _mm_add_pd(exponent, _mm_and_pd(big, one));
+            const __m128d z = _mm_div_pd(_mm_sub_pd(m, one), _mm_add_pd(m, one)), z2 = _mm_mul_pd(z, z);
+            __m128d series = _mm_set1_pd(1.0 / 21.0);
+            for (int t = 19; t >= 1; t -= 2) {
+                series = _mm_add_pd(_mm_mul_pd(series, z2), _mm_set1_pd(1.0 / t));
+            }
+            const __m128d ln = _mm_add_pd(_mm_mul_pd(exponent, _mm_set1_pd(LN_2)), _mm_mul_pd(_mm_add_pd(z, z), series));
+            _mm_storeu_pd(y + k, _mm_mul_pd(ln, _mm_set1_pd(EARTH_RADIUS * 0.5)));
+        }
+    }
+#endif
+    for (; k < n; ++k) {
+        y[k] = mercatorY(y[k]);
+    }
+}
+
+// Batch form of worldToImage for translated points: px = floor((x + dx) * scale),
+// py = image_size - floor((y + dy) * scale), bit-identical to the scalar path.
+void worldToImageBatch(const double* x, const double* y, size_t n, double dx, double dy,
+    double scale, int image_size, int32_t* px, int32_t* py) {
+    size_t i = 0;
+#if defined(__AVX__)
+    const __m256d s4 = _mm256_set1_pd(scale), dx4 = _mm256_set1_pd(dx), dy4 = _mm256_set1_pd(dy);
+    const __m128i size4 = _mm_set1_epi32(image_size);
+    for (; i + 4 <= n; i += 4) {
+        __m256d vx = _mm256_floor_pd(_mm256_mul_pd(_mm256_add_pd(_mm256_loadu_pd(x + i), dx4), s4));
+        __m256d vy = _mm256_floor_pd(_mm256_mul_pd(_mm256_add_pd(_mm256_loadu_pd(y + i), dy4), s4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(px + i), _mm256_cvttpd_epi32(vx));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(py + i), _mm_sub_epi32(size4, _mm256_cvttpd_epi32(vy)));
+    }
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    // SSE2 has no floor: truncate, then step down where truncation rounded up
+    const __m128d s2 = _mm_set1_pd(scale), dx2 = _mm_set1_pd(dx), dy2 = _mm_set1_pd(dy);
+    const __m128i size2 = _mm_set1_epi32(image_size);
+    auto floor2 = [](__m128d v) {
+        __m128i t = _mm_cvttpd_epi32(v);
+        __m128d above = _mm_cmpgt_pd(_mm_cvtepi32_pd(t), v);
+        return _mm_add_epi32(t, _mm_shuffle_epi32(_mm_castpd_si128(above), _MM_SHUFFLE(3, 3, 2, 0)));
+    };
+    for (; i + 2 <= n; i += 2) {
+        __m128i fx = floor2(_mm_mul_pd(_mm_add_pd(_mm_loadu_pd(x + i), dx2), s2));
+        __m128i fy = floor2(_mm_mul_pd(_mm_add_pd(_mm_loadu_pd(y + i), dy2), s2));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(px + i), fx);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(py + i), _mm_sub_epi32(size2, fy));
+    }
+#endif
+    for (; i < n; ++i) {
+        px[i] = cvFloor((x[i] + dx) * scale);
+        py[i] = image_size - cvFloor((y[i] + dy) * scale);
+    }
+}
+
+// Image-space coordinates of one input set at one (scale, image_size). The
+// renderer and the pixel-aligned placer both read from it, so every point is
+// transformed once per view. A cache belongs to one input: it is keyed on a
+// generation counter, not on the vector's address, so call invalidate()
+// after modifying the points or before using the cache for other points.
+struct image_coordinate_cache {
+    uint64_t generation = 1;        // bumped by invalidate()
+    uint64_t filled_generation = 0; // generation the arrays below were built at
+    double scale = 0.0;
+    int image_size = 0;
+
+    point_columns world;                          // SoA copy of the input points
+    huge_vector<int32_t> anchor_x, anchor_y;      // worldToImage of every point
+    std::array<pixel_rect_columns, 4> candidates; // worldBoxToImageRect per offset, filled on demand
+    std::vector<label_extent> extents;            // labelExtent of every label, filled with candidates
+    double max_reach = LABEL_GAP;                 // largest labelReach among them
+
+    void invalidate() { ++generation; }
+};
+
+void updateImageCoordinates(image_coordinate_cache& cache,
+    const std::vector<std::pair<point_t, std::string>>& input_points, double scale, int image_size) {
+    if (cache.filled_generation == cache.generation && cache.scale == scale && cache.image_size == image_size) {
+        return;
+    }
+    cache.filled_generation = cache.generation;
+    cache.scale = scale;
+    cache.image_size = image_size;
+    cache.world = toPointColumns(input_points);
+    cache.anchor_x.resize(input_points.size());
+    cache.anchor_y.resize(input_points.size());
+    worldToImageBatch(cache.world.x.data(), cache.world.y.data(), cache.world.size(), 0.0, 0.0,
+        scale, image_size, cache.anchor_x.data(), cache.anchor_y.data());
+    for (auto& columns : cache.candidates) {
+        columns = pixel_rect_columns();
+    }
+    cache.extents.clear();
+}
+
+// Label extents and pixel rectangles of every candidate box, matching
+// worldBoxToImageRect(candidateBox(...)); input_points must be the points
+// the cache was filled from
+void ensureCandidateRects(image_coordinate_cache& cache, const std::vector<std::pair<point_t, std::string>>& input_points) {
+    const size_t n = cache.world.size();
+    if (n == 0 || cache.candidates[0].size() == n) {
+        return;
+    }
+    cache.extents = measureLabels(input_points, &cache.max_reach);
+    std::vector<double> corner_x(n), corner_y(n);
+    for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+        pixel_rect_columns& rects = cache.candidates[j];
+        rects.x0.resize(n);
+        rects.y0.resize(n);
+        rects.x1.resize(n);
+        rects.y1.resize(n);
+        // Corners are computed exactly as candidateBox does; the min corner
+        // maps to the left and bottom edge (y flips)
+        for (size_t i = 0; i < n; ++i) {
+            corner_x[i] = cache.world.x[i] + candidateOffsetX(j, cache.extents[i].width);
+            corner_y[i] = cache.world.y[i] + candidateOffsetY(j, cache.extents[i].height);
+        }
+        worldToImageBatch(corner_x.data(), corner_y.data(), n, 0.0, 0.0,
+            cache.scale, cache.image_size, rects.x0.data(), rects.y1.data());
+        for (size_t i = 0; i < n; ++i) {
+            corner_x[i] += cache.extents[i].width;
+            corner_y[i] += cache.extents[i].height;
+        }
+        worldToImageBatch(corner_x.data(), corner_y.data(), n, 0.0, 0.0,
+            cache.scale, cache.image_size, rects.x1.data(), rects.y0.data());
+    }
+}
+
+// Pixel-aligned placement: candidates are snapped exactly as the renderer's
+// worldBoxToImageRect would and collide in integer pixel space on a
+// pixel_rect_grid, so placed boxes never share a pixel on screen. Boxes that merely touch in world space
+// may both be placed here, unlike with bg::intersects. Candidate rectangles
+// come from the shared coordinate cache when one is passed; rejections are
+// recorded against the world candidate box like in placeLabelsWithIndex.
+std::vector<labeled_point> placeLabelsPixelAligned(const std::vector<std::pair<point_t, std::string>>& input_points,
+    double scale, int image_size, image_coordinate_cache* coords = nullptr, placement_diagnostics* diagnostics = nullptr) {
+    image_coordinate_cache local_coords;
+    image_coordinate_cache& cache = coords ? *coords : local_coords;
+    updateImageCoordinates(cache, input_points, scale, image_size);
+    ensureCandidateRects(cache, input_points);
+    if (diagnostics) {
+        initDiagnostics(*diagnostics, input_points, cache.max_reach);
+    }
+
+    std::vector<labeled_point> result;
+    pixel_rect_grid placed;
+
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        bool was_placed = false;
+        for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+            const pixel_rect_columns& rects = cache.candidates[j];
+            pixel_rect candidate{ rects.x0[i], rects.y0[i], rects.x1[i], rects.y1[i] };
+            size_t blocker = placed.findOverlap(candidate);
+            if (blocker == NO_OVERLAP) {
+                placed.insert(candidate);
+                const auto& input = input_points[i];
+                result.push_back(labeled_point{ input.first, input.second, candidateBox(input.first, j, cache.extents[i]),
+                    static_cast<uint8_t>(j) });
+                was_placed = true;
+                break;
+            }
+            if (diagnostics) {
+                recordRejection(*diagnostics, candidateBox(input_points[i].first, j, cache.extents[i]), blocker);
+            }
+        }
+        if (diagnostics) {
+            if (was_placed) {
+                diagnostics->blocked_by.push_back(0);
+            } else {
+                ++diagnostics->unplaced_points;
+            }
+        }
+    }
+    return result;
+}
+
+// Blend a congestion heatmap of rejected candidates over the image. Cell counts
+// are accumulated into a float buffer, smoothed, normalized and colour mapped;
+// pixels without any rejections are left untouched.
+void overlayCongestionHeatmap(cv::Mat& image, const placement_diagnostics& diagnostics,
+    double scale, int image_size) {
+    cv::Mat heat = cv::Mat::zeros(image.rows, image.cols, CV_32F);
+    const cv::Rect image_rect(0, 0, image.cols, image.rows);
+    for (int gy = 0; gy < diagnostics.grid_height; ++gy) {
+        for (int gx = 0; gx < diagnostics.grid_width; ++gx) {
+            float count = diagnostics.congestion[static_cast<size_t>(gy) * diagnostics.grid_width + gx];
+            if (count <= 0.0f) {
+                continue;
+            }
+            box_t cell(point_t(diagnostics.origin_x + gx * diagnostics.cell_size, diagnostics.origin_y + gy * diagnostics.cell_size),
+                point_t(diagnostics.origin_x + (gx + 1) * diagnostics.cell_size, diagnostics.origin_y + (gy + 1) * diagnostics.cell_size));
+            cv::Rect cell_rect = worldBoxToImageRect(cell, scale, image_size) & image_rect;
+            if (!cell_rect.empty()) {
+                heat(cell_rect).setTo(cv::Scalar(count));
+            }
+        }
+    }
+
+    double max_heat = 0.0;
+    cv::minMaxLoc(heat, nullptr, &max_heat);
+    if (max_heat <= 0.0) {
+        return;
+    }
+    cv::GaussianBlur(heat, heat, cv::Size(0, 0), std::max(1.0, diagnostics.cell_size * scale / 3.0));
+
+    cv::Mat mask;
+    cv::threshold(heat, mask, max_heat * 0.02, 255.0, cv::THRESH_BINARY);
+    mask.convertTo(mask, CV_8U);
+
+    cv::Mat heat8u, colored, blended;
+    cv::normalize(heat, heat8u, 0, 255, cv::NORM_MINMAX, CV_8U);
+    cv::applyColorMap(heat8u, colored, cv::COLORMAP_JET);
+    cv::addWeighted(colored, 0.5, image, 0.5, 0, blended);
+    blended.copyTo(image, mask);
+}
+
+// How placed labels are drawn. Decorations are the green box outline and the
+// text background; they reach past the ink, so placements that only keep the
+// ink apart (--glyph-masks) turn them off to avoid drawing over neighbours.
+//
+// Icons are the POI icons of a composite placement (--icons), each with its
+// anchor; their anchors count as placed whether or not the text fitted.
+struct placement_render_options {
+    bool decorations = true;
+    std::vector<std::pair<point_t, box_t>> icons; // anchor and icon box
+};
+
+const cv::Scalar ICON_COLOUR(0, 140, 255); // orange
+
+// Placed POI icons of a composite placement, for placement_render_options::icons
+std::vector<std::pair<point_t, box_t>> compositeIcons(const std::vector<composite_label>& pois) {
+    std::vector<std::pair<point_t, box_t>> icons;
+    icons.reserve(pois.size());
+    for (const composite_label& poi : pois) {
+        icons.emplace_back(poi.text.point, poi.icon_box);
+    }
+    return icons;
+}
+
+// Draw the placement into a new image; with diagnostics, a congestion heatmap
+// is overlaid. Point positions come from the shared coordinate cache when one
+// is passed.
+cv::Mat renderPlacementImage(const std::vector<labeled_point>& placed_labels,
+    const std::vector<std::pair<point_t, std::string>>& all_points,
+    const placement_diagnostics* diagnostics = nullptr,
+    image_coordinate_cache* coords = nullptr, cv::Mat* frame = nullptr,
+    const placement_render_options& options = placement_render_options()) {
+    const int POINT_RADIUS = 6;
+
+    image_coordinate_cache local_coords;
+    image_coordinate_cache& cache = coords ? *coords : local_coords;
+    updateImageCoordinates(cache, all_points, SCALE, IMAGE_SIZE);
+
+    // Create a white image, in the caller's buffer when one is given
+    cv::Mat image;
+    if (frame) {
+        frame->create(IMAGE_SIZE, IMAGE_SIZE, CV_8UC3);
+        frame->setTo(cv::Scalar(255, 255, 255));
+        image = *frame;
+    } else {
+        image = cv::Mat(IMAGE_SIZE, IMAGE_SIZE, CV_8UC3, cv::Scalar(255, 255, 255));
+    }
+
+    // First draw all potential points in light gray
+    for (size_t i = 0; i < all_points.size(); ++i) {
+        cv::Point img_point(cache.anchor_x[i], cache.anchor_y[i]);
+        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(200, 200, 200), -1);
+    }
+
+    if (diagnostics) {
+        overlayCongestionHeatmap(image, *diagnostics, SCALE, IMAGE_SIZE);
+    }
+
+    // POI icons under the labels, with their anchors in blue
+    for (const auto& icon : options.icons) {
+        cv::Rect icon_rect = worldBoxToImageRect(icon.second, SCALE, IMAGE_SIZE);
+        cv::rectangle(image, icon_rect, ICON_COLOUR, -1);
+        cv::rectangle(image, icon_rect, cv::Scalar(0, 0, 0), 1);
+        cv::Point img_point = worldToImage(icon.first, SCALE, IMAGE_SIZE);
+        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(255, 0, 0), -1);
+        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 0), 1);
+    }
+
+    // Draw successfully placed labels
+    for (const auto& lp : placed_labels) {
+        // Draw the point in blue
+        cv::Point img_point = worldToImage(lp.point, SCALE, IMAGE_SIZE);
+        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(255, 0, 0), -1);
+        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 0), 1); // Black border
+
+        // Draw the label box in green
+        cv::Rect box_rect = worldBoxToImageRect(lp.label_box, SCALE, IMAGE_SIZE);
+        if (options.decorations) {
+            cv::rectangle(image, box_rect, cv::Scalar(0, 255, 0), 2);
+        }
+
+        // Draw connection line from point to label box center
+        cv::Point box_center(box_rect.x + box_rect.width / 2, box_rect.y + box_rect.height / 2);
+        cv::line(image, img_point, box_center, cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
+
+        // Put the label text centered inside the box, which was sized from this run
+        const text_run& run = text_run_cache::instance().get(lp.label);
+        const cv::Point text_org = centredTextOrigin(box_rect, run);
+
+        // Draw semi-transparent background for text. Blending only the covered
+        // rectangle gives the same result as blending a full overlay copy.
+        cv::Rect background(text_org.x - LABEL_PADDING, text_org.y - run.size.height - LABEL_PADDING,
+            run.mask.cols + 2 * LABEL_PADDING, run.mask.rows + 2 * LABEL_PADDING);
+        background = background & cv::Rect(0, 0, image.cols, image.rows);
+        if (options.decorations && !background.empty()) {
+            cv::Mat roi = image(background);
+            roi.convertTo(roi, -1, 0.3, 255 * 0.7);
+        }
+
+        // Draw the text
+        drawTextRun(image, run, text_org, cv::Scalar(0, 0, 0));
+    }
+
+    // Draw unlabeled points in red; placed anchors are looked up in sorted order
+    std::vector<std::pair<double, double>> labeled_anchors;
+    labeled_anchors.reserve(placed_labels.size() + options.icons.size());
+    for (const auto& lp : placed_labels) {
+        labeled_anchors.emplace_back(bg::get<0>(lp.point), bg::get<1>(lp.point));
+    }
+    for (const auto& icon : options.icons) {
+        labeled_anchors.emplace_back(bg::get<0>(icon.first), bg::get<1>(icon.first));
+    }
+    std::sort(labeled_anchors.begin(), labeled_anchors.end());
+    for (size_t i = 0; i < all_points.size(); ++i) {
+        bool has_label = std::binary_search(labeled_anchors.begin(), labeled_anchors.end(),
+            std::make_pair(bg::get<0>(all_points[i].first), bg::get<1>(all_points[i].first)));
+        if (!has_label) {
+            cv::Point img_point(cache.anchor_x[i], cache.anchor_y[i]);
+            cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 255), -1);
+            cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 0), 1); // Black border
+        }
+    }
+
+    // Add legend
+    cv::putText(image, "Blue: Labeled points", cv::Point(20, 30),
+        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255, 0, 0), 2);
+    cv::putText(image, "Red: Unlabeled points (overlap)", cv::Point(20, 55),
+        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 2);
+    cv::putText(image, "Green: Label boxes", cv::Point(20, 80),
+        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 255, 0), 2);
+    cv::putText(image, "Red lines: Point-label connections", cv::Point(20, 105),
+        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 2);
+    if (!options.icons.empty()) {
+        cv::putText(image, "Orange: POI icons", cv::Point(20, 130),
+            cv::FONT_HERSHEY_SIMPLEX, 0.5, ICON_COLOUR, 2);
+    }
+
+    // Add title
+    cv::putText(image, "Automatic Label Placement Algorithm", cv::Point(IMAGE_SIZE / 2 - 180, 30),
+        cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 0, 0), 2);
+    return image;
+}
+
+// Bulk file I/O. Writing many small files costs an open, a write and a close
+// syscall each; with io_uring a whole batch of opens is submitted with one
+// syscall, then all writes, then all closes, and large reads keep several
+// chunk reads in flight. Without io_uring (older kernels, other systems, or
+// when switched off) the same calls run as plain POSIX or iostream I/O.
+enum class io_backend { posix, io_uring };
+
+// Process-wide setting, read when a thread first uses bulk I/O
+inline io_backend& ioBackend() {
+    static io_backend backend = io_backend::posix;
+    return backend;
+}
+
+// One file to create or replace, written from consecutive pieces
+struct file_write {
+    std::string path;
+    std::vector<std::pair<const uint8_t*, size_t>> parts;
+};
+
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+// Minimal io_uring ring over the raw syscalls: batches of operations are
+// queued, submitted together and waited for as a group
+class io_ring {
+public:
+    explicit io_ring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            return;
+        }
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        sq_ring_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_
+            : mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED || sqes == MAP_FAILED) {
+            if (sqes != MAP_FAILED) {
+                munmap(sqes, sqes_size_);
+            }
+            release();
+            return;
+        }
+        char* sq = static_cast<char*>(sq_ring_);
+        char* cq = static_cast<char*>(cq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
+        entries_ = params.sq_entries;
+    }
+
+    ~io_ring() {
+        if (sqes_) {
+            munmap(sqes_, sqes_size_);
+        }
+        release();
+    }
+
+    io_ring(const io_ring&) = delete;
+    io_ring& operator=(const io_ring&) = delete;
+
+    bool available() const { return sqes_ != nullptr; }
+
+    // Whether the kernel implements opcode, from IORING_REGISTER_PROBE. Kernels
+    // without the probe predate the file opcodes too, so they report false.
+    bool supports(uint8_t opcode) const {
+        const unsigned count = 256;
+        std::vector<uint8_t> buffer(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, count) < 0 || opcode > probe->last_op) {
+            return false;
+        }
+        return (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    // Run every operation; results[k] receives the cqe result of ops[k]
+    // (negative errno on failure). Returns false if the ring itself failed.
+    bool run(std::vector<io_uring_sqe>& ops, std::vector<int>& results) {
+        results.assign(ops.size(), -ECANCELED);
+        for (size_t first = 0; first < ops.size(); first += entries_) {
+            const unsigned batch = static_cast<unsigned>(std::min<size_t>(entries_, ops.size() - first));
+            unsigned tail = *sq_tail_;
+            for (unsigned k = 0; k < batch; ++k) {
+                const unsigned slot = (tail + k) & sq_mask_;
+                sqes_[slot] = ops[first + k];
+                sqes_[slot].user_data = first + k;
+                sq_array_[slot] = slot;
+            }
+            __atomic_store_n(sq_tail_, tail + batch, __ATOMIC_RELEASE);
+
+            unsigned submitted = 0, completed = 0;
+            while (completed < batch) {
+                const unsigned to_submit = batch - submitted;
+                long r = syscall(__NR_io_uring_enter, fd_, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (r < 0 && errno != EINTR) {
+                    return false;
+                }
+                if (r > 0) {
+                    submitted += static_cast<unsigned>(r);
+                }
+                unsigned head = *cq_head_;
+                const unsigned cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+                for (; head != cq_tail; ++head, ++completed) {
+                    const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+                    results[cqe.user_data] = cqe.res;
+                }
+                __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            }
+        }
+        return true;
+    }
+
+private:
+    void release() {
+        if (cq_ring_ && cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            munmap(cq_ring_, cq_size_);
+        }
+        if (sq_ring_ && sq_ring_ != MAP_FAILED) {
+            munmap(sq_ring_, sq_size_);
+        }
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        sq_ring_ = cq_ring_ = nullptr;
+        fd_ = -1;
+    }
+
+    int fd_ = -1;
+    unsigned entries_ = 0;
+    size_t sq_size_ = 0, cq_size_ = 0, sqes_size_ = 0;
+    void* sq_ring_ = nullptr;
+    void* cq_ring_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+};
+#endif
+
+// Per-thread bulk I/O front end. Rings are not shared between threads; each
+// thread gets its own through threadBulkIo().
+class bulk_io {
+public:
+    static constexpr unsigned RING_ENTRIES = 256;
+    static constexpr size_t READ_CHUNK = size_t(4) << 20;
+    static constexpr size_t MAX_WRITE = size_t(1) << 30; // per write operation
+
+    explicit bulk_io(io_backend backend) {
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+        if (backend == io_backend::io_uring) {
+            ring_.reset(new io_ring(RING_ENTRIES));
+            if (!ring_->available() || !ring_->supports(IORING_OP_OPENAT) || !ring_->supports(IORING_OP_WRITE)
+                || !ring_->supports(IORING_OP_CLOSE) || !ring_->supports(IORING_OP_READ)) {
+                ring_.reset();
+            }
+            // Leave half the descriptor limit to the rest of the process
+            rlimit limit{};
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+                open_batch_ = static_cast<size_t>(std::max<rlim_t>(1, std::min<rlim_t>(RING_ENTRIES, limit.rlim_cur / 2)));
+            }
+        }
+#else
+        (void)backend;
+#endif
+    }
+
+    bool usingIoUring() const {
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+        return ring_ != nullptr;
+#else
+        return false;
+#endif
+    }
+
+    // Create or replace every file. Returns false if any of them failed.
+    bool writeFiles(const std::vector<file_write>& files) {
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+        if (ring_) {
+            bool all_ok = true;
+            if (writeFilesRing(files, all_ok)) {
+                return all_ok;
+            }
+            ring_.reset(); // the kernel lacks an opcode: fall back for good
+        }
+#endif
+        bool all_ok = true;
+        for (const auto& file : files) {
+            std::ofstream out(file.path, std::ios::binary);
+            for (const auto& part : file.parts) {
+                out.write(reinterpret_cast<const char*>(part.first), static_cast<std::streamsize>(part.second));
+            }
+            all_ok &= static_cast<bool>(out);
+        }
+        return all_ok;
+    }
+
+    bool writeFile(const std::string& path, const std::vector<uint8_t>& data) {
+        return writeFiles({ file_write{ path, { { data.data(), data.size() } } } });
+    }
+
+    // Whole file into memory. With io_uring the chunk reads are in flight together.
+    bool readFile(const std::string& path, std::vector<uint8_t>& out) {
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+        if (ring_) {
+            bool ok = false;
+            if (readFileRing(path, out, ok)) {
+                return ok;
+            }
+            ring_.reset();
+        }
+#endif
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+private:
+#if defined(LABEL_PLACER_HAVE_IO_URING)
+    static io_uring_sqe operation(uint8_t opcode, int fd, const void* addr, uint32_t len, uint64_t offset) {
+        io_uring_sqe sqe{};
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(addr);
+        sqe.len = len;
+        sqe.off = offset;
+        return sqe;
+    }
+
+    // Files go through in chunks of at most RING_ENTRIES (fewer under a low
+    // RLIMIT_NOFILE), each as three batched rounds: opens, writes, closes. A
+    // chunk is closed before the next is opened, so a batch never holds more
+    // descriptors than that. Returns
+    // false only when the ring cannot run these operations at all; every
+    // descriptor it opened is closed by then.
+    bool writeFilesRing(const std::vector<file_write>& files, bool& all_ok) {
+        std::vector<io_uring_sqe> ops;
+        std::vector<int> results;
+        std::vector<int> fds;
+        std::vector<size_t> expected;
+        auto closeAll = [&]() {
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        };
+        for (size_t first = 0; first < files.size(); first += open_batch_) {
+            const size_t count = std::min(open_batch_, files.size() - first);
+            ops.clear();
+            for (size_t f = first; f < first + count; ++f) {
+                io_uring_sqe open_op = operation(IORING_OP_OPENAT, AT_FDCWD, files[f].path.c_str(), 0644, 0);
+                open_op.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+                ops.push_back(open_op);
+            }
+            if (!ring_->run(ops, results)) {
+                fds = results; // opens that completed hold descriptors
+                closeAll();
+                return false;
+            }
+            fds = results;
+            // An opcode the probe missed fails every operation with EINVAL
+            if (first == 0 && fds[0] == -EINVAL) {
+                closeAll();
+                return false;
+            }
+
+            ops.clear();
+            expected.clear();
+            for (size_t k = 0; k < count; ++k) {
+                if (fds[k] < 0) {
+                    all_ok = false;
+                    continue;
+                }
+                uint64_t offset = 0;
+                for (const auto& part : files[first + k].parts) {
+                    for (size_t done = 0; done < part.second; done += MAX_WRITE) {
+                        const size_t length = std::min(MAX_WRITE, part.second - done);
+                        ops.push_back(operation(IORING_OP_WRITE, fds[k], part.first + done, static_cast<uint32_t>(length), offset + done));
+                        expected.push_back(length);
+                    }
+                    offset += part.second;
+                }
+            }
+            if (!ring_->run(ops, results)) {
+                closeAll();
+                return false;
+            }
+            for (size_t k = 0; k < ops.size(); ++k) {
+                if (results[k] >= 0 && static_cast<size_t>(results[k]) < expected[k]) {
+                    // Short write: finish it synchronously
+                    const uint8_t* data = reinterpret_cast<const uint8_t*>(ops[k].addr);
+                    size_t done = static_cast<size_t>(results[k]);
+                    while (done < expected[k]) {
+                        ssize_t w = pwrite(ops[k].fd, data + done, expected[k] - done, static_cast<off_t>(ops[k].off + done));
+                        if (w <= 0) {
+                            break;
+                        }
+                        done += static_cast<size_t>(w);
+                    }
+                    results[k] = done == expected[k] ? static_cast<int>(done) : -EIO;
+                }
+                if (results[k] < 0) {
+                    all_ok = false;
+                }
+            }
+
+            ops.clear();
+            for (int fd : fds) {
+                if (fd >= 0) {
+                    ops.push_back(operation(IORING_OP_CLOSE, fd, nullptr, 0, 0));
+                }
+            }
+            if (!ring_->run(ops, results)) {
+                for (size_t k = 0; k < ops.size(); ++k) {
+                    if (results[k] == -ECANCELED) {
+                        close(ops[k].fd);
+                    }
+                }
+                return false;
+            }
+            for (int r : results) {
+                all_ok &= r >= 0;
+            }
+        }
+        return true;
+    }
+
+    bool readFileRing(const std::string& path, std::vector<uint8_t>& out, bool& ok) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ok = false;
+            return true;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            ok = false;
+            return true;
+        }
+        out.resize(static_cast<size_t>(info.st_size));
+        std::vector<io_uring_sqe> ops;
+        for (size_t offset = 0; offset < out.size(); offset += READ_CHUNK) {
+            const size_t length = std::min(READ_CHUNK, out.size() - offset);
+            ops.push_back(operation(IORING_OP_READ, fd, out.data() + offset, static_cast<uint32_t>(length), offset));
+        }
+        std::vector<int> results;
+        if (!ring_->run(ops, results) || (!results.empty() && results[0] == -EINVAL)) {
+            close(fd);
+            return false;
+        }
+        ok = true;
+        for (size_t k = 0; k < ops.size(); ++k) {
+            // Short reads are completed synchronously
+            size_t done = results[k] < 0 ? 0 : static_cast<size_t>(results[k]);
+            while (done < ops[k].len) {
+                ssize_t r = pread(fd, out.data() + ops[k].off + done, ops[k].len - done, static_cast<off_t>(ops[k].off + done));
+                if (r <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += static_cast<size_t>(r);
+            }
+        }
+        close(fd);
+        return true;
+    }
+
+    std::unique_ptr<io_ring> ring_;
+    size_t open_batch_ = RING_ENTRIES; // files open at once while writing
+#endif
+};
+
+inline bulk_io& threadBulkIo() {
+    thread_local bulk_io io(ioBackend());
+    return io;
+}
+
+// Fixed-capacity FIFO between producer and consumer threads. push blocks
+// while the queue is full, pop blocks while it is empty; after close, pop
+// drains what is left and then returns false.
+template <typename T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&]() { return items_.size() < capacity_ || closed_; });
+        if (closed_) {
+            return;
+        }
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&]() { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+};
+
+// QOI ("Quite OK Image") encoding of an 8-bit BGR or BGRA image: a single
+// pass with a 64-entry colour cache, runs and small deltas. Several times
+// faster than PNG at a somewhat larger size.
+std::vector<uint8_t> encodeQoi(const cv::Mat& image) {
+    const int channels = image.channels();
+    std::vector<uint8_t> out;
+    out.reserve(14 + static_cast<size_t>(image.rows) * image.cols * (channels + 1) / 2 + 8);
+    auto put32 = [&](uint32_t v) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out.push_back(static_cast<uint8_t>(v >> shift));
+        }
+    };
+    out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+    put32(static_cast<uint32_t>(image.cols));
+    put32(static_cast<uint32_t>(image.rows));
+    out.push_back(static_cast<uint8_t>(channels == 4 ? 4 : 3));
+    out.push_back(0); // sRGB with linear alpha
+
+    std::array<uint32_t, 64> seen{};
+    uint8_t prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    for (int y = 0; y < image.rows; ++y) {
+        const uint8_t* row = image.ptr<uint8_t>(y);
+        for (int x = 0; x < image.cols; ++x) {
+            const uint8_t* bgr = row + x * channels;
+            const uint8_t px[4] = { bgr[2], bgr[1], bgr[0], channels == 4 ? bgr[3] : uint8_t(255) };
+            const bool last = y == image.rows - 1 && x == image.cols - 1;
+            if (std::memcmp(px, prev, 4) == 0) {
+                if (++run == 62 || last) {
+                    out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0) {
+                out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+                run = 0;
+            }
+            uint32_t packed;
+            std::memcpy(&packed, px, 4);
+            const int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+            if (seen[slot] == packed) {
+                out.push_back(static_cast<uint8_t>(slot));
+            } else {
+                seen[slot] = packed;
+                if (px[3] == prev[3]) {
+                    const int dr = static_cast<int8_t>(px[0] - prev[0]);
+                    const int dg = static_cast<int8_t>(px[1] - prev[1]);
+                    const int db = static_cast<int8_t>(px[2] - prev[2]);
+                    const int dr_dg = dr - dg, db_dg = db - dg;
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        out.push_back(static_cast<uint8_t>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+                    } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                        out.push_back(static_cast<uint8_t>(0x80 | (dg + 32)));
+                        out.push_back(static_cast<uint8_t>((dr_dg + 8) << 4 | (db_dg + 8)));
+                    } else {
+                        out.insert(out.end(), { 0xfe, px[0], px[1], px[2] });
+                    }
+                } else {
+                    out.insert(out.end(), { 0xff, px[0], px[1], px[2], px[3] });
+                }
+            }
+            std::memcpy(prev, px, 4);
+        }
+    }
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 });
+    return out;
+}
+
+// Image buffers handed back after encoding, so rendering the next frame of
+// the same size does not allocate
+class frame_pool {
+public:
+    explicit frame_pool(size_t capacity = 8) : capacity_(capacity) {}
+
+    cv::Mat acquire(int rows, int cols, int type) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t k = 0; k < free_.size(); ++k) {
+            if (free_[k].rows == rows && free_[k].cols == cols && free_[k].type() == type) {
+                cv::Mat frame = free_[k];
+                free_[k] = free_.back();
+                free_.pop_back();
+                return frame;
+            }
+        }
+        return cv::Mat(rows, cols, type);
+    }
+
+    void release(cv::Mat frame) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_.size() < capacity_) {
+            free_.push_back(frame);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<cv::Mat> free_;
+    size_t capacity_;
+};
+
+struct image_encode_options {
+    int png_compression = 3;  // zlib level 0-9; OpenCV's default of 1 favours speed less
+    int webp_quality = 90;    // above 100 is lossless
+    unsigned threads = 0;     // 0: half the hardware threads
+    size_t queue_capacity = 8;
+};
+
+// Write-behind output stage: finished frames are queued and encoded to disk by
+// a pool of encoder threads while the caller goes on with the next job. The
+// format follows the file extension: .qoi uses encodeQoi, .webp and .png go
+// through OpenCV with the configured quality and compression. Frames should
+// come from pool() and must not be modified after submit; they return to the
+// pool once written.
+class async_image_writer {
+public:
+    explicit async_image_writer(const image_encode_options& options = image_encode_options())
+        : options_(options), queue_(options.queue_capacity), pool_(options.queue_capacity + 2) {
+        unsigned threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency() / 2);
+        for (unsigned t = 0; t < threads; ++t) {
+            encoders_.emplace_back(&async_image_writer::run, this);
+        }
+    }
+
+    ~async_image_writer() { finish(); }
+
+    async_image_writer(const async_image_writer&) = delete;
+    async_image_writer& operator=(const async_image_writer&) = delete;
+
+    frame_pool& pool() { return pool_; }
+
+    // Blocks only while the queue is full
+    void submit(cv::Mat frame, const std::string& path) { queue_.push(job{ frame, path }); }
+
+    // Wait for every queued frame; returns false if any failed to write
+    bool finish() {
+        queue_.close();
+        for (auto& encoder : encoders_) {
+            encoder.join();
+        }
+        encoders_.clear();
+        return failed_ == 0;
+    }
+
+    size_t written() const { return written_; }
+
+private:
+    struct job {
+        cv::Mat frame;
+        std::string path;
+    };
+
+    static bool endsWith(const std::string& path, const char* suffix) {
+        const size_t n = std::strlen(suffix);
+        return path.size() >= n && path.compare(path.size() - n, n, suffix) == 0;
+    }
+
+    bool write(const job& j) const {
+        std::vector<uint8_t> bytes;
+        if (endsWith(j.path, ".qoi")) {
+            bytes = encodeQoi(j.frame);
+        } else if (endsWith(j.path, ".webp")) {
+            if (!cv::imencode(".webp", j.frame, bytes, { cv::IMWRITE_WEBP_QUALITY, options_.webp_quality })) {
+                return false;
+            }
+        } else if (!cv::imencode(".png", j.frame, bytes, { cv::IMWRITE_PNG_COMPRESSION, options_.png_compression })) {
+            return false;
+        }
+        return threadBulkIo().writeFile(j.path, bytes);
+    }
+
+    void run() {
+        job j;
+        while (queue_.pop(j)) {
+            if (write(j)) {
+                ++written_;
+            } else {
+                ++failed_;
+            }
+            pool_.release(j.frame);
+            j.frame = cv::Mat();
+        }
+    }
+
+    image_encode_options options_;
+    bounded_queue<job> queue_;
+    frame_pool pool_;
+    std::vector<std::thread> encoders_;
+    std::atomic<size_t> written_{ 0 };
+    std::atomic<size_t> failed_{ 0 };
+};
+
+// Visualize results using OpenCV; with diagnostics, a congestion heatmap is overlaid
+void visualizeWithOpenCV(const std::vector<labeled_point>& placed_labels,
+    const std::vector<std::pair<point_t, std::string>>& all_points,
+    const placement_diagnostics* diagnostics = nullptr,
+    image_coordinate_cache* coords = nullptr, async_image_writer* writer = nullptr,
+    const std::string& path = "label_placement_results.png",
+    const placement_render_options& options = placement_render_options()) {
+    // Save the image; interactive display is handled by the viewer below
+    if (writer) {
+        cv::Mat frame = writer->pool().acquire(IMAGE_SIZE, IMAGE_SIZE, CV_8UC3);
+        renderPlacementImage(placed_labels, all_points, diagnostics, coords, &frame, options);
+        writer->submit(frame, path);
+        std::cout << "Image queued as '" << path << "'\n";
+    } else {
+        cv::Mat image = renderPlacementImage(placed_labels, all_points, diagnostics, coords, nullptr, options);
+        cv::imwrite(path, image);
+        std::cout << "Image saved as '" << path << "'\n";
+    }
+    std::cout << "Placed " << placed_labels.size() << " out of " << all_points.size() << " labels.\n";
+}
+
+// Spatial index over a finished placement, used by the interactive viewer to
+// fetch only what falls inside the visible tiles
+struct placement_view_index {
+    using marker_entry = std::pair<point_t, size_t>;
+    using label_entry = std::pair<box_t, size_t>;
+
+    const std::vector<labeled_point>* placed_labels = nullptr;
+    placement_render_options options;
+    bgi::rtree<marker_entry, bgi::rstar<16>> markers; // every input point
+    bgi::rtree<label_entry, bgi::rstar<16>> labels;   // envelope of label box and its anchor point
+    bgi::rtree<label_entry, bgi::rstar<16>> icons;    // envelope of icon box and its anchor, by options.icons index
+    box_t bounds;
+    // Markers per cell of a VIEW_DENSITY_GRID square grid over bounds, so a
+    // tile's marker count can be estimated without querying its markers
+    std::vector<uint32_t> density;
+};
+
+const int VIEW_DENSITY_GRID = 128;
+
+// Markers expected in box: the density cells it overlaps, each weighted by
+// the share of the cell it covers
+double estimateMarkers(const placement_view_index& index, const box_t& box) {
+    if (index.density.empty()) {
+        return 0.0;
+    }
+    const double x0 = bg::get<0>(index.bounds.min_corner()), y0 = bg::get<1>(index.bounds.min_corner());
+    const double cell_w = std::max(bg::get<0>(index.bounds.max_corner()) - x0, 1e-9) / VIEW_DENSITY_GRID;
+    const double cell_h = std::max(bg::get<1>(index.bounds.max_corner()) - y0, 1e-9) / VIEW_DENSITY_GRID;
+    auto cell = [](double v) { return static_cast<int>(std::max(0.0, std::min(VIEW_DENSITY_GRID - 1.0, std::floor(v)))); };
+    const double bx0 = (bg::get<0>(box.min_corner()) - x0) / cell_w, bx1 = (bg::get<0>(box.max_corner()) - x0) / cell_w;
+    const double by0 = (bg::get<1>(box.min_corner()) - y0) / cell_h, by1 = (bg::get<1>(box.max_corner()) - y0) / cell_h;
+    if (bx1 < 0.0 || by1 < 0.0 || bx0 > VIEW_DENSITY_GRID || by0 > VIEW_DENSITY_GRID) {
+        return 0.0;
+    }
+    double count = 0.0;
+    for (int cy = cell(by0); cy <= cell(by1); ++cy) {
+        const double fy = std::min(by1, cy + 1.0) - std::max(by0, static_cast<double>(cy));
+        for (int cx = cell(bx0); cx <= cell(bx1); ++cx) {
+            const double fx = std::min(bx1, cx + 1.0) - std::max(bx0, static_cast<double>(cx));
+            count += index.density[static_cast<size_t>(cy) * VIEW_DENSITY_GRID + cx] * std::max(fx, 0.0) * std::max(fy, 0.0);
+        }
+    }
+    return count;
+}
+
+placement_view_index buildViewIndex(const std::vector<labeled_point>& placed_labels,
+    const std::vector<std::pair<point_t, std::string>>& all_points,
+    const placement_render_options& options = placement_render_options()) {
+    placement_view_index index;
+    index.placed_labels = &placed_labels;
+    index.options = options;
+    bg::assign_inverse(index.bounds);
+
+    std::vector<placement_view_index::marker_entry> markers;
+    markers.reserve(all_points.size());
+    for (size_t i = 0; i < all_points.size(); ++i) {
+        markers.emplace_back(all_points[i].first, i);
+        bg::expand(index.bounds, all_points[i].first);
+    }
+
+    std::vector<placement_view_index::label_entry> labels;
+    labels.reserve(placed_labels.size());
+    for (size_t i = 0; i < placed_labels.size(); ++i) {
+        // Include the anchor so the connection line is found from either end
+        box_t envelope = placed_labels[i].label_box;
+        bg::expand(envelope, placed_labels[i].point);
+        labels.emplace_back(envelope, i);
+        bg::expand(index.bounds, envelope);
+    }
+
+    std::vector<placement_view_index::label_entry> icons;
+    icons.reserve(index.options.icons.size());
+    for (size_t i = 0; i < index.options.icons.size(); ++i) {
+        box_t envelope = index.options.icons[i].second;
+        bg::expand(envelope, index.options.icons[i].first);
+        icons.emplace_back(envelope, i);
+        bg::expand(index.bounds, envelope);
+    }
+
+    if (!markers.empty()) {
+        const double x0 = bg::get<0>(index.bounds.min_corner()), y0 = bg::get<1>(index.bounds.min_corner());
+        const double cell_w = std::max(bg::get<0>(index.bounds.max_corner()) - x0, 1e-9) / VIEW_DENSITY_GRID;
+        const double cell_h = std::max(bg::get<1>(index.bounds.max_corner()) - y0, 1e-9) / VIEW_DENSITY_GRID;
+        index.density.assign(static_cast<size_t>(VIEW_DENSITY_GRID) * VIEW_DENSITY_GRID, 0);
+        for (const auto& marker : markers) {
+            const int cx = std::min(VIEW_DENSITY_GRID - 1, static_cast<int>((bg::get<0>(marker.first) - x0) / cell_w));
+            const int cy = std::min(VIEW_DENSITY_GRID - 1, static_cast<int>((bg::get<1>(marker.first) - y0) / cell_h));
+            ++index.density[static_cast<size_t>(cy) * VIEW_DENSITY_GRID + cx];
+        }
+    }
+
+    // Range constructors use the packing (bulk loading) algorithm
+    index.markers = decltype(index.markers)(markers.begin(), markers.end());
+    index.labels = decltype(index.labels)(labels.begin(), labels.end());
+    index.icons = decltype(index.icons)(icons.begin(), icons.end());
+    return index;
+}
+
+// Window onto the world: centre, discrete zoom level and output size
+struct viewport {
+    double center_x = 0.0;
+    double center_y = 0.0;
+    double base_scale = 80.0; // pixels per world unit at zoom 0
+    int zoom = 0;             // scale doubles every 4 steps
+    int width = 800;
+    int height = 600;
+
+    double scale() const { return base_scale * std::pow(2.0, zoom / 4.0); }
+};
+
+// Viewport that fits the whole placement into a window of the given size
+viewport fitViewport(const placement_view_index& index, int width, int height) {
+    viewport vp;
+    vp.width = width;
+    vp.height = height;
+    if (bg::get<0>(index.bounds.min_corner()) > bg::get<0>(index.bounds.max_corner())) {
+        return vp; // empty placement
+    }
+    vp.center_x = (bg::get<0>(index.bounds.min_corner()) + bg::get<0>(index.bounds.max_corner())) / 2.0;
+    vp.center_y = (bg::get<1>(index.bounds.min_corner()) + bg::get<1>(index.bounds.max_corner())) / 2.0;
+    double world_w = std::max(bg::get<0>(index.bounds.max_corner()) - bg::get<0>(index.bounds.min_corner()), 1e-9);
+    double world_h = std::max(bg::get<1>(index.bounds.max_corner()) - bg::get<1>(index.bounds.min_corner()), 1e-9);
+    vp.base_scale = 0.9 * std::min(width / world_w, height / world_h);
+    return vp;
+}
+
+const int VIEW_TILE_SIZE = 256;     // tile edge in screen pixels
+const size_t VIEW_TILE_CACHE = 1024; // tiles kept before off-screen ones are evicted
+const size_t VIEW_MARKER_CHUNK = 256; // markers drawn between two budget checks
+const size_t VIEW_LABEL_CHUNK = 16;   // labels drawn between two budget checks, each costs far more
+const double VIEW_COMPOSE_MS = 1.0;  // budget kept back for composing the frame
+
+// A rendered tile. Its passes run in order: every point, the placed anchors
+// and the icons as markers, then the label refinement. Each pass walks an
+// R-tree query; when the frame budget runs out inside one, its query cursor
+// stays here and the next frame resumes from it.
+struct view_tile {
+    enum class pass { points, anchors, icons, labels, done };
+    cv::Mat image;
+    pass stage = pass::points;
+    bool dense = false;   // markers as single pixels, decided when the tile starts
+    bool started = false; // the cursor of stage is live
+    bgi::rtree<placement_view_index::marker_entry, bgi::rstar<16>>::const_query_iterator marker_cursor;
+    bgi::rtree<placement_view_index::label_entry, bgi::rstar<16>>::const_query_iterator label_cursor;
+
+    bool hasMarkers() const { return stage >= pass::labels; }
+};
+
+// Interactive viewer state: the index, the current viewport and its tile cache
+struct viewer_state {
+    const placement_view_index* index = nullptr;
+    viewport view;
+    int cached_zoom = 0;
+    std::unordered_map<uint64_t, view_tile> tiles;
+    bool refinement_pending = false;
+};
+
+// Draw every hit of query on tree from the tile's cursor on, checking
+// expired every chunk hits. Returns false when it stopped early;
+// the cursor then holds the next hit.
+template <typename Tree, typename Cursor, typename Draw>
+bool drawTileQuery(const Tree& tree, const box_t& query, view_tile& tile, Cursor& cursor, size_t chunk,
+    const std::function<bool()>& expired, Draw draw) {
+    if (!tile.started) {
+        cursor = tree.qbegin(bgi::intersects(query));
+        tile.started = true;
+    }
+    for (size_t k = 0; cursor != tree.qend(); ++cursor, ++k) {
+        if (k > 0 && k % chunk == 0 && expired && expired()) {
+            return false;
+        }
+        draw(*cursor);
+    }
+    tile.started = false;
+    return true;
+}
+
+// World box covered by tile (tx, ty), grown by a margin in pixels. Tile pixel
+// space has x = world_x * scale and y = -world_y * scale, so y grows downwards.
+box_t viewTileWorldBox(int tx, int ty, double scale, int margin_pixels) {
+    double x0 = (static_cast<double>(tx) * VIEW_TILE_SIZE - margin_pixels) / scale;
+    double x1 = (static_cast<double>(tx + 1) * VIEW_TILE_SIZE + margin_pixels) / scale;
+    double y0 = -(static_cast<double>(ty + 1) * VIEW_TILE_SIZE + margin_pixels) / scale;
+    double y1 = -(static_cast<double>(ty) * VIEW_TILE_SIZE - margin_pixels) / scale;
+    return box_t(point_t(x0, y0), point_t(x1, y1));
+}
+
+cv::Point worldToTile(const point_t& world_point, double scale, int tx, int ty) {
+    return cv::Point(cvRound(bg::get<0>(world_point) * scale) - tx * VIEW_TILE_SIZE,
+        cvRound(-bg::get<1>(world_point) * scale) - ty * VIEW_TILE_SIZE);
+}
+
+// Marker passes: every point in red, placed anchors in blue on top, then
+// icons. Returns true once they are done, false if expired stopped them;
+// calling again resumes where they stopped.
+bool renderTileMarkers(viewer_state& state, int tx, int ty, view_tile& tile,
+    const std::function<bool()>& expired = nullptr) {
+    const int POINT_RADIUS = 6;
+    const double scale = state.view.scale();
+    const box_t query = viewTileWorldBox(tx, ty, scale, POINT_RADIUS + 1);
+    if (tile.image.empty()) {
+        tile.image.create(VIEW_TILE_SIZE, VIEW_TILE_SIZE, CV_8UC3);
+        tile.image.setTo(cv::Scalar(255, 255, 255));
+        tile.stage = view_tile::pass::points;
+        tile.started = false;
+        // When zoomed far out the markers would only paint over each other
+        tile.dense = estimateMarkers(*state.index, query) > VIEW_TILE_SIZE * VIEW_TILE_SIZE / 64;
+    }
+    // Red for points, blue for placed anchors
+    auto dot = [&](const point_t& point, bool anchor) {
+        cv::Point p = worldToTile(point, scale, tx, ty);
+        if (tile.dense) {
+            if (p.x >= 0 && p.y >= 0 && p.x < VIEW_TILE_SIZE && p.y < VIEW_TILE_SIZE) {
+                tile.image.at<cv::Vec3b>(p.y, p.x) = anchor ? cv::Vec3b{ { 255, 0, 0 } } : cv::Vec3b{ { 0, 0, 255 } };
+            }
+        } else {
+            cv::circle(tile.image, p, POINT_RADIUS, anchor ? cv::Scalar(255, 0, 0) : cv::Scalar(0, 0, 255), -1);
+            cv::circle(tile.image, p, POINT_RADIUS, cv::Scalar(0, 0, 0), 1);
+        }
+    };
+
+    const placement_view_index& index = *state.index;
+    if (tile.stage == view_tile::pass::points) {
+        if (!drawTileQuery(index.markers, query, tile, tile.marker_cursor, VIEW_MARKER_CHUNK, expired,
+            [&](const placement_view_index::marker_entry& hit) { dot(hit.first, false); })) {
+            return false;
+        }
+        tile.stage = view_tile::pass::anchors;
+    }
+    if (tile.stage == view_tile::pass::anchors) {
+        if (!drawTileQuery(index.labels, query, tile, tile.label_cursor, VIEW_MARKER_CHUNK, expired,
+            [&](const placement_view_index::label_entry& hit) { dot((*index.placed_labels)[hit.second].point, true); })) {
+            return false;
+        }
+        tile.stage = view_tile::pass::icons;
+    }
+    if (tile.stage == view_tile::pass::icons) {
+        // POI icons, their anchors placed whether or not the text fitted
+        if (!drawTileQuery(index.icons, query, tile, tile.label_cursor, VIEW_MARKER_CHUNK, expired, [&](const placement_view_index::label_entry& hit) {
+            const auto& icon = index.options.icons[hit.second];
+            if (!tile.dense) {
+                cv::Rect icon_rect(worldToTile(icon.second.min_corner(), scale, tx, ty),
+                    worldToTile(icon.second.max_corner(), scale, tx, ty));
+                cv::rectangle(tile.image, icon_rect, ICON_COLOUR, -1);
+                cv::rectangle(tile.image, icon_rect, cv::Scalar(0, 0, 0), 1);
+            }
+            dot(icon.first, true);
+        })) {
+            return false;
+        }
+        tile.stage = view_tile::pass::labels;
+    }
+    return true;
+}
+
+// Refinement pass: label boxes, connection lines and text on top of the
+// markers, once those are done. Returns true once the pass is done, false if
+// expired stopped it; calling again resumes where it stopped.
+bool renderTileLabels(viewer_state& state, int tx, int ty, view_tile& tile,
+    const std::function<bool()>& expired = nullptr) {
+    const int TEXT_MARGIN = 64; // text may spill outside a narrow box
+    const double scale = state.view.scale();
+    if (tile.stage != view_tile::pass::labels) {
+        return tile.stage == view_tile::pass::done;
+    }
+
+    const box_t query = viewTileWorldBox(tx, ty, scale, TEXT_MARGIN);
+    const bool done = drawTileQuery(state.index->labels, query, tile, tile.label_cursor, VIEW_LABEL_CHUNK, expired,
+        [&](const placement_view_index::label_entry& hit) {
+        const labeled_point& lp = (*state.index->placed_labels)[hit.second];
+        cv::Point img_point = worldToTile(lp.point, scale, tx, ty);
+        cv::Rect box_rect(worldToTile(lp.label_box.min_corner(), scale, tx, ty),
+            worldToTile(lp.label_box.max_corner(), scale, tx, ty));
+        if (state.index->options.decorations) {
+            cv::rectangle(tile.image, box_rect, cv::Scalar(0, 255, 0), 2);
+        }
+
+        cv::Point box_center(box_rect.x + box_rect.width / 2, box_rect.y + box_rect.height / 2);
+        cv::line(tile.image, img_point, box_center, cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
+
+        // Text is unreadable below this size; skip the most expensive primitive
+        if (box_rect.width < 12) {
+            return;
+        }
+        const text_run& run = text_run_cache::instance().get(lp.label);
+        const cv::Point text_org = centredTextOrigin(box_rect, run);
+
+        // Blend the text background in place instead of copying the whole image
+        cv::Rect background(text_org.x - LABEL_PADDING, text_org.y - run.size.height - LABEL_PADDING,
+            run.mask.cols + 2 * LABEL_PADDING, run.mask.rows + 2 * LABEL_PADDING);
+        background = background & cv::Rect(0, 0, VIEW_TILE_SIZE, VIEW_TILE_SIZE);
+        if (state.index->options.decorations && !background.empty()) {
+            cv::Mat roi = tile.image(background);
+            roi.convertTo(roi, -1, 0.3, 255 * 0.7);
+        }
+        drawTextRun(tile.image, run, text_org, cv::Scalar(0, 0, 0));
+    });
+    if (done) {
+        tile.stage = view_tile::pass::done;
+    }
+    return done;
+}
+
+// Compose the visible tiles into a frame. Missing tiles get their markers and
+// then their labels tile by tile while the frame budget lasts, checked every
+// chunk of markers or labels inside a tile too; tiles not reached stay blank and a
+// tile stopped mid-pass shows what it has, so repeated calls fill in and
+// refine the picture progressively. A negative budget renders everything.
+cv::Mat renderViewerFrame(viewer_state& state, double budget_ms) {
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&start]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    const std::function<bool()> expired = [&]() {
+        return budget_ms >= 0.0 && elapsed_ms() >= budget_ms - VIEW_COMPOSE_MS;
+    };
+
+    const viewport& vp = state.view;
+    if (vp.zoom != state.cached_zoom) {
+        state.tiles.clear();
+        state.cached_zoom = vp.zoom;
+    }
+
+    const double scale = vp.scale();
+    const int origin_x = cvFloor(vp.center_x * scale - vp.width / 2.0);
+    const int origin_y = cvFloor(-vp.center_y * scale - vp.height / 2.0);
+    const int tx0 = cvFloor(static_cast<double>(origin_x) / VIEW_TILE_SIZE);
+    const int ty0 = cvFloor(static_cast<double>(origin_y) / VIEW_TILE_SIZE);
+    const int tx1 = cvFloor(static_cast<double>(origin_x + vp.width - 1) / VIEW_TILE_SIZE);
+    const int ty1 = cvFloor(static_cast<double>(origin_y + vp.height - 1) / VIEW_TILE_SIZE);
+
+    if (state.tiles.size() > VIEW_TILE_CACHE) {
+        for (auto it = state.tiles.begin(); it != state.tiles.end();) {
+            int tx = static_cast<int32_t>(it->first >> 32);
+            int ty = static_cast<int32_t>(it->first & 0xffffffffu);
+            bool visible = tx >= tx0 && tx <= tx1 && ty >= ty0 && ty <= ty1;
+            it = visible ? std::next(it) : state.tiles.erase(it);
+        }
+    }
+
+    // Markers first, for every visible tile, then labels, both as far as the
+    // budget allows; a tile without markers yet stays blank for this frame
+    state.refinement_pending = false;
+    std::vector<view_tile*> visible_tiles;
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            view_tile& tile = state.tiles[viewTileKey(tx, ty)];
+            if (!tile.hasMarkers() && (expired() || !renderTileMarkers(state, tx, ty, tile, expired))) {
+                state.refinement_pending = true;
+            }
+            visible_tiles.push_back(&tile);
+        }
+    }
+
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            view_tile& tile = *visible_tiles[(ty - ty0) * (tx1 - tx0 + 1) + (tx - tx0)];
+            if (!tile.hasMarkers() || tile.stage == view_tile::pass::done) {
+                continue;
+            }
+            if (expired() || !renderTileLabels(state, tx, ty, tile, expired)) {
+                state.refinement_pending = true;
+            }
+        }
+    }
+
+    cv::Mat frame(vp.height, vp.width, CV_8UC3, cv::Scalar(255, 255, 255));
+    const cv::Rect frame_rect(0, 0, vp.width, vp.height);
+    for (int ty = ty0; ty <= ty1; ++ty) {
+        for (int tx = tx0; tx <= tx1; ++tx) {
+            const view_tile& tile = *visible_tiles[(ty - ty0) * (tx1 - tx0 + 1) + (tx - tx0)];
+            if (tile.image.empty()) {
+                continue;
+            }
+            cv::Rect dst(tx * VIEW_TILE_SIZE - origin_x, ty * VIEW_TILE_SIZE - origin_y, VIEW_TILE_SIZE, VIEW_TILE_SIZE);
+            cv::Rect clipped = dst & frame_rect;
+            if (clipped.empty()) {
+                continue;
+            }
+            cv::Rect src(clipped.x - dst.x, clipped.y - dst.y, clipped.width, clipped.height);
+            tile.image(src).copyTo(frame(clipped));
+        }
+    }
+    return frame;
+}
+
+void panViewer(viewer_state& state, int dx_pixels, int dy_pixels) {
+    state.view.center_x -= dx_pixels / state.view.scale();
+    state.view.center_y += dy_pixels / state.view.scale();
+}
+
+// Zoom by a number of steps, keeping the world point under (px, py) in place
+void zoomViewer(viewer_state& state, int steps, int px, int py) {
+    double old_scale = state.view.scale();
+    double wx = state.view.center_x + (px - state.view.width / 2.0) / old_scale;
+    double wy = state.view.center_y - (py - state.view.height / 2.0) / old_scale;
+    state.view.zoom = std::max(-40, std::min(80, state.view.zoom + steps));
+    double new_scale = state.view.scale();
+    state.view.center_x = wx - (px - state.view.width / 2.0) / new_scale;
+    state.view.center_y = wy + (py - state.view.height / 2.0) / new_scale;
+}
+
+// Fully refined render of one viewport, without HighGUI, for tests and batch jobs
+bool saveViewerScreenshot(const placement_view_index& index, const viewport& vp, const std::string& path) {
+    viewer_state state;
+    state.index = &index;
+    state.view = vp;
+    state.cached_zoom = vp.zoom;
+    cv::Mat frame = renderViewerFrame(state, -1.0);
+    return cv::imwrite(path, frame);
+}
+
+struct viewer_mouse {
+    viewer_state* state = nullptr;
+    bool dragging = false;
+    cv::Point last;
+};
+
+void onViewerMouse(int event, int x, int y, int flags, void* userdata) {
+    viewer_mouse& mouse = *static_cast<viewer_mouse*>(userdata);
+    if (event == cv::EVENT_LBUTTONDOWN) {
+        mouse.dragging = true;
+        mouse.last = cv::Point(x, y);
+    } else if (event == cv::EVENT_LBUTTONUP) {
+        mouse.dragging = false;
+    } else if (event == cv::EVENT_MOUSEMOVE && mouse.dragging) {
+        panViewer(*mouse.state, x - mouse.last.x, y - mouse.last.y);
+        mouse.last = cv::Point(x, y);
+    } else if (event == cv::EVENT_MOUSEWHEEL) {
+        zoomViewer(*mouse.state, cv::getMouseWheelDelta(flags) > 0 ? 1 : -1, x, y);
+    }
+}
+
+const double VIEWER_FRAME_BUDGET_MS = 16.0;
+
+// HighGUI loop: drag or WASD to pan, wheel or +/- to zoom, Q or Esc to quit.
+// Each frame gets a 16 ms budget; unfinished label refinement continues on idle frames.
+void runInteractiveViewer(const placement_view_index& index, const viewport& initial_view) {
+    const std::string window = "Automatic Label Placement Results";
+    const int PAN_STEP = 64;
+
+    viewer_state state;
+    state.index = &index;
+    state.view = initial_view;
+    state.cached_zoom = initial_view.zoom;
+
+    viewer_mouse mouse;
+    mouse.state = &state;
+    cv::namedWindow(window, cv::WINDOW_AUTOSIZE);
+    cv::setMouseCallback(window, onViewerMouse, &mouse);
+
+    std::cout << "Drag or W/A/S/D to pan, mouse wheel or +/- to zoom, Q to quit.\n";
+    while (true) {
+        cv::Mat frame = renderViewerFrame(state, VIEWER_FRAME_BUDGET_MS);
+        cv::imshow(window, frame);
+        int key = cv::waitKey(state.refinement_pending ? 1 : 15);
+        if (key == 'q' || key == 'Q' || key == 27) {
+            break;
+        }
+        if (cv::getWindowProperty(window, cv::WND_PROP_VISIBLE) < 1) {
+            break;
+        }
+        switch (key) {
+        case 'w': case 'W': panViewer(state, 0, PAN_STEP); break;
+        case 's': case 'S': panViewer(state, 0, -PAN_STEP); break;
+        case 'a': case 'A': panViewer(state, PAN_STEP, 0); break;
+        case 'd': case 'D': panViewer(state, -PAN_STEP, 0); break;
+        case '+': case '=': zoomViewer(state, 1, state.view.width / 2, state.view.height / 2); break;
+        case '-': case '_': zoomViewer(state, -1, state.view.width / 2, state.view.height / 2); break;
+        default: break;
+        }
+    }
+    cv::destroyWindow(window);
+}
+
+// Run body(i) for every i in [0, count) across the hardware threads. The
+// first exception thrown by body stops the remaining work and is rethrown
+// on the calling thread once every worker has joined.
+template <typename Body>
+void parallelFor(size_t count, Body body) {
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    body(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                    next = count;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Regular grid of square tiles from an origin. A tile is addressed by a
+// 64-bit key, its row (counted northwards) in the high half and its column in
+// the low half, so keys sort row-major and only tiles holding labels are ever
+// stored: the grid's extent costs nothing.
+struct tile_grid {
+    double origin_x = 0.0;
+    double origin_y = 0.0;
+    double tile_size = 1.0;
+
+    static uint64_t key(uint32_t column, uint32_t row) { return (static_cast<uint64_t>(row) << 32) | column; }
+    static uint32_t column(uint64_t tile) { return static_cast<uint32_t>(tile); }
+    static uint32_t row(uint64_t tile) { return static_cast<uint32_t>(tile >> 32); }
+
+    // Tile containing p; points outside the grid are clamped to the border tiles
+    uint64_t tileOf(const point_t& p) const {
+        auto cell = [this](double v, double origin) {
+            const double t = std::floor((v - origin) / tile_size);
+            return t <= 0.0 ? 0u : t >= 4294967295.0 ? 0xffffffffu : static_cast<uint32_t>(t);
+        };
+        return key(cell(bg::get<0>(p), origin_x), cell(bg::get<1>(p), origin_y));
+    }
+
+    point_t tileOrigin(uint64_t tile) const {
+        return point_t(origin_x + column(tile) * tile_size, origin_y + row(tile) * tile_size);
+    }
+};
+
+// Grid of tile_size tiles with its origin at the tile holding the lowest anchor
+tile_grid makeTileGrid(const std::vector<labeled_point>& labels, double tile_size) {
+    tile_grid grid;
+    grid.tile_size = tile_size;
+    if (labels.empty()) {
+        return grid;
+    }
+    box_t bounds;
+    bg::assign_inverse(bounds);
+    for (const auto& lp : labels) {
+        bg::expand(bounds, lp.point);
+    }
+    grid.origin_x = std::floor(bg::get<0>(bounds.min_corner()) / tile_size) * tile_size;
+    grid.origin_y = std::floor(bg::get<1>(bounds.min_corner()) / tile_size) * tile_size;
+    return grid;
+}
+
+// Labels grouped by tile: tiles holds the keys of non-empty tiles in key
+// order, and order lists label indices tile by tile, tile k spanning
+// order[start[k], start[k + 1]) in priority order
+struct tile_buckets {
+    std::vector<uint64_t> tiles;
+    std::vector<uint32_t> start;
+    std::vector<uint32_t> order;
+};
+
+tile_buckets bucketByTile(const std::vector<labeled_point>& labels, const tile_grid& grid) {
+    std::vector<std::pair<uint64_t, uint32_t>> keyed(labels.size());
+    parallelFor(labels.size(), [&](size_t i) {
+        keyed[i] = std::make_pair(grid.tileOf(labels[i].point), static_cast<uint32_t>(i));
+    });
+    std::sort(keyed.begin(), keyed.end()); // ties by index keep priority order
+
+    tile_buckets buckets;
+    buckets.order.resize(keyed.size());
+    for (size_t i = 0; i < keyed.size(); ++i) {
+        if (i == 0 || keyed[i].first != keyed[i - 1].first) {
+            buckets.tiles.push_back(keyed[i].first);
+            buckets.start.push_back(static_cast<uint32_t>(i));
+        }
+        buckets.order[i] = keyed[i].second;
+    }
+    buckets.start.push_back(static_cast<uint32_t>(keyed.size()));
+    return buckets;
+}
+
+void putVarint(std::vector<uint8_t>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<uint8_t>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t getVarint(const uint8_t*& p, const uint8_t* end) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end) {
+            throw std::runtime_error("truncated varint");
+        }
+        uint8_t byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::runtime_error("varint too long");
+}
+
+inline uint64_t zigzagEncode(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+inline int64_t zigzagDecode(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+// Columnar, block-compressed archive of placed labels. Labels are bucketed into
+// tiles and every tile is an independent block, so blocks encode and decode in
+// parallel and a single tile can be read without touching the others. Within a
+// block each column is stored separately:
+//   - box min corner x and y, quantized, delta coded from the previous label
+//     (the first from the tile origin), zigzag + varint
+//   - shape, an id into the archive-wide shape table: 2 bits per label (4
+//     per byte) when the table has at most 4 entries, else a varint
+//   - label, varint id into the archive-wide dictionary
+// A shape is the box size, the anchor's offset from the box min corner and
+// the offset index, all quantized. Labels of one placement share a handful
+// of shapes, so the box max corner and the anchor point cost next to nothing.
+struct columnar_archive {
+    struct label_shape {
+        int64_t width = 0, height = 0; // in quanta
+        int64_t dx = 0, dy = 0;        // box min corner minus anchor, in quanta
+        uint8_t offset_index = 0;
+
+        bool operator<(const label_shape& o) const {
+            return std::tie(width, height, dx, dy, offset_index) < std::tie(o.width, o.height, o.dx, o.dy, o.offset_index);
+        }
+    };
+
+    struct tile_entry {
+        uint64_t tile = 0;    // tile key in grid
+        uint32_t count = 0;   // labels in the block
+        uint64_t offset = 0;  // start of the block in blocks
+        uint64_t size = 0;    // encoded size in bytes
+    };
+
+    tile_grid grid;
+    double quantum = 1.0 / 1024.0;       // world units per quantization step
+    std::vector<std::string> dictionary; // distinct label strings, by first appearance
+    std::vector<label_shape> shapes;     // distinct shapes, by first appearance
+    std::vector<tile_entry> directory;   // sorted by tile key, empty tiles omitted
+    std::vector<uint8_t> blocks;
+};
+
+columnar_archive encodeColumnarArchive(const std::vector<labeled_point>& labels, double tile_size,
+    double quantum = 1.0 / 1024.0) {
+    columnar_archive archive;
+    archive.grid = makeTileGrid(labels, tile_size);
+    archive.quantum = quantum;
+
+    // Dictionary and shape ids, and tile buckets
+    std::vector<uint32_t> label_ids(labels.size());
+    std::vector<uint32_t> shape_ids(labels.size());
+    std::unordered_map<std::string, uint32_t> dictionary_ids;
+    std::map<columnar_archive::label_shape, uint32_t> shape_table;
+    for (size_t i = 0; i < labels.size(); ++i) {
+        auto inserted = dictionary_ids.emplace(labels[i].label, static_cast<uint32_t>(archive.dictionary.size()));
+        if (inserted.second) {
+            archive.dictionary.push_back(labels[i].label);
+        }
+        label_ids[i] = inserted.first->second;
+
+        const box_t& box = labels[i].label_box;
+        columnar_archive::label_shape shape;
+        shape.width = std::llround((bg::get<0>(box.max_corner()) - bg::get<0>(box.min_corner())) / quantum);
+        shape.height = std::llround((bg::get<1>(box.max_corner()) - bg::get<1>(box.min_corner())) / quantum);
+        shape.dx = std::llround((bg::get<0>(box.min_corner()) - bg::get<0>(labels[i].point)) / quantum);
+        shape.dy = std::llround((bg::get<1>(box.min_corner()) - bg::get<1>(labels[i].point)) / quantum);
+        shape.offset_index = labels[i].offset_index;
+        auto shape_inserted = shape_table.emplace(shape, static_cast<uint32_t>(archive.shapes.size()));
+        if (shape_inserted.second) {
+            archive.shapes.push_back(shape);
+        }
+        shape_ids[i] = shape_inserted.first->second;
+    }
+    const tile_buckets buckets = bucketByTile(labels, archive.grid);
+    archive.directory.resize(buckets.tiles.size());
+    for (size_t b = 0; b < buckets.tiles.size(); ++b) {
+        archive.directory[b].tile = buckets.tiles[b];
+        archive.directory[b].count = buckets.start[b + 1] - buckets.start[b];
+    }
+
+    std::vector<std::vector<uint8_t>> encoded(archive.directory.size());
+    parallelFor(archive.directory.size(), [&](size_t b) {
+        const columnar_archive::tile_entry& entry = archive.directory[b];
+        const uint32_t* members = buckets.order.data() + buckets.start[b];
+        std::vector<uint8_t>& out = encoded[b];
+        out.reserve(entry.count * 5);
+
+        point_t origin = archive.grid.tileOrigin(entry.tile);
+        for (int axis = 0; axis < 2; ++axis) {
+            int64_t previous = std::llround((axis == 0 ? bg::get<0>(origin) : bg::get<1>(origin)) / quantum);
+            for (uint32_t k = 0; k < entry.count; ++k) {
+                const point_t& corner = labels[members[k]].label_box.min_corner();
+                int64_t q = std::llround((axis == 0 ? bg::get<0>(corner) : bg::get<1>(corner)) / quantum);
+                putVarint(out, zigzagEncode(q - previous));
+                previous = q;
+            }
+        }
+        if (archive.shapes.size() <= 4) {
+            for (uint32_t k = 0; k < entry.count; k += 4) {
+                uint8_t packed = 0;
+                for (uint32_t m = 0; m < 4 && k + m < entry.count; ++m) {
+                    packed |= static_cast<uint8_t>(shape_ids[members[k + m]] << (2 * m));
+                }
+                out.push_back(packed);
+            }
+        } else {
+            for (uint32_t k = 0; k < entry.count; ++k) {
+                putVarint(out, shape_ids[members[k]]);
+            }
+        }
+        for (uint32_t k = 0; k < entry.count; ++k) {
+            putVarint(out, label_ids[members[k]]);
+        }
+    });
+
+    uint64_t offset = 0;
+    for (size_t b = 0; b < encoded.size(); ++b) {
+        archive.directory[b].offset = offset;
+        archive.directory[b].size = encoded[b].size();
+        offset += encoded[b].size();
+    }
+    archive.blocks.resize(offset);
+    parallelFor(encoded.size(), [&](size_t b) {
+        std::copy(encoded[b].begin(), encoded[b].end(), archive.blocks.begin() + archive.directory[b].offset);
+    });
+    return archive;
+}
+
+// Decode one directory entry, appending its labels to out
+void decodeColumnarBlock(const columnar_archive& archive, const columnar_archive::tile_entry& entry,
+    std::vector<labeled_point>& out) {
+    const uint8_t* p = archive.blocks.data() + entry.offset;
+    const uint8_t* end = p + entry.size;
+    const size_t first = out.size();
+    out.resize(first + entry.count);
+
+    point_t origin = archive.grid.tileOrigin(entry.tile);
+    std::vector<int64_t> qx(entry.count), qy(entry.count);
+    for (int axis = 0; axis < 2; ++axis) {
+        std::vector<int64_t>& column = axis == 0 ? qx : qy;
+        int64_t previous = std::llround((axis == 0 ? bg::get<0>(origin) : bg::get<1>(origin)) / archive.quantum);
+        for (uint32_t k = 0; k < entry.count; ++k) {
+            previous += zigzagDecode(getVarint(p, end));
+            column[k] = previous;
+        }
+    }
+    const bool packed = archive.shapes.size() <= 4;
+    if (packed && static_cast<size_t>(end - p) < (entry.count + 3) / 4) {
+        throw std::runtime_error("truncated shape column");
+    }
+    for (uint32_t k = 0; k < entry.count; ++k) {
+        const uint64_t id = packed ? (p[k / 4] >> (2 * (k % 4))) & 3 : getVarint(p, end);
+        if (id >= archive.shapes.size()) {
+            throw std::runtime_error("shape id outside table");
+        }
+        const columnar_archive::label_shape& shape = archive.shapes[id];
+        labeled_point& lp = out[first + k];
+        lp.offset_index = shape.offset_index;
+        const int64_t x = qx[k], y = qy[k];
+        lp.label_box = box_t(point_t(x * archive.quantum, y * archive.quantum),
+            point_t((x + shape.width) * archive.quantum, (y + shape.height) * archive.quantum));
+        lp.point = point_t((x - shape.dx) * archive.quantum, (y - shape.dy) * archive.quantum);
+    }
+    if (packed) {
+        p += (entry.count + 3) / 4;
+    }
+    for (uint32_t k = 0; k < entry.count; ++k) {
+        uint64_t id = getVarint(p, end);
+        if (id >= archive.dictionary.size()) {
+            throw std::runtime_error("label id outside dictionary");
+        }
+        out[first + k].label = archive.dictionary[id];
+    }
+}
+
+// Random access: labels of a single tile, in placement order
+std::vector<labeled_point> decodeColumnarTile(const columnar_archive& archive, uint64_t tile) {
+    std::vector<labeled_point> out;
+    auto it = std::lower_bound(archive.directory.begin(), archive.directory.end(), tile,
+        [](const columnar_archive::tile_entry& entry, uint64_t key) { return entry.tile < key; });
+    if (it != archive.directory.end() && it->tile == tile) {
+        decodeColumnarBlock(archive, *it, out);
+    }
+    return out;
+}
+
+// All labels, tile by tile, decoding blocks in parallel
+std::vector<labeled_point> decodeColumnarArchive(const columnar_archive& archive) {
+    std::vector<std::vector<labeled_point>> decoded(archive.directory.size());
+    parallelFor(archive.directory.size(), [&](size_t b) {
+        decodeColumnarBlock(archive, archive.directory[b], decoded[b]);
+    });
+    std::vector<labeled_point> out;
+    for (auto& block : decoded) {
+        std::move(block.begin(), block.end(), std::back_inserter(out));
+    }
+    return out;
+}
+
+template <typename T>
+void putRaw(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+T getRaw(const uint8_t*& p, const uint8_t* end) {
+    if (static_cast<size_t>(end - p) < sizeof(T)) {
+        throw std::runtime_error("truncated archive header");
+    }
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+}
+
+const char COLUMNAR_MAGIC[4] = { 'L', 'P', 'C', '3' };
+
+// File layout: magic, grid origin and tile size, quantum, dictionary, shapes,
+// directory (tile keys delta coded in key order), blocks
+bool writeColumnarArchive(const columnar_archive& archive, const std::string& path) {
+    std::vector<uint8_t> header(COLUMNAR_MAGIC, COLUMNAR_MAGIC + 4);
+    putRaw(header, archive.grid.origin_x);
+    putRaw(header, archive.grid.origin_y);
+    putRaw(header, archive.grid.tile_size);
+    putRaw(header, archive.quantum);
+    putVarint(header, archive.dictionary.size());
+    for (const auto& label : archive.dictionary) {
+        putVarint(header, label.size());
+        header.insert(header.end(), label.begin(), label.end());
+    }
+    putVarint(header, archive.shapes.size());
+    for (const auto& shape : archive.shapes) {
+        putVarint(header, zigzagEncode(shape.width));
+        putVarint(header, zigzagEncode(shape.height));
+        putVarint(header, zigzagEncode(shape.dx));
+        putVarint(header, zigzagEncode(shape.dy));
+        putVarint(header, shape.offset_index);
+    }
+    putVarint(header, archive.directory.size());
+    uint64_t previous = 0;
+    for (const auto& entry : archive.directory) {
+        putVarint(header, entry.tile - previous);
+        previous = entry.tile;
+        putVarint(header, entry.count);
+        putVarint(header, entry.size); // offsets follow from the sizes
+    }
+
+    return threadBulkIo().writeFiles({ file_write{ path,
+        { { header.data(), header.size() }, { archive.blocks.data(), archive.blocks.size() } } } });
+}
+
+bool readColumnarArchive(const std::string& path, columnar_archive& archive) {
+    std::vector<uint8_t> bytes;
+    if (!threadBulkIo().readFile(path, bytes) || bytes.size() < 4 || !std::equal(COLUMNAR_MAGIC, COLUMNAR_MAGIC + 4, bytes.begin())) {
+        return false;
+    }
+    try {
+        const uint8_t* p = bytes.data() + 4;
+        const uint8_t* end = bytes.data() + bytes.size();
+        archive = columnar_archive();
+        archive.grid.origin_x = getRaw<double>(p, end);
+        archive.grid.origin_y = getRaw<double>(p, end);
+        archive.grid.tile_size = getRaw<double>(p, end);
+        archive.quantum = getRaw<double>(p, end);
+        // Every quantized coordinate of the grid must fit an int64 with room to spare
+        const double reach = std::max(std::abs(archive.grid.origin_x), std::abs(archive.grid.origin_y))
+            + 4294967296.0 * archive.grid.tile_size;
+        if (!(archive.grid.tile_size > 0.0) || !(archive.quantum > 0.0) || !std::isfinite(reach)
+            || !(reach / archive.quantum < 1e18)) {
+            return false;
+        }
+
+        // Counts are checked against the bytes left before anything is
+        // allocated: a dictionary entry takes at least one byte, a directory
+        // entry three
+        uint64_t words = getVarint(p, end);
+        if (words > static_cast<uint64_t>(end - p)) {
+            return false;
+        }
+        archive.dictionary.resize(words);
+        for (auto& label : archive.dictionary) {
+            uint64_t length = getVarint(p, end);
+            if (length > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            label.assign(reinterpret_cast<const char*>(p), length);
+            p += length;
+        }
+        uint64_t shapes = getVarint(p, end);
+        if (shapes > static_cast<uint64_t>(end - p) / 5) {
+            return false;
+        }
+        archive.shapes.resize(shapes);
+        for (auto& shape : archive.shapes) {
+            shape.width = zigzagDecode(getVarint(p, end));
+            shape.height = zigzagDecode(getVarint(p, end));
+            shape.dx = zigzagDecode(getVarint(p, end));
+            shape.dy = zigzagDecode(getVarint(p, end));
+            const uint64_t offset_index = getVarint(p, end);
+            // Shapes only ever shift a grid coordinate by a box size or so
+            if (offset_index > 255 || std::max({ std::abs(shape.width), std::abs(shape.height),
+                std::abs(shape.dx), std::abs(shape.dy) }) > (int64_t(1) << 40)) {
+                return false;
+            }
+            shape.offset_index = static_cast<uint8_t>(offset_index);
+        }
+        uint64_t tiles = getVarint(p, end);
+        if (tiles > static_cast<uint64_t>(end - p) / 3) {
+            return false;
+        }
+        archive.directory.resize(tiles);
+        uint64_t offset = 0;
+        for (size_t b = 0; b < archive.directory.size(); ++b) {
+            columnar_archive::tile_entry& entry = archive.directory[b];
+            const uint64_t delta = getVarint(p, end);
+            const uint64_t count = getVarint(p, end);
+            entry.size = getVarint(p, end);
+            // Keys strictly increase; a label takes at least three bytes
+            // (x, y and label id), so count is bounded by the block size
+            if ((b > 0 && delta == 0) || delta > ~archive.directory[b > 0 ? b - 1 : 0].tile
+                || count == 0 || count > entry.size / 3 || entry.size > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+            entry.tile = (b > 0 ? archive.directory[b - 1].tile : 0) + delta;
+            entry.count = static_cast<uint32_t>(count);
+            entry.offset = offset;
+            offset += entry.size;
+            if (offset > static_cast<uint64_t>(end - p)) {
+                return false;
+            }
+        }
+        if (offset != static_cast<uint64_t>(end - p)) {
+            return false;
+        }
+        archive.blocks.assign(p, end);
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    return true;
+}
+
+// Mapbox Vector Tile output. Every tile of the grid holding at least one
+// label anchor becomes one MVT tile with a single "labels" layer of point
+// features: the anchor in tile-local coordinates quantized to the extent
+// (y pointing down, as MVT expects) and the properties
+//   text    the label string
+//   offset  offset_index of the label (see labeled_point)
+//   anchor  the text-anchor that reproduces the box: the side or corner of
+//           label_box nearest the point, "center" when the point is inside
+// Features keep priority order. Each tile is encoded by one worker into
+// buffers reused across its features; sizes of nested messages are computed
+// up front so nothing is written twice.
+const uint32_t MVT_EXTENT = 4096;
+const char* const MVT_LAYER_NAME = "labels";
+const std::array<const char*, 9> MVT_ANCHORS = { { "bottom-left", "bottom", "bottom-right", "left", "center", "right",
+    "top-left", "top", "top-right" } };
+
+// Index into MVT_ANCHORS for a label, from its real box
+inline uint32_t mvtAnchor(const labeled_point& label) {
+    const double x = bg::get<0>(label.point), y = bg::get<1>(label.point);
+    const box_t& box = label.label_box;
+    const uint32_t column = x <= bg::get<0>(box.min_corner()) ? 0 : x >= bg::get<0>(box.max_corner()) ? 2 : 1;
+    const uint32_t row = y <= bg::get<1>(box.min_corner()) ? 0 : y >= bg::get<1>(box.max_corner()) ? 2 : 1;
+    return row * 3 + column;
+}
+
+struct encoded_vector_tile {
+    uint64_t tile = 0;          // tile_grid key; row 0 is the southern row
+    std::vector<uint8_t> data;  // uncompressed MVT protobuf
+};
+
+inline size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+inline void putTag(std::vector<uint8_t>& out, uint32_t field, uint32_t wire_type) {
+    putVarint(out, (static_cast<uint64_t>(field) << 3) | wire_type);
+}
+
+inline void putBytesField(std::vector<uint8_t>& out, uint32_t field, const char* data, size_t size) {
+    putTag(out, field, 2);
+    putVarint(out, size);
+    out.insert(out.end(), data, data + size);
+}
+
+std::vector<encoded_vector_tile> encodeVectorTiles(const std::vector<labeled_point>& labels, const tile_grid& grid,
+    uint32_t extent = MVT_EXTENT) {
+    const tile_buckets buckets = bucketByTile(labels, grid);
+    std::vector<encoded_vector_tile> tiles(buckets.tiles.size());
+
+    const double units = extent / grid.tile_size;
+    parallelFor(tiles.size(), [&](size_t b) {
+        tiles[b].tile = buckets.tiles[b];
+        const uint32_t* members = buckets.order.data() + buckets.start[b];
+        const uint32_t count = buckets.start[b + 1] - buckets.start[b];
+        const point_t origin = grid.tileOrigin(buckets.tiles[b]);
+
+        // Value table: distinct texts in first-use order, then the offset
+        // indices up to the largest one in the tile, then the anchor names
+        std::vector<uint32_t> text_value(count);  // per member position
+        std::vector<uint32_t> first_use(count);   // distinct text -> first member position
+        std::vector<uint32_t> position(count);
+        for (uint32_t k = 0; k < count; ++k) {
+            position[k] = k;
+        }
+        std::stable_sort(position.begin(), position.end(),
+            [&](uint32_t a, uint32_t c) { return labels[members[a]].label < labels[members[c]].label; });
+        uint32_t texts = 0;
+        for (uint32_t k = 0; k < count; ++k) {
+            if (k == 0 || labels[members[position[k]]].label != labels[members[position[k - 1]]].label) {
+                first_use[texts++] = position[k];
+            }
+            text_value[position[k]] = texts - 1;
+        }
+        // Renumber distinct texts by first use so the table follows feature order
+        std::vector<uint32_t> rank(texts);
+        {
+            std::vector<uint32_t> distinct(texts);
+            for (uint32_t d = 0; d < texts; ++d) {
+                distinct[d] = d;
+            }
+            std::sort(distinct.begin(), distinct.end(), [&](uint32_t a, uint32_t c) { return first_use[a] < first_use[c]; });
+            for (uint32_t r = 0; r < texts; ++r) {
+                rank[distinct[r]] = r;
+            }
+        }
+
+        uint32_t offsets = 1;
+        for (uint32_t k = 0; k < count; ++k) {
+            offsets = std::max<uint32_t>(offsets, labels[members[k]].offset_index + 1u);
+        }
+
+        std::vector<uint8_t> layer;
+        layer.reserve(count * 24 + 64);
+        putBytesField(layer, 1, MVT_LAYER_NAME, std::strlen(MVT_LAYER_NAME));
+        for (uint32_t k = 0; k < count; ++k) {
+            const labeled_point& label = labels[members[k]];
+            const uint64_t id = members[k] + 1;
+            const uint32_t tags[6] = { 0, rank[text_value[k]], 1, texts + label.offset_index, 2, texts + offsets + mvtAnchor(label) };
+            const int64_t x = std::llround((bg::get<0>(label.point) - bg::get<0>(origin)) * units);
+            const int64_t y = std::llround(extent - (bg::get<1>(label.point) - bg::get<1>(origin)) * units);
+            const uint64_t geometry[3] = { (1u << 3) | 1u, zigzagEncode(x), zigzagEncode(y) }; // MoveTo(1)
+
+            size_t tags_size = 0, geometry_size = 0;
+            for (uint32_t tag : tags) {
+                tags_size += varintSize(tag);
+            }
+            for (uint64_t g : geometry) {
+                geometry_size += varintSize(g);
+            }
+            const size_t feature_size = 1 + varintSize(id) + 1 + varintSize(tags_size) + tags_size
+                + 2 + 1 + varintSize(geometry_size) + geometry_size;
+
+            putTag(layer, 2, 2);
+            putVarint(layer, feature_size);
+            putTag(layer, 1, 0);
+            putVarint(layer, id);
+            putTag(layer, 2, 2);
+            putVarint(layer, tags_size);
+            for (uint32_t tag : tags) {
+                putVarint(layer, tag);
+            }
+            putTag(layer, 3, 0);
+            putVarint(layer, 1);    // POINT
+            putTag(layer, 4, 2);
+            putVarint(layer, geometry_size);
+            for (uint64_t g : geometry) {
+                putVarint(layer, g);
+            }
+        }
+        putBytesField(layer, 3, "text", 4);
+        putBytesField(layer, 3, "offset", 6);
+        putBytesField(layer, 3, "anchor", 6);
+        std::vector<uint32_t> distinct_in_order(texts);
+        for (uint32_t d = 0; d < texts; ++d) {
+            distinct_in_order[rank[d]] = first_use[d];
+        }
+        for (uint32_t r = 0; r < texts; ++r) {
+            const std::string& text = labels[members[distinct_in_order[r]]].label;
+            putTag(layer, 4, 2);
+            putVarint(layer, 1 + varintSize(text.size()) + text.size());
+            putBytesField(layer, 1, text.data(), text.size());    // string_value
+        }
+        for (uint32_t o = 0; o < offsets; ++o) {
+            putTag(layer, 4, 2);
+            putVarint(layer, 1 + varintSize(o));
+            putTag(layer, 5, 0);                                  // uint_value
+            putVarint(layer, o);
+        }
+        for (const char* anchor : MVT_ANCHORS) {
+            const size_t size = std::strlen(anchor);
+            putTag(layer, 4, 2);
+            putVarint(layer, 1 + varintSize(size) + size);
+            putBytesField(layer, 1, anchor, size);
+        }
+        putTag(layer, 5, 0);
+        putVarint(layer, extent);
+        putTag(layer, 15, 0);
+        putVarint(layer, 2);        // version
+
+        std::vector<uint8_t>& out = tiles[b].data;
+        out.reserve(layer.size() + 8);
+        putTag(out, 3, 2);          // Tile.layers
+        putVarint(out, layer.size());
+        out.insert(out.end(), layer.begin(), layer.end());
+    });
+    return tiles;
+}
+
+// One tile for an MBTiles file; row counts from the south (TMS)
+struct mbtiles_tile {
+    int zoom = 0;
+    int column = 0;
+    int row = 0;
+    std::vector<uint8_t> data;
+};
+
+// MBTiles (SQLite) output. Tiles are queued by any number of producers and
+// written by a single writer thread, which owns the connection, reuses one
+// prepared INSERT and commits every batch_size tiles, so SQLite never sees a
+// transaction per tile. The queue is bounded: producers only wait when the
+// writer is a full queue behind.
+class mbtiles_writer {
+public:
+    // format is the MBTiles "format" metadata: "png", "jpg", "webp" or "pbf"
+    mbtiles_writer(const std::string& path, const std::string& format, const std::string& name,
+        size_t queue_capacity = 256, size_t batch_size = 1000)
+        : queue_(queue_capacity), batch_size_(std::max<size_t>(1, batch_size)) {
+#if defined(LABEL_PLACER_HAVE_SQLITE)
+        if (sqlite3_open(path.c_str(), &db_) != SQLITE_OK) {
+            fail("open");
+            return;
+        }
+        // A fresh offline package: no rollback journal or fsync needed while building it
+        const std::string schema =
+            "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;"
+            "CREATE TABLE IF NOT EXISTS metadata (name TEXT, value TEXT);"
+            "CREATE TABLE IF NOT EXISTS tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);"
+            "CREATE UNIQUE INDEX IF NOT EXISTS tile_index ON tiles (zoom_level, tile_column, tile_row);";
+        if (sqlite3_exec(db_, schema.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+            fail("create schema");
+            return;
+        }
+        setMetadata("name", name);
+        setMetadata("format", format);
+        setMetadata("type", "overlay");
+        setMetadata("version", "1");
+        if (sqlite3_prepare_v2(db_, "INSERT OR REPLACE INTO tiles VALUES (?, ?, ?, ?)", -1, &insert_, nullptr) != SQLITE_OK) {
+            fail("prepare insert");
+            return;
+        }
+        writer_ = std::thread(&mbtiles_writer::run, this);
+#else
+        (void)path;
+        (void)format;
+        (void)name;
+        error_ = "built without SQLite";
+        failed_ = true;
+#endif
+    }
+
+    ~mbtiles_writer() { close(); }
+
+    mbtiles_writer(const mbtiles_writer&) = delete;
+    mbtiles_writer& operator=(const mbtiles_writer&) = delete;
+
+    bool ok() const { return !failed_; }
+    const std::string& error() const { return error_; } // valid once close returned
+    size_t written() const { return written_; }
+
+    // Extra metadata rows (bounds, minzoom, maxzoom, json, ...). Only valid
+    // before the first push, while no writer thread uses the connection.
+    void setMetadata(const std::string& key, const std::string& value) {
+#if defined(LABEL_PLACER_HAVE_SQLITE)
+        sqlite3_stmt* statement = nullptr;
+        if (db_ && sqlite3_prepare_v2(db_, "INSERT INTO metadata VALUES (?, ?)", -1, &statement, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(statement, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(statement, 2, value.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_step(statement);
+        }
+        sqlite3_finalize(statement);
+#else
+        (void)key;
+        (void)value;
+#endif
+    }
+
+    void push(mbtiles_tile tile) {
+        if (ok()) {
+            queue_.push(std::move(tile));
+        }
+    }
+
+    // Flush the queue, commit and close the file. Returns ok().
+    bool close() {
+        queue_.close();
+        if (writer_.joinable()) {
+            writer_.join();
+        }
+#if defined(LABEL_PLACER_HAVE_SQLITE)
+        sqlite3_finalize(insert_);
+        insert_ = nullptr;
+        sqlite3_close(db_);
+        db_ = nullptr;
+#endif
+        return ok();
+    }
+
+private:
+#if defined(LABEL_PLACER_HAVE_SQLITE)
+    void fail(const char* what) {
+        error_ = std::string(what) + ": " + (db_ ? sqlite3_errmsg(db_) : "no connection");
+        failed_ = true;
+    }
+
+    void run() {
+        mbtiles_tile tile;
+        size_t in_transaction = 0;
+        while (queue_.pop(tile)) {
+            if (!ok()) {
+                continue; // keep draining so producers never block
+            }
+            if (in_transaction == 0 && sqlite3_exec(db_, "BEGIN", nullptr, nullptr, nullptr) != SQLITE_OK) {
+                fail("begin");
+                continue;
+            }
+            sqlite3_bind_int(insert_, 1, tile.zoom);
+            sqlite3_bind_int(insert_, 2, tile.column);
+            sqlite3_bind_int(insert_, 3, tile.row);
+            sqlite3_bind_blob(insert_, 4, tile.data.data(), static_cast<int>(tile.data.size()), SQLITE_STATIC);
+            if (sqlite3_step(insert_) != SQLITE_DONE) {
+                fail("insert tile");
+            }
+            sqlite3_reset(insert_);
+            ++written_;
+            if (++in_transaction == batch_size_) {
+                if (sqlite3_exec(db_, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+                    fail("commit");
+                }
+                in_transaction = 0;
+            }
+        }
+        if (in_transaction > 0 && sqlite3_exec(db_, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            fail("commit");
+        }
+    }
+
+    sqlite3* db_ = nullptr;
+    sqlite3_stmt* insert_ = nullptr;
+#endif
+    bounded_queue<mbtiles_tile> queue_;
+    size_t batch_size_;
+    std::atomic<size_t> written_{ 0 };
+    std::atomic<bool> failed_{ false };
+    std::string error_;
+    std::thread writer_;
+};
+
+// gzip wrapper around a buffer, as MBTiles expects for vector tiles. Returns
+// the input unchanged when zlib is unavailable.
+std::vector<uint8_t> gzipBytes(const std::vector<uint8_t>& data) {
+#if defined(LABEL_PLACER_HAVE_ZLIB)
+    z_stream stream{};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return data;
+    }
+    std::vector<uint8_t> out(deflateBound(&stream, static_cast<uLong>(data.size())) + 32);
+    stream.next_in = const_cast<Bytef*>(data.data());
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+#else
+    return data;
+#endif
+}
+
+// MBTiles pyramids are cut from a fixed world square, [0, MBTILES_WORLD_SIZE]
+// on both axes, taken as the Web Mercator world: zoom z splits it into 2^z by
+// 2^z tiles, so every tile has its parent at z - 1 whatever the data covers.
+// The square is the demo image's world (IMAGE_SIZE / SCALE), which holds the
+// sample and the fitted OSM input.
+const double MBTILES_WORLD_SIZE = IMAGE_SIZE / SCALE;
+
+// MBTiles "bounds" metadata (west,south,east,north in degrees) of a world box
+std::string mbtilesBounds(const box_t& box) {
+    const double pi = 3.14159265358979323846;
+    auto lon = [&](double x) { return std::max(-180.0, std::min(180.0, x / MBTILES_WORLD_SIZE * 360.0 - 180.0)); };
+    auto lat = [&](double y) {
+        const double t = std::max(0.0, std::min(1.0, y / MBTILES_WORLD_SIZE));
+        return std::atan(std::sinh(pi * (2.0 * t - 1.0))) * 180.0 / pi;
+    };
+    std::ostringstream out;
+    out << lon(bg::get<0>(box.min_corner())) << "," << lat(bg::get<1>(box.min_corner())) << ","
+        << lon(bg::get<0>(box.max_corner())) << "," << lat(bg::get<1>(box.max_corner()));
+    return out.str();
+}
+
+// Zoom range and bounds rows; must be set before the first tile is pushed
+void setPyramidMetadata(mbtiles_writer& writer, const box_t& bounds, int max_zoom) {
+    writer.setMetadata("minzoom", "0");
+    writer.setMetadata("maxzoom", std::to_string(max_zoom));
+    writer.setMetadata("bounds", mbtilesBounds(bounds));
+}
+
+// Vector tiles of the placement at zooms 0 to max_zoom. Grid rows count from
+// the south, which is the MBTiles (TMS) row order. Only anchors inside the
+// world square have a tile there; the others are left out and their count is
+// returned.
+size_t writeVectorTilesToMbtiles(mbtiles_writer& writer, const std::vector<labeled_point>& labels, int max_zoom) {
+    std::vector<labeled_point> inside;
+    inside.reserve(labels.size());
+    for (const auto& lp : labels) {
+        const double x = bg::get<0>(lp.point);
+        const double y = bg::get<1>(lp.point);
+        if (x >= 0.0 && x < MBTILES_WORLD_SIZE && y >= 0.0 && y < MBTILES_WORLD_SIZE) {
+            inside.push_back(lp);
+        }
+    }
+    for (int zoom = 0; zoom <= max_zoom; ++zoom) {
+        tile_grid grid;
+        grid.tile_size = MBTILES_WORLD_SIZE / (1u << zoom);
+        std::vector<encoded_vector_tile> tiles = encodeVectorTiles(inside, grid);
+        parallelFor(tiles.size(), [&](size_t b) {
+            mbtiles_tile tile;
+            tile.zoom = zoom;
+            tile.column = static_cast<int>(tile_grid::column(tiles[b].tile));
+            tile.row = static_cast<int>(tile_grid::row(tiles[b].tile));
+            tile.data = gzipBytes(tiles[b].data);
+            writer.push(std::move(tile));
+        });
+    }
+    return labels.size() - inside.size();
+}
+
+// Raster pyramid of the placement rendered with the viewer's tile renderer at
+// zooms 0 to max_zoom, each zoom's tiles 256 pixels over 1 / 2^z of the world
+// square. Only tiles overlapping the data are rendered. Tiles are rendered
+// and PNG encoded in parallel, one viewer state per tile, and handed to the
+// writer as they finish. Returns false if a tile failed to encode; that tile
+// is skipped.
+bool writeRasterPyramidToMbtiles(mbtiles_writer& writer, const std::vector<labeled_point>& placed,
+    const std::vector<std::pair<point_t, std::string>>& all_points, int max_zoom,
+    const placement_render_options& options = placement_render_options()) {
+    placement_view_index index = buildViewIndex(placed, all_points, options);
+    if (bg::get<0>(index.bounds.min_corner()) > bg::get<0>(index.bounds.max_corner())) {
+        return true;
+    }
+    std::atomic<bool> encoded{ true };
+    for (int zoom = 0; zoom <= max_zoom; ++zoom) {
+        const int tiles_per_side = 1 << zoom;
+        viewport view;
+        view.base_scale = VIEW_TILE_SIZE / MBTILES_WORLD_SIZE;
+        view.zoom = 4 * zoom; // the viewer doubles its scale every 4 steps
+        const double scale = view.scale();
+        // Viewer tile rows count down from world y = 0, so the world square
+        // spans rows -2^z to -1; that is TMS row -1 - ty
+        auto clampColumn = [&](int t) { return std::max(0, std::min(tiles_per_side - 1, t)); };
+        auto clampRow = [&](int t) { return std::max(-tiles_per_side, std::min(-1, t)); };
+        const int tx0 = clampColumn(cvFloor(bg::get<0>(index.bounds.min_corner()) * scale / VIEW_TILE_SIZE));
+        const int tx1 = clampColumn(cvFloor(bg::get<0>(index.bounds.max_corner()) * scale / VIEW_TILE_SIZE));
+        const int ty0 = clampRow(cvFloor(-bg::get<1>(index.bounds.max_corner()) * scale / VIEW_TILE_SIZE));
+        const int ty1 = clampRow(cvFloor(-bg::get<1>(index.bounds.min_corner()) * scale / VIEW_TILE_SIZE));
+        const int columns = tx1 - tx0 + 1;
+        const size_t count = static_cast<size_t>(columns) * (ty1 - ty0 + 1);
+        parallelFor(count, [&](size_t k) {
+            const int tx = tx0 + static_cast<int>(k % columns);
+            const int ty = ty0 + static_cast<int>(k / columns);
+            viewer_state state;
+            state.index = &index;
+            state.view = view;
+            view_tile rendered;
+            renderTileMarkers(state, tx, ty, rendered);
+            renderTileLabels(state, tx, ty, rendered);
+            mbtiles_tile tile;
+            tile.zoom = zoom;
+            tile.column = tx;
+            tile.row = -1 - ty;
+            if (!cv::imencode(".png", rendered.image, tile.data)) {
+                encoded = false;
+                return;
+            }
+            writer.push(std::move(tile));
+        });
+    }
+    return encoded;
+}
+
+// Label strings stored back to back in one buffer. Equal strings are interned
+// to a single id, so repeated names ("Main Street") are kept once. The lookup
+// keys are views into the buffer itself, re-pointed whenever it grows.
+// Offsets are 32-bit, so the buffer is capped at 4 GiB of text.
+struct label_arena {
+    std::string text;
+    std::vector<uint32_t> offsets{ 0 }; // label id k spans [offsets[k], offsets[k + 1])
+    std::unordered_map<std::string_view, uint32_t> ids;
+
+    size_t size() const { return offsets.size() - 1; }
+
+    uint32_t intern(const char* data, size_t length) {
+        auto found = ids.find(std::string_view(data, length));
+        if (found != ids.end()) {
+            return found->second;
+        }
+        if (length > std::numeric_limits<uint32_t>::max() - text.size()) {
+            throw std::runtime_error("label text exceeds 4 GiB");
+        }
+        const uint32_t id = static_cast<uint32_t>(size());
+        const char* before = text.data();
+        text.append(data, length);
+        offsets.push_back(static_cast<uint32_t>(text.size()));
+        if (text.data() != before) {
+            // The buffer moved: every key still points into the old one
+            ids.clear();
+            for (uint32_t k = 0; k < id; ++k) {
+                ids.emplace(view(k), k);
+            }
+        }
+        ids.emplace(view(id), id);
+        return id;
+    }
+
+    std::string_view view(uint32_t id) const {
+        return std::string_view(text.data() + offsets[id], offsets[id + 1] - offsets[id]);
+    }
+
+    std::string label(uint32_t id) const {
+        return text.substr(offsets[id], offsets[id + 1] - offsets[id]);
+    }
+};
+
+// Named nodes of an OpenStreetMap extract as placer input: lon/lat degrees in
+// SoA columns (see lonLatToMercator) and one label id per point
+struct osm_points {
+    point_columns lonlat;
+    std::vector<uint32_t> label_ids;
+    label_arena labels;
+
+    size_t size() const { return label_ids.size(); }
+};
+
+// Minimal protobuf wire-format reader for the PBF messages
+struct pbf_reader {
+    const uint8_t* p;
+    const uint8_t* end;
+    uint32_t field = 0;
+    uint32_t wire_type = 0;
+
+    pbf_reader(const uint8_t* begin, const uint8_t* finish) : p(begin), end(finish) {}
+
+    bool next() {
+        if (p == end) {
+            return false;
+        }
+        uint64_t key = getVarint(p, end);
+        field = static_cast<uint32_t>(key >> 3);
+        wire_type = static_cast<uint32_t>(key & 7);
+        return true;
+    }
+
+    uint64_t varint() { return getVarint(p, end); }
+
+    // Length-delimited payload (bytes, strings, sub-messages, packed arrays)
+    pbf_reader bytes() {
+        uint64_t length = getVarint(p, end);
+        if (length > static_cast<uint64_t>(end - p)) {
+            throw std::runtime_error("truncated protobuf field");
+        }
+        pbf_reader sub(p, p + length);
+        p += length;
+        return sub;
+    }
+
+    void skip() {
+        switch (wire_type) {
+        case 0: getVarint(p, end); break;
+        case 1: advance(8); break;
+        case 2: bytes(); break;
+        case 5: advance(4); break;
+        default: throw std::runtime_error("unsupported protobuf wire type");
+        }
+    }
+
+    void advance(size_t n) {
+        if (n > static_cast<size_t>(end - p)) {
+            throw std::runtime_error("truncated protobuf field");
+        }
+        p += n;
+    }
+};
+
+// Largest blob payload the OSM PBF format allows, compressed or inflated
+const size_t MAX_PBF_BLOB_SIZE = size_t(32) << 20;
+
+// Payload of one OSMData blob, inflated when zlib compressed. Sizes beyond
+// MAX_PBF_BLOB_SIZE are rejected before anything is allocated for them.
+std::vector<uint8_t> inflatePbfBlob(const uint8_t* data, size_t size) {
+    pbf_reader blob(data, data + size);
+    std::vector<uint8_t> out;
+    while (blob.next()) {
+        if (blob.field == 1 && blob.wire_type == 2) {          // raw
+            pbf_reader raw = blob.bytes();
+            if (static_cast<size_t>(raw.end - raw.p) > MAX_PBF_BLOB_SIZE) {
+                throw std::runtime_error("PBF blob too large");
+            }
+            out.assign(raw.p, raw.end);
+        } else if (blob.field == 2 && blob.wire_type == 0) {   // raw_size
+            uint64_t raw_size = blob.varint();
+            if (raw_size > MAX_PBF_BLOB_SIZE) {
+                throw std::runtime_error("PBF blob too large");
+            }
+            out.reserve(static_cast<size_t>(raw_size));
+        } else if (blob.field == 3 && blob.wire_type == 2) {   // zlib_data
+            pbf_reader compressed = blob.bytes();
+#if defined(LABEL_PLACER_HAVE_ZLIB)
+            z_stream stream{};
+            if (inflateInit(&stream) != Z_OK) {
+                throw std::runtime_error("inflateInit failed");
+            }
+            stream.next_in = const_cast<Bytef*>(compressed.p);
+            stream.avail_in = static_cast<uInt>(compressed.end - compressed.p);
+            uint8_t chunk[1 << 16];
+            int status = Z_OK;
+            while (status != Z_STREAM_END) {
+                stream.next_out = chunk;
+                stream.avail_out = sizeof(chunk);
+                status = inflate(&stream, Z_NO_FLUSH);
+                if (status != Z_OK && status != Z_STREAM_END) {
+                    inflateEnd(&stream);
+                    throw std::runtime_error("corrupt zlib blob");
+                }
+                if (static_cast<size_t>(stream.next_out - chunk) > MAX_PBF_BLOB_SIZE - out.size()) {
+                    inflateEnd(&stream);
+                    throw std::runtime_error("PBF blob inflates past the size limit");
+                }
+                out.insert(out.end(), chunk, stream.next_out);
+            }
+            inflateEnd(&stream);
+#else
+            (void)compressed;
+            throw std::runtime_error("zlib compressed PBF needs zlib");
+#endif
+        } else if (blob.wire_type == 2 && blob.field >= 4) {
+            throw std::runtime_error("unsupported PBF blob compression");
+        } else {
+            blob.skip();
+        }
+    }
+    return out;
+}
+
+// Named nodes of one decoded blob, names still local to the blob
+struct osm_blob_points {
+    std::vector<double> lon, lat;
+    std::vector<std::pair<uint32_t, uint32_t>> names; // [begin, end) in the blob's name text
+    std::string name_text;
+};
+
+// Decode a PrimitiveBlock, keeping plain and dense nodes that carry a name tag
+void decodePrimitiveBlock(const std::vector<uint8_t>& block, osm_blob_points& out) {
+    std::vector<std::pair<const uint8_t*, size_t>> strings;
+    std::vector<pbf_reader> groups;
+    int64_t granularity = 100, lat_offset = 0, lon_offset = 0;
+    pbf_reader message(block.data(), block.data() + block.size());
+    while (message.next()) {
+        if (message.field == 1 && message.wire_type == 2) {
+            pbf_reader table = message.bytes();
+            while (table.next()) {
+                if (table.field == 1 && table.wire_type == 2) {
+                    pbf_reader entry = table.bytes();
+                    strings.emplace_back(entry.p, static_cast<size_t>(entry.end - entry.p));
+                } else {
+                    table.skip();
+                }
+            }
+        } else if (message.field == 2 && message.wire_type == 2) {
+            groups.push_back(message.bytes());
+        } else if (message.field == 17 && message.wire_type == 0) {
+            granularity = static_cast<int64_t>(message.varint());
+        } else if (message.field == 19 && message.wire_type == 0) {
+            lat_offset = static_cast<int64_t>(message.varint());
+        } else if (message.field == 20 && message.wire_type == 0) {
+            lon_offset = static_cast<int64_t>(message.varint());
+        } else {
+            message.skip();
+        }
+    }
+
+    // Index of "name" in this block's string table, if present
+    uint64_t name_key = std::numeric_limits<uint64_t>::max();
+    for (size_t k = 0; k < strings.size(); ++k) {
+        if (strings[k].second == 4 && std::memcmp(strings[k].first, "name", 4) == 0) {
+            name_key = k;
+        }
+    }
+    if (name_key == std::numeric_limits<uint64_t>::max()) {
+        return;
+    }
+    auto string_at = [&](uint64_t k) {
+        if (k >= strings.size()) {
+            throw std::runtime_error("PBF string index out of range");
+        }
+        return strings[k];
+    };
+    auto add = [&](int64_t lat, int64_t lon, uint64_t value) {
+        auto name = string_at(value);
+        // Nodes may share one long string; keep the 32-bit name offsets valid
+        if (name.second > std::numeric_limits<uint32_t>::max() - out.name_text.size()) {
+            throw std::runtime_error("PBF block names exceed 4 GiB");
+        }
+        out.lat.push_back(1e-9 * static_cast<double>(lat_offset + granularity * lat));
+        out.lon.push_back(1e-9 * static_cast<double>(lon_offset + granularity * lon));
+        uint32_t begin = static_cast<uint32_t>(out.name_text.size());
+        out.name_text.append(reinterpret_cast<const char*>(name.first), name.second);
+        out.names.emplace_back(begin, static_cast<uint32_t>(out.name_text.size()));
+    };
+
+    for (pbf_reader& group : groups) {
+        while (group.next()) {
+            if (group.field == 1 && group.wire_type == 2) {
+                // Plain node: parallel keys / vals arrays
+                pbf_reader node = group.bytes();
+                std::vector<uint64_t> keys, vals;
+                int64_t lat = 0, lon = 0;
+                while (node.next()) {
+                    if ((node.field == 2 || node.field == 3) && node.wire_type == 2) {
+                        pbf_reader packed = node.bytes();
+                        std::vector<uint64_t>& column = node.field == 2 ? keys : vals;
+                        while (packed.p != packed.end) {
+                            column.push_back(packed.varint());
+                        }
+                    } else if (node.field == 8 && node.wire_type == 0) {
+                        lat = zigzagDecode(node.varint());
+                    } else if (node.field == 9 && node.wire_type == 0) {
+                        lon = zigzagDecode(node.varint());
+                    } else {
+                        node.skip();
+                    }
+                }
+                for (size_t k = 0; k < keys.size() && k < vals.size(); ++k) {
+                    if (keys[k] == name_key) {
+                        add(lat, lon, vals[k]);
+                        break;
+                    }
+                }
+            } else if (group.field == 2 && group.wire_type == 2) {
+                // Dense nodes: delta coded lat / lon columns and a flat
+                // key, value, ..., 0 list per node
+                pbf_reader dense = group.bytes();
+                pbf_reader lats(nullptr, nullptr), lons(nullptr, nullptr), tags(nullptr, nullptr);
+                while (dense.next()) {
+                    if (dense.field == 8 && dense.wire_type == 2) {
+                        lats = dense.bytes();
+                    } else if (dense.field == 9 && dense.wire_type == 2) {
+                        lons = dense.bytes();
+                    } else if (dense.field == 10 && dense.wire_type == 2) {
+                        tags = dense.bytes();
+                    } else {
+                        dense.skip();
+                    }
+                }
+                int64_t lat = 0, lon = 0;
+                while (lats.p != lats.end && lons.p != lons.end) {
+                    lat += zigzagDecode(lats.varint());
+                    lon += zigzagDecode(lons.varint());
+                    uint64_t name_value = std::numeric_limits<uint64_t>::max();
+                    while (tags.p != tags.end) {
+                        uint64_t key = tags.varint();
+                        if (key == 0) {
+                            break;
+                        }
+                        uint64_t value = tags.varint();
+                        if (key == name_key) {
+                            name_value = value;
+                        }
+                    }
+                    if (name_value != std::numeric_limits<uint64_t>::max()) {
+                        add(lat, lon, name_value);
+                    }
+                }
+            } else {
+                group.skip();
+            }
+        }
+    }
+}
+
+// Import the named nodes of an .osm.pbf file. The file is read once to find
+// the blobs, the OSMData blobs are then inflated and decoded in parallel, and
+// the results are appended in file order, interning names as they go.
+// Returns false if the file cannot be read or is malformed.
+bool readOsmPbf(const std::string& path, osm_points& result) {
+    std::vector<uint8_t> bytes;
+    if (!threadBulkIo().readFile(path, bytes)) {
+        return false;
+    }
+
+    try {
+        // Blob directory: [4-byte big-endian header size][BlobHeader][Blob]
+        std::vector<std::pair<size_t, size_t>> blobs; // offset and size of OSMData blobs
+        size_t pos = 0;
+        while (pos < bytes.size()) {
+            if (bytes.size() - pos < 4) {
+                return false;
+            }
+            size_t header_size = (size_t(bytes[pos]) << 24) | (size_t(bytes[pos + 1]) << 16)
+                | (size_t(bytes[pos + 2]) << 8) | size_t(bytes[pos + 3]);
+            pos += 4;
+            if (header_size > bytes.size() - pos) {
+                return false;
+            }
+            pbf_reader header(bytes.data() + pos, bytes.data() + pos + header_size);
+            pos += header_size;
+            std::string type;
+            uint64_t data_size = 0;
+            while (header.next()) {
+                if (header.field == 1 && header.wire_type == 2) {
+                    pbf_reader name = header.bytes();
+                    type.assign(reinterpret_cast<const char*>(name.p), name.end - name.p);
+                } else if (header.field == 3 && header.wire_type == 0) {
+                    data_size = header.varint();
+                } else {
+                    header.skip();
+                }
+            }
+            if (data_size > bytes.size() - pos || data_size > MAX_PBF_BLOB_SIZE) {
+                return false;
+            }
+            if (type == "OSMData") {
+                blobs.emplace_back(pos, static_cast<size_t>(data_size));
+            }
+            pos += data_size;
+        }
+
+        std::vector<osm_blob_points> decoded(blobs.size());
+        parallelFor(blobs.size(), [&](size_t b) {
+            decodePrimitiveBlock(inflatePbfBlob(bytes.data() + blobs[b].first, blobs[b].second), decoded[b]);
+        });
+
+        size_t total = result.size();
+        for (const auto& blob : decoded) {
+            total += blob.lon.size();
+        }
+        result.lonlat.x.reserve(total);
+        result.lonlat.y.reserve(total);
+        result.label_ids.reserve(total);
+        for (const auto& blob : decoded) {
+            result.lonlat.x.insert(result.lonlat.x.end(), blob.lon.begin(), blob.lon.end());
+            result.lonlat.y.insert(result.lonlat.y.end(), blob.lat.begin(), blob.lat.end());
+            for (const auto& name : blob.names) {
+                result.label_ids.push_back(result.labels.intern(blob.name_text.data() + name.first, name.second - name.first));
+            }
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
+// Placer input from imported points, in the units the columns are in
+std::vector<std::pair<point_t, std::string>> toPlacementInput(const osm_points& points) {
+    std::vector<std::pair<point_t, std::string>> input;
+    input.reserve(points.size());
+    for (size_t i = 0; i < points.size(); ++i) {
+        input.emplace_back(point_t(points.lonlat.x[i], points.lonlat.y[i]), points.labels.label(points.label_ids[i]));
+    }
+    return input;
+}
+
+// Storage for tile-local boxes: float offsets, or int32 steps of a quantum
+enum class local_precision { float32, int32 };
+
+// Conversions between a box relative to a tile origin (in double, computed
+// once per candidate) and the compact local form. Both forms round outwards,
+// so no true overlap is missed: the float form by one ulp, and the int32
+// form, kept half-open so findPixelOverlap can test it, by one quantum. Either
+// may reject a candidate that clears a neighbour by less than that step.
+void pushLocalBox(float_box_columns& boxes, double x0, double y0, double x1, double y1, double) {
+    boxes.push_back(floatDown(x0), floatDown(y0), floatUp(x1), floatUp(y1));
+}
+
+size_t findLocalOverlap(const float_box_columns& boxes, double x0, double y0, double x1, double y1, double) {
+    return findFloatOverlap(boxes, floatDown(x0), floatDown(y0), floatUp(x1), floatUp(y1));
+}
+
+pixel_rect quantizeLocalBox(double x0, double y0, double x1, double y1, double quantum) {
+    return pixel_rect{ static_cast<int32_t>(std::floor(x0 / quantum)), static_cast<int32_t>(std::floor(y0 / quantum)),
+        static_cast<int32_t>(std::ceil(x1 / quantum)) + 1, static_cast<int32_t>(std::ceil(y1 / quantum)) + 1 };
+}
+
+void pushLocalBox(pixel_rect_columns& boxes, double x0, double y0, double x1, double y1, double quantum) {
+    boxes.push_back(quantizeLocalBox(x0, y0, x1, y1, quantum));
+}
+
+size_t findLocalOverlap(const pixel_rect_columns& boxes, double x0, double y0, double x1, double y1, double quantum) {
+    return findPixelOverlap(quantizeLocalBox(x0, y0, x1, y1, quantum), boxes);
+}
+
+template <typename Boxes>
+class tile_local_placer {
+public:
+    // A tile's placed boxes and the origin they are relative to
+    struct tile_ref {
+        const Boxes* boxes;
+        double origin_x, origin_y;
+    };
+
+    tile_local_placer(double tile_size, double quantum) : tile_size_(tile_size), quantum_(quantum) {}
+
+    // Offset index of the first free candidate of a label of the given
+    // extent, which is then occupied, or -1. A box is kept in the tile of its
+    // anchor, so the tiles searched are those holding anchors within the
+    // candidate's reach plus the largest reach placed so far; with tiles at
+    // least twice that, only the 3x3 neighbourhood.
+    int place(const point_t& pt, const label_extent& extent) {
+        const double x = bg::get<0>(pt), y = bg::get<1>(pt);
+        const double reach = labelReach(extent) + max_reach_;
+        const int tx = static_cast<int>(std::floor(x / tile_size_));
+        const int ty = static_cast<int>(std::floor(y / tile_size_));
+        neighbours_.clear();
+        for (int ny = static_cast<int>(std::floor((y - reach) / tile_size_)); ny <= static_cast<int>(std::floor((y + reach) / tile_size_)); ++ny) {
+            for (int nx = static_cast<int>(std::floor((x - reach) / tile_size_)); nx <= static_cast<int>(std::floor((x + reach) / tile_size_)); ++nx) {
+                auto it = tiles_.find(viewTileKey(nx, ny));
+                if (it != tiles_.end()) {
+                    neighbours_.push_back(tile_ref{ &it->second, nx * tile_size_, ny * tile_size_ });
+                }
+            }
+        }
+        const int j = firstFree(pt, extent, neighbours_.data(), neighbours_.size(), quantum_);
+        if (j >= 0) {
+            occupy(tiles_[viewTileKey(tx, ty)], pt, extent, j, tx * tile_size_, ty * tile_size_, quantum_);
+            max_reach_ = std::max(max_reach_, labelReach(extent));
+        }
+        return j;
+    }
+
+    // The candidate test on its own, for callers that keep their tiles
+    // themselves: offset index of the first candidate of pt clear of the
+    // boxes of every given tile (its own tile included), or -1
+    static int firstFree(const point_t& pt, const label_extent& extent, const tile_ref* neighbours, size_t count, double quantum) {
+        for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+            box_t candidate_box = candidateBox(pt, j, extent);
+            const double bx0 = bg::get<0>(candidate_box.min_corner()), by0 = bg::get<1>(candidate_box.min_corner());
+            const double bx1 = bg::get<0>(candidate_box.max_corner()), by1 = bg::get<1>(candidate_box.max_corner());
+            bool blocked = false;
+            for (size_t n = 0; n < count && !blocked; ++n) {
+                const double ox = neighbours[n].origin_x, oy = neighbours[n].origin_y;
+                blocked = findLocalOverlap(*neighbours[n].boxes, bx0 - ox, by0 - oy, bx1 - ox, by1 - oy, quantum) != NO_OVERLAP;
+            }
+            if (!blocked) {
+                return static_cast<int>(j);
+            }
+        }
+        return -1;
+    }
+
+    // Add candidate j of pt to a tile's boxes, relative to the tile origin
+    static void occupy(Boxes& boxes, const point_t& pt, const label_extent& extent, int j,
+        double origin_x, double origin_y, double quantum) {
+        box_t candidate_box = candidateBox(pt, static_cast<size_t>(j), extent);
+        pushLocalBox(boxes, bg::get<0>(candidate_box.min_corner()) - origin_x, bg::get<1>(candidate_box.min_corner()) - origin_y,
+            bg::get<0>(candidate_box.max_corner()) - origin_x, bg::get<1>(candidate_box.max_corner()) - origin_y, quantum);
+    }
+
+private:
+    double tile_size_;
+    double quantum_;
+    double max_reach_ = 0.0;                    // largest labelReach placed
+    std::unordered_map<uint64_t, Boxes> tiles_; // sparse, keyed by tile coordinates
+    std::vector<tile_ref> neighbours_;          // scratch of place()
+};
+
+template <typename Boxes>
+std::vector<compact_label> placeLabelsTileLocalImpl(const std::vector<std::pair<point_t, std::string>>& input_points,
+    double tile_size, double quantum) {
+    tile_local_placer<Boxes> placer(tile_size, quantum);
+    std::vector<compact_label> result;
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        int j = placer.place(input_points[i].first, labelExtent(input_points[i].second));
+        if (j >= 0) {
+            result.emplace_back(i, static_cast<size_t>(j));
+        }
+    }
+    return result;
+}
+
+// Placement for planet-scale coordinates: every tile stores its placed boxes
+// relative to its own origin as float or quantized int32, and collisions are
+// tested in that compact local space with the SIMD kernels. Global
+// coordinates only reappear when the compact result is expanded for output.
+std::vector<compact_label> placeLabelsTileLocal(const std::vector<std::pair<point_t, std::string>>& input_points,
+    double tile_size, local_precision precision, double quantum = 1.0 / 4096.0) {
+    if (precision == local_precision::int32) {
+        return placeLabelsTileLocalImpl<pixel_rect_columns>(input_points, tile_size, quantum);
+    }
+    return placeLabelsTileLocalImpl<float_box_columns>(input_points, tile_size, quantum);
+}
+
+// Precise collision: labels collide only where the text drawn inside their
+// boxes does. Coverage is kept on a coarse grid of GLYPH_CELL world units
+// (two pixels) as one 64-bit word per cell row, bit k being column k from the
+// left.
+const double GLYPH_CELL = 2.0 / SCALE;
+const int GLYPH_MASK_ROWS = 16;
+
+// Coverage of a box by its text, relative to the box min corner
+struct glyph_pattern {
+    int rows = 0;
+    bool full = false; // box too large for a mask: any box overlap collides
+    std::array<uint64_t, GLYPH_MASK_ROWS> bits{};
+};
+
+// Cells of a label's box touched by its ink as the result image draws it
+// (the cached run, centred), grown by one pixel. The box is the label's
+// labelExtent, so it holds the whole run.
+glyph_pattern glyphPattern(const std::string& label, const label_extent& extent) {
+    const double width = extent.width, height = extent.height;
+    glyph_pattern pattern;
+    const int cols = static_cast<int>(std::ceil(width / GLYPH_CELL));
+    pattern.rows = static_cast<int>(std::ceil(height / GLYPH_CELL));
+    // One column and row stay free for the snap to the global grid
+    if (cols > 63 || pattern.rows > GLYPH_MASK_ROWS - 1) {
+        pattern.full = true;
+        return pattern;
+    }
+    const int w = std::max(1, static_cast<int>(std::lround(width * SCALE)));
+    const int h = std::max(1, static_cast<int>(std::lround(height * SCALE)));
+    const text_run& run = text_run_cache::instance().get(label);
+    const cv::Point origin = centredTextOrigin(cv::Rect(0, 0, w, h), run);
+    const int ox = origin.x, oy = origin.y - run.size.height;
+
+    const double px = 1.0 / SCALE;
+    for (int py = std::max(0, oy); py < std::min(h, oy + run.mask.rows); ++py) {
+        const uint8_t* row = run.mask.ptr<uint8_t>(py - oy);
+        // Pixel rows run downwards from the box top
+        const int r0 = std::max(0, static_cast<int>(((h - py - 2) * px) / GLYPH_CELL));
+        const int r1 = std::min(pattern.rows - 1, static_cast<int>(((h - py + 1) * px) / GLYPH_CELL));
+        for (int x = std::max(0, ox); x < std::min(w, ox + run.mask.cols); ++x) {
+            if (!row[x - ox]) {
+                continue;
+            }
+            const int c0 = std::max(0, static_cast<int>(((x - 1) * px) / GLYPH_CELL));
+            const int c1 = std::min(cols - 1, static_cast<int>(((x + 2) * px) / GLYPH_CELL));
+            const uint64_t span = ((uint64_t(2) << c1) - 1) & ~((uint64_t(1) << c0) - 1);
+            for (int r = r0; r <= r1; ++r) {
+                pattern.bits[r] |= span;
+            }
+        }
+    }
+    return pattern;
+}
+
+// A pattern placed on the global cell grid at cell (x, y)
+struct glyph_mask {
+    int32_t x = 0, y = 0;
+    int rows = 0;
+    bool full = false;
+    std::array<uint64_t, GLYPH_MASK_ROWS> bits{};
+};
+
+// Snapping a box corner down to the grid can move its text by up to one
+// cell, so every pattern cell also covers the next cell right and up
+glyph_mask placeGlyphPattern(const glyph_pattern& pattern, const box_t& box) {
+    glyph_mask mask;
+    mask.x = static_cast<int32_t>(std::floor(bg::get<0>(box.min_corner()) / GLYPH_CELL));
+    mask.y = static_cast<int32_t>(std::floor(bg::get<1>(box.min_corner()) / GLYPH_CELL));
+    mask.full = pattern.full;
+    if (!pattern.full) {
+        mask.rows = pattern.rows + 1;
+        for (int r = 0; r < pattern.rows; ++r) {
+            const uint64_t row = pattern.bits[r] | (pattern.bits[r] << 1);
+            mask.bits[r] |= row;
+            mask.bits[r + 1] |= row;
+        }
+    }
+    return mask;
+}
+
+bool masksIntersect(const glyph_mask& a, const glyph_mask& b) {
+    if (a.full || b.full) {
+        return true;
+    }
+    const int shift = b.x - a.x; // bit k of b is bit k + shift of a
+    if (shift >= 64 || shift <= -64) {
+        return false;
+    }
+    const int y1 = std::min(a.y + a.rows, b.y + b.rows);
+    for (int y = std::max(a.y, b.y); y < y1; ++y) {
+        const uint64_t ra = a.bits[y - a.y], rb = b.bits[y - b.y];
+        if (shift >= 0 ? (ra >> shift) & rb : ra & (rb >> -shift)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Placed boxes with their masks, bucketed by the tile of the box min corner.
+// A candidate runs the SIMD box scan first; only boxes it hits get the mask
+// AND, so a candidate clear of all boxes costs the same as a box test.
+class glyph_mask_index {
+public:
+    explicit glyph_mask_index(double max_box_size) : tile_size_(std::max(max_box_size, 1e-6)) {}
+
+    bool collides(const box_t& box, const glyph_mask& mask) const {
+        const double x0 = bg::get<0>(box.min_corner()), y0 = bg::get<1>(box.min_corner());
+        const double x1 = bg::get<0>(box.max_corner()), y1 = bg::get<1>(box.max_corner());
+        const int tx = static_cast<int>(std::floor(x0 / tile_size_)), ty = static_cast<int>(std::floor(y0 / tile_size_));
+        for (int ny = ty - 1; ny <= ty + 1; ++ny) {
+            for (int nx = tx - 1; nx <= tx + 1; ++nx) {
+                auto it = tiles_.find(viewTileKey(nx, ny));
+                if (it == tiles_.end()) {
+                    continue;
+                }
+                const tile& t = it->second;
+                const float ox = static_cast<float>(nx * tile_size_), oy = static_cast<float>(ny * tile_size_);
+                const float bx0 = static_cast<float>(x0) - ox, by0 = static_cast<float>(y0) - oy;
+                const float bx1 = static_cast<float>(x1) - ox, by1 = static_cast<float>(y1) - oy;
+                for (size_t i = findFloatOverlap(t.boxes, bx0, by0, bx1, by1); i != NO_OVERLAP;
+                     i = findFloatOverlap(t.boxes, bx0, by0, bx1, by1, i + 1)) {
+                    if (masksIntersect(mask, t.masks[i])) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    void insert(const box_t& box, const glyph_mask& mask) {
+        const double x0 = bg::get<0>(box.min_corner()), y0 = bg::get<1>(box.min_corner());
+        const int tx = static_cast<int>(std::floor(x0 / tile_size_)), ty = static_cast<int>(std::floor(y0 / tile_size_));
+        const float ox = static_cast<float>(tx * tile_size_), oy = static_cast<float>(ty * tile_size_);
+        tile& t = tiles_[viewTileKey(tx, ty)];
+        t.boxes.push_back(static_cast<float>(x0) - ox, static_cast<float>(y0) - oy,
+            static_cast<float>(bg::get<0>(box.max_corner())) - ox, static_cast<float>(bg::get<1>(box.max_corner())) - oy);
+        t.masks.push_back(mask);
+    }
+
+private:
+    struct tile {
+        float_box_columns boxes;
+        std::vector<glyph_mask> masks;
+    };
+    double tile_size_;
+    std::unordered_map<uint64_t, tile> tiles_;
+};
+
+// Greedy placement in input order where labels may share box area as long
+// as their text does not touch. Patterns are built once per distinct label.
+std::vector<compact_label> placeLabelsGlyphMasked(const std::vector<std::pair<point_t, std::string>>& input_points) {
+    double reach = 0.0;
+    const std::vector<label_extent> extents = measureLabels(input_points, &reach);
+    glyph_mask_index index(reach); // no box is larger than the furthest reach
+    std::unordered_map<std::string, glyph_pattern> patterns;
+    std::vector<compact_label> result;
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        const point_t& pt = input_points[i].first;
+        auto found = patterns.find(input_points[i].second);
+        if (found == patterns.end()) {
+            found = patterns.emplace(input_points[i].second, glyphPattern(input_points[i].second, extents[i])).first;
+        }
+        for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+            box_t candidate_box = candidateBox(pt, j, extents[i]);
+            glyph_mask mask = placeGlyphPattern(found->second, candidate_box);
+            if (!index.collides(candidate_box, mask)) {
+                index.insert(candidate_box, mask);
+                result.emplace_back(i, j);
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+// Position of a point along a Hilbert curve over bounds at 32-bit resolution
+// per axis. Sorting by it keeps points that are close in space mostly close
+// in the sequence.
+uint64_t hilbertKey(const point_t& p, const box_t& bounds) {
+    auto cell = [](double v, double lo, double hi) {
+        double t = hi > lo ? (v - lo) / (hi - lo) : 0.0;
+        t = std::max(0.0, std::min(1.0, t));
+        return static_cast<uint32_t>(std::min(t * 4294967296.0, 4294967295.0));
+    };
+    uint32_t x = cell(bg::get<0>(p), bg::get<0>(bounds.min_corner()), bg::get<0>(bounds.max_corner()));
+    uint32_t y = cell(bg::get<1>(p), bg::get<1>(bounds.min_corner()), bg::get<1>(bounds.max_corner()));
+    uint64_t d = 0;
+    for (uint32_t s = 1u << 31; s > 0; s >>= 1) {
+        const uint32_t rx = (x & s) ? 1 : 0;
+        const uint32_t ry = (y & s) ? 1 : 0;
+        d += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = ~x;
+                y = ~y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// One input point with its sort key
+struct sort_record {
+    uint64_t key = 0;
+    point_t point;
+    std::string label;
+};
+
+// External merge sort of input points by key, for inputs larger than memory.
+// Records are buffered until the memory budget is used, then sorted and
+// spilled to a run file in the spill directory. merge() streams all records
+// in key order (ties keep insertion order) through a k-way merge that reads
+// each run sequentially in large blocks. Run files are deleted afterwards.
+// Run layout per record: key, x, y as raw 8-byte values, label length as
+// varint, label bytes.
+class external_sorter {
+public:
+    explicit external_sorter(const std::string& spill_dir, size_t memory_budget = size_t(256) << 20)
+        : spill_dir_(spill_dir), memory_budget_(std::max<size_t>(memory_budget, 1 << 16)) {}
+
+    ~external_sorter() { removeRuns(); }
+
+    external_sorter(const external_sorter&) = delete;
+    external_sorter& operator=(const external_sorter&) = delete;
+
+    size_t runCount() const { return runs_.size(); }
+    size_t size() const { return total_; }
+
+    // Returns false if a run could not be spilled
+    bool add(uint64_t key, const point_t& point, const std::string& label) {
+        buffer_.push_back(sort_record{ key, point, label });
+        buffered_bytes_ += sizeof(sort_record) + label.size();
+        ++total_;
+        return buffered_bytes_ < memory_budget_ || spill();
+    }
+
+    // sink(const sort_record&) for every record in key order; false on I/O errors
+    template <typename Sink>
+    bool merge(Sink sink) {
+        if (runs_.empty()) {
+            std::stable_sort(buffer_.begin(), buffer_.end(), byKey);
+            for (const auto& record : buffer_) {
+                sink(record);
+            }
+            clear();
+            return true;
+        }
+        if (!buffer_.empty() && !spill()) {
+            return false;
+        }
+
+        // Each run gets an equal share of the budget as its read buffer
+        const size_t block = std::max<size_t>(memory_budget_ / runs_.size(), 1 << 16);
+        std::vector<run_reader> readers(runs_.size());
+        using head = std::pair<uint64_t, size_t>; // key, run
+        std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+        std::vector<sort_record> current(runs_.size());
+        for (size_t r = 0; r < runs_.size(); ++r) {
+            if (!readers[r].open(runs_[r], block)) {
+                return false;
+            }
+            if (readers[r].next(current[r])) {
+                heads.emplace(current[r].key, r);
+            }
+        }
+        while (!heads.empty()) {
+            const size_t r = heads.top().second;
+            heads.pop();
+            sink(current[r]);
+            if (readers[r].next(current[r])) {
+                heads.emplace(current[r].key, r);
+            }
+        }
+        bool ok = true;
+        for (const auto& reader : readers) {
+            ok &= !reader.failed;
+        }
+        clear();
+        return ok;
+    }
+
+private:
+    struct run_reader {
+        std::ifstream file;
+        std::vector<uint8_t> data;
+        size_t pos = 0;
+        size_t end = 0;
+        bool failed = false;
+
+        bool open(const std::string& path, size_t block) {
+            file.open(path, std::ios::binary);
+            data.resize(block);
+            return static_cast<bool>(file);
+        }
+
+        // Make at least n unread bytes available; false at end of run
+        bool ensure(size_t n) {
+            if (end - pos >= n) {
+                return true;
+            }
+            std::memmove(data.data(), data.data() + pos, end - pos);
+            end -= pos;
+            pos = 0;
+            if (data.size() < n) {
+                data.resize(n);
+            }
+            file.read(reinterpret_cast<char*>(data.data() + end), static_cast<std::streamsize>(data.size() - end));
+            end += static_cast<size_t>(file.gcount());
+            return end - pos >= n;
+        }
+
+        bool next(sort_record& record) {
+            if (!ensure(1)) {
+                return false;
+            }
+            try {
+                // A full record header: key, x, y and a varint of 1 to 10 bytes
+                if (!ensure(24 + 10) && end - pos < 24 + 1) {
+                    throw std::runtime_error("truncated run");
+                }
+                const uint8_t* p = data.data() + pos;
+                const uint8_t* stop = data.data() + end;
+                record.key = getRaw<uint64_t>(p, stop);
+                double x = getRaw<double>(p, stop);
+                double y = getRaw<double>(p, stop);
+                record.point = point_t(x, y);
+                const size_t length = static_cast<size_t>(getVarint(p, stop));
+                pos = static_cast<size_t>(p - data.data());
+                if (!ensure(length)) {
+                    throw std::runtime_error("truncated run");
+                }
+                record.label.assign(reinterpret_cast<const char*>(data.data() + pos), length);
+                pos += length;
+            } catch (const std::runtime_error&) {
+                failed = true;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    static bool byKey(const sort_record& a, const sort_record& b) { return a.key < b.key; }
+
+    bool spill() {
+        std::stable_sort(buffer_.begin(), buffer_.end(), byKey);
+        std::vector<uint8_t> bytes;
+        bytes.reserve(buffered_bytes_);
+        for (const auto& record : buffer_) {
+            putRaw(bytes, record.key);
+            putRaw(bytes, bg::get<0>(record.point));
+            putRaw(bytes, bg::get<1>(record.point));
+            putVarint(bytes, record.label.size());
+            bytes.insert(bytes.end(), record.label.begin(), record.label.end());
+        }
+        std::string path = newRunPath();
+        buffer_.clear();
+        buffered_bytes_ = 0;
+        if (path.empty()) {
+            return false;
+        }
+        runs_.push_back(path);
+        return threadBulkIo().writeFile(path, bytes);
+    }
+
+    // A fresh run file in the spill directory. mkstemp creates it atomically,
+    // so sorters in other processes sharing the directory never collide; on
+    // Windows the process id and the sorter's address keep names apart.
+    std::string newRunPath() const {
+#if defined(_MSC_VER)
+        return spill_dir_ + "/label_sort_" + std::to_string(_getpid()) + "_"
+            + std::to_string(reinterpret_cast<uintptr_t>(this)) + "_" + std::to_string(runs_.size()) + ".run";
+#else
+        std::string path = spill_dir_ + "/label_sort_XXXXXX";
+        const int fd = mkstemp(&path[0]);
+        if (fd < 0) {
+            return std::string();
+        }
+        close(fd);
+        return path;
+#endif
+    }
+
+    void removeRuns() {
+        for (const auto& path : runs_) {
+            std::remove(path.c_str());
+        }
+        runs_.clear();
+    }
+
+    void clear() {
+        removeRuns();
+        buffer_.clear();
+        buffered_bytes_ = 0;
+        total_ = 0;
+    }
+
+    std::string spill_dir_;
+    size_t memory_budget_;
+    std::vector<sort_record> buffer_;
+    size_t buffered_bytes_ = 0;
+    size_t total_ = 0;
+    std::vector<std::string> runs_;
+};
+
+// Streaming placement: records arrive in their final order straight from the
+// sorter's merge and each placed label is handed to sink(const labeled_point&)
+// at once, so neither the input nor the output is held in memory; only the
+// placed boxes are, as tile-local floats. Returns the number of records seen,
+// or 0 if the merge failed.
+template <typename Sink>
+size_t placeLabelsStreaming(external_sorter& sorted, Sink sink, double tile_size = 2.0) {
+    tile_local_placer<float_box_columns> placer(tile_size, 0.0);
+    size_t seen = 0;
+    bool ok = sorted.merge([&](const sort_record& record) {
+        ++seen;
+        const label_extent extent = labelExtent(record.label);
+        int j = placer.place(record.point, extent);
+        if (j >= 0) {
+            labeled_point lp;
+            lp.point = record.point;
+            lp.label = record.label;
+            lp.label_box = candidateBox(record.point, static_cast<size_t>(j), extent);
+            lp.offset_index = static_cast<uint8_t>(j);
+            sink(lp);
+        }
+    });
+    return ok ? seen : 0;
+}
+
+// CPUs grouped by NUMA node. Read from sysfs on Linux; everywhere else, or
+// when NUMA handling is switched off, all CPUs form a single node.
+struct numa_topology {
+    std::vector<std::vector<int>> node_cpus;
+
+    size_t nodeCount() const { return node_cpus.size(); }
+};
+
+// Parse a sysfs cpulist such as "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string& list) {
+    std::vector<int> cpus;
+    std::istringstream in(list);
+    std::string range;
+    while (std::getline(in, range, ',')) {
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0]))) {
+            continue;
+        }
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+numa_topology detectNumaTopology(bool numa_aware) {
+    numa_topology topology;
+#if defined(__linux__)
+    if (numa_aware) {
+        for (int node = 0; node < 1024; ++node) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) {
+                break;
+            }
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus = parseCpuList(list);
+            if (!cpus.empty()) {
+                topology.node_cpus.push_back(cpus);
+            }
+        }
+    }
+#else
+    (void)numa_aware;
+#endif
+    if (topology.node_cpus.empty()) {
+        // Single node without pinning: cpu -1 leaves scheduling to the OS
+        topology.node_cpus.assign(1, std::vector<int>(std::max(1u, std::thread::hardware_concurrency()), -1));
+    }
+    return topology;
+}
+
+// Pin the calling thread to one CPU; a no-op for cpu < 0 or off Linux
+void pinCurrentThread(int cpu) {
+#if defined(__linux__)
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+// Reusable barrier for a fixed number of threads
+class phase_barrier {
+public:
+    explicit phase_barrier(size_t count) : count_(count) {}
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t generation = generation_;
+        if (++waiting_ == count_) {
+            waiting_ = 0;
+            ++generation_;
+            cv_.notify_all();
+            return;
+        }
+        cv_.wait(lock, [&]() { return generation != generation_; });
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t count_;
+    size_t waiting_ = 0;
+    size_t generation_ = 0;
+};
+
+struct parallel_placement_options {
+    double tile_size = 4.0;  // grown to at least twice a label's reach
+    unsigned threads = 0;    // 0: one per CPU
+    bool numa_aware = true;  // off: one node, no pinning, same algorithm
+};
+
+// One tile of the parallel placer. Its inputs and placed boxes are copied and
+// allocated by a worker of the tile's node, so first touch puts them there.
+struct placement_tile {
+    int tx = 0;
+    int ty = 0;
+    int node = 0;
+    uint32_t first = 0;                 // slice of the bucketed input order
+    uint32_t count = 0;
+    std::array<int32_t, 9> neighbours;  // 3x3 block, -1 where empty, self at 4
+    std::vector<uint32_t> members;      // input indices, priority order
+    std::vector<double> x, y;           // member coordinates
+    float_box_columns boxes;            // placed boxes relative to the tile origin
+};
+
+// Parallel tiled placement. Tiles are coloured in a 2x2 pattern and the four
+// colours run one after another; tiles of one colour are two apart, so the
+// 3x3 neighbourhoods they read are never written concurrently. Tiles are split
+// into contiguous row-major ranges per NUMA node, workers are pinned to their
+// node's CPUs and take that node's tiles, and every worker appends to its own
+// result arena. Within a tile labels are placed in input order; across tiles
+// the colour order decides, so the result can differ from placeLabels while
+// still being overlap free. Returned in input order.
+std::vector<compact_label> placeLabelsParallel(const std::vector<std::pair<point_t, std::string>>& input_points,
+    const parallel_placement_options& options = parallel_placement_options()) {
+    double reach = 0.0;
+    const std::vector<label_extent> extents = measureLabels(input_points, &reach);
+    const double tile_size = std::max(options.tile_size, 2.0 * reach);
+
+    // Bucket the input into non-empty tiles (a counting sort keeps priority order)
+    std::vector<uint64_t> key_of(input_points.size());
+    std::unordered_map<uint64_t, int32_t> tile_ids;
+    std::vector<placement_tile> tiles;
+    std::vector<int32_t> tile_of(input_points.size());
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        int tx = static_cast<int>(std::floor(bg::get<0>(input_points[i].first) / tile_size));
+        int ty = static_cast<int>(std::floor(bg::get<1>(input_points[i].first) / tile_size));
+        auto inserted = tile_ids.emplace(viewTileKey(tx, ty), static_cast<int32_t>(tiles.size()));
+        if (inserted.second) {
+            tiles.emplace_back();
+            tiles.back().tx = tx;
+            tiles.back().ty = ty;
+        }
+        tile_of[i] = inserted.first->second;
+        ++tiles[tile_of[i]].count;
+    }
+    // Row-major tile order keeps each node's range spatially compact
+    std::vector<int32_t> by_position(tiles.size());
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        by_position[t] = static_cast<int32_t>(t);
+    }
+    std::sort(by_position.begin(), by_position.end(), [&](int32_t a, int32_t b) {
+        return tiles[a].ty != tiles[b].ty ? tiles[a].ty < tiles[b].ty : tiles[a].tx < tiles[b].tx;
+    });
+    uint32_t offset = 0;
+    for (int32_t t : by_position) {
+        tiles[t].first = offset;
+        offset += tiles[t].count;
+    }
+    std::vector<uint32_t> order(input_points.size());
+    std::vector<uint32_t> fill(tiles.size());
+    for (size_t t = 0; t < tiles.size(); ++t) {
+        fill[t] = tiles[t].first;
+    }
+    for (size_t i = 0; i < input_points.size(); ++i) {
+        order[fill[tile_of[i]]++] = static_cast<uint32_t>(i);
+    }
+    for (auto& tile : tiles) {
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                auto it = tile_ids.find(viewTileKey(tile.tx + dx, tile.ty + dy));
+                tile.neighbours[(dy + 1) * 3 + (dx + 1)] = it == tile_ids.end() ? -1 : it->second;
+            }
         }
     }
-    return false;
-}
-
-std::vector<labeled_point> placeLabels(const std::vector<std::pair<point_t, std::string>>& input_points) {
-    std::vector<labeled_point> result;
-    // Reduced label size for better visualization
-    const double label_width = 0.4;  // Reduced from 6.0
-    const double label_height = 0.2; // Reduced from 2.0
 
-    // Closer offsets - positions relative to point
-    std::vector<std::pair<double, double>> offsets = {
-        {0.2, 0.2},           // Top-right - much closer
-        {-0.2 - label_width, 0.2},  // Top-left  
-        {0.2, -0.2 - label_height}, // Bottom-right
-        {-0.2 - label_width, -0.2 - label_height} // Bottom-left
+    // Workers and their nodes
+    numa_topology topology = detectNumaTopology(options.numa_aware);
+    struct worker_slot {
+        int node;
+        int cpu;
     };
+    std::vector<worker_slot> workers;
+    size_t total_cpus = 0;
+    for (const auto& cpus : topology.node_cpus) {
+        total_cpus += cpus.size();
+    }
+    const size_t thread_count = std::max<size_t>(1, std::min<size_t>(options.threads ? options.threads : total_cpus, std::max<size_t>(1, tiles.size())));
+    for (size_t w = 0; w < thread_count; ++w) {
+        // Spread workers over nodes in proportion to their CPUs
+        size_t slot = w * total_cpus / thread_count;
+        int node = 0;
+        while (slot >= topology.node_cpus[node].size()) {
+            slot -= topology.node_cpus[node].size();
+            ++node;
+        }
+        workers.push_back(worker_slot{ node, topology.node_cpus[node][slot] });
+    }
+    std::vector<int> node_workers(topology.nodeCount(), 0);
+    for (const auto& worker : workers) {
+        ++node_workers[worker.node];
+    }
+    // Tiles are split into contiguous ranges over the nodes that have
+    // workers; a node without workers gets no tiles
+    std::vector<int> active_nodes;
+    for (size_t n = 0; n < topology.nodeCount(); ++n) {
+        if (node_workers[n] > 0) {
+            active_nodes.push_back(static_cast<int>(n));
+        }
+    }
+    for (size_t r = 0; r < by_position.size(); ++r) {
+        tiles[by_position[r]].node = active_nodes[r * active_nodes.size() / by_position.size()];
+    }
+    std::vector<std::array<std::vector<int32_t>, 4>> node_colour_tiles(topology.nodeCount());
+    for (int32_t t : by_position) {
+        int colour = (tiles[t].tx & 1) + 2 * (tiles[t].ty & 1);
+        node_colour_tiles[tiles[t].node][colour].push_back(t);
+    }
 
-    for (size_t i = 0; i < input_points.size(); ++i) {
-        const point_t& pt = input_points[i].first;
-        const std::string& label_str = input_points[i].second;
-        boost::optional<labeled_point> successfully_placed;
-
-        for (size_t j = 0; j < offsets.size(); ++j) {
-            double offset_x = offsets[j].first;
-            double offset_y = offsets[j].second;
+    std::vector<huge_vector<compact_label>> arenas(workers.size());
+    std::vector<std::unique_ptr<std::atomic<size_t>>> cursors;
+    for (size_t n = 0; n < topology.nodeCount() * 5; ++n) {
+        cursors.emplace_back(new std::atomic<size_t>(0));
+    }
+    phase_barrier barrier(workers.size());
 
-            point_t corner1, corner2;
-            // Calculate box corners based on offset from point
-            bg::set<0>(corner1, bg::get<0>(pt) + offset_x);
-            bg::set<1>(corner1, bg::get<1>(pt) + offset_y);
-            bg::set<0>(corner2, bg::get<0>(corner1) + label_width);
-            bg::set<1>(corner2, bg::get<1>(corner1) + label_height);
+    // Tile-local candidate test shared with placeLabelsTileLocal, against
+    // the boxes this tile and its neighbours hold
+    using placer = tile_local_placer<float_box_columns>;
+    auto place_tile = [&](placement_tile& tile, huge_vector<compact_label>& arena) {
+        placer::tile_ref neighbours[9];
+        size_t count = 0;
+        for (int32_t neighbour : tile.neighbours) {
+            if (neighbour >= 0) {
+                const placement_tile& other = tiles[neighbour];
+                neighbours[count++] = placer::tile_ref{ &other.boxes, other.tx * tile_size, other.ty * tile_size };
+            }
+        }
+        for (uint32_t k = 0; k < tile.count; ++k) {
+            point_t pt(tile.x[k], tile.y[k]);
+            const label_extent& extent = extents[tile.members[k]];
+            const int j = placer::firstFree(pt, extent, neighbours, count, 0.0);
+            if (j >= 0) {
+                placer::occupy(tile.boxes, pt, extent, j, tile.tx * tile_size, tile.ty * tile_size, 0.0);
+                arena.emplace_back(tile.members[k], static_cast<size_t>(j));
+            }
+        }
+    };
 
-            box_t candidate_box(corner1, corner2);
+    auto run_worker = [&](size_t w) {
+        pinCurrentThread(workers[w].cpu);
+        const int node = workers[w].node;
+        huge_vector<compact_label>& arena = arenas[w];
 
-            if (!hasOverlap(candidate_box, result)) {
-                successfully_placed = labeled_point{ pt, label_str, candidate_box };
-                break;
+        // First touch: this node's workers copy their tiles' inputs
+        std::atomic<size_t>& copy_cursor = *cursors[node * 5 + 4];
+        std::vector<int32_t> node_tiles;
+        for (const auto& colour : node_colour_tiles[node]) {
+            node_tiles.insert(node_tiles.end(), colour.begin(), colour.end());
+        }
+        for (size_t k = copy_cursor++; k < node_tiles.size(); k = copy_cursor++) {
+            placement_tile& tile = tiles[node_tiles[k]];
+            tile.members.assign(order.begin() + tile.first, order.begin() + tile.first + tile.count);
+            tile.x.resize(tile.count);
+            tile.y.resize(tile.count);
+            for (uint32_t m = 0; m < tile.count; ++m) {
+                tile.x[m] = bg::get<0>(input_points[tile.members[m]].first);
+                tile.y[m] = bg::get<1>(input_points[tile.members[m]].first);
             }
+            tile.boxes.x0.reserve(tile.count);
+            tile.boxes.y0.reserve(tile.count);
+            tile.boxes.x1.reserve(tile.count);
+            tile.boxes.y1.reserve(tile.count);
         }
-        if (successfully_placed) {
-            result.push_back(*successfully_placed);
+        barrier.wait();
+
+        for (int colour = 0; colour < 4; ++colour) {
+            const std::vector<int32_t>& list = node_colour_tiles[node][colour];
+            std::atomic<size_t>& cursor = *cursors[node * 5 + colour];
+            for (size_t k = cursor++; k < list.size(); k = cursor++) {
+                place_tile(tiles[list[k]], arena);
+            }
+            barrier.wait();
         }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t w = 1; w < workers.size(); ++w) {
+        threads.emplace_back(run_worker, w);
+    }
+    run_worker(0);
+    for (auto& thread : threads) {
+        thread.join();
     }
+
+    std::vector<compact_label> result;
+    for (const auto& arena : arenas) {
+        result.insert(result.end(), arena.begin(), arena.end());
+    }
+    std::sort(result.begin(), result.end(),
+        [](compact_label a, compact_label b) { return a.packed < b.packed; });
     return result;
 }
 
-// Convert from our coordinate system to image coordinates
-cv::Point worldToImage(const point_t& world_point, double scale, int image_size) {
-    int x = static_cast<int>(bg::get<0>(world_point) * scale);
-    int y = image_size - static_cast<int>(bg::get<1>(world_point) * scale); // Flip Y axis
-    return cv::Point(x, y);
+// One hardware event counted with perf_event_open for the calling thread.
+// Where the platform or the kernel does not provide it (other systems,
+// containers, perf_event_paranoid), available() is false and stop() returns -1.
+struct perf_counter {
+    int fd = -1;
+
+    perf_counter(uint32_t type, uint64_t config) {
+#if defined(__linux__)
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+        (void)type;
+        (void)config;
+#endif
+    }
+    ~perf_counter() {
+#if defined(__linux__)
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+    perf_counter(const perf_counter&) = delete;
+    perf_counter& operator=(const perf_counter&) = delete;
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#if defined(__linux__)
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    int64_t stop() {
+#if defined(__linux__)
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            int64_t value = 0;
+            if (read(fd, &value, sizeof(value)) == static_cast<ssize_t>(sizeof(value))) {
+                return value;
+            }
+        }
+#endif
+        return -1;
+    }
+};
+
+#if defined(__linux__)
+const uint32_t PERF_HARDWARE_TYPE = PERF_TYPE_HARDWARE;
+const uint64_t PERF_CYCLES = PERF_COUNT_HW_CPU_CYCLES;
+const uint64_t PERF_INSTRUCTIONS = PERF_COUNT_HW_INSTRUCTIONS;
+const uint64_t PERF_BRANCH_MISSES = PERF_COUNT_HW_BRANCH_MISSES;
+const uint32_t PERF_CACHE_TYPE = PERF_TYPE_HW_CACHE;
+const uint64_t PERF_L1D_READ_MISSES = PERF_COUNT_HW_CACHE_L1D
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+const uint64_t PERF_LLC_READ_MISSES = PERF_COUNT_HW_CACHE_LL
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+const uint64_t PERF_DTLB_READ_MISSES = PERF_COUNT_HW_CACHE_DTLB
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+#else
+const uint32_t PERF_HARDWARE_TYPE = 0;
+const uint64_t PERF_CYCLES = 0;
+const uint64_t PERF_INSTRUCTIONS = 0;
+const uint64_t PERF_BRANCH_MISSES = 0;
+const uint32_t PERF_CACHE_TYPE = 0;
+const uint64_t PERF_L1D_READ_MISSES = 0;
+const uint64_t PERF_LLC_READ_MISSES = 0;
+const uint64_t PERF_DTLB_READ_MISSES = 0;
+#endif
+
+// Counters read around one benchmark phase; -1 marks an unavailable counter
+struct perf_sample {
+    double wall_ms = 0.0;
+    int64_t cycles = -1;
+    int64_t instructions = -1;
+    int64_t l1d_misses = -1;
+    int64_t llc_misses = -1;
+    int64_t branch_misses = -1;
+};
+
+// The standard set of counters for a benchmark phase. Each event is opened on
+// its own, so a missing one (common for cache events in VMs) leaves the rest.
+struct perf_counter_set {
+    perf_counter cycles{ PERF_HARDWARE_TYPE, PERF_CYCLES };
+    perf_counter instructions{ PERF_HARDWARE_TYPE, PERF_INSTRUCTIONS };
+    perf_counter l1d_misses{ PERF_CACHE_TYPE, PERF_L1D_READ_MISSES };
+    perf_counter llc_misses{ PERF_CACHE_TYPE, PERF_LLC_READ_MISSES };
+    perf_counter branch_misses{ PERF_HARDWARE_TYPE, PERF_BRANCH_MISSES };
+    std::chrono::steady_clock::time_point started;
+
+    void start() {
+        cycles.start();
+        instructions.start();
+        l1d_misses.start();
+        llc_misses.start();
+        branch_misses.start();
+        started = std::chrono::steady_clock::now();
+    }
+
+    perf_sample stop() {
+        perf_sample sample;
+        sample.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+        sample.cycles = cycles.stop();
+        sample.instructions = instructions.stop();
+        sample.l1d_misses = l1d_misses.stop();
+        sample.llc_misses = llc_misses.stop();
+        sample.branch_misses = branch_misses.stop();
+        return sample;
+    }
+};
+
+std::string jsonCount(int64_t value) {
+    return value < 0 ? std::string("null") : std::to_string(value);
 }
 
-// Get image coordinates for a box
-cv::Rect worldBoxToImageRect(const box_t& box, double scale, int image_size) {
-    cv::Point top_left = worldToImage(box.min_corner(), scale, image_size);
-    cv::Point bottom_right = worldToImage(box.max_corner(), scale, image_size);
-    return cv::Rect(top_left, bottom_right);
+std::string jsonRatio(int64_t numerator, double denominator) {
+    if (numerator < 0 || denominator <= 0.0) {
+        return "null";
+    }
+    std::ostringstream out;
+    out << numerator / denominator;
+    return out.str();
 }
 
-// Visualize results using OpenCV
-void visualizeWithOpenCV(const std::vector<labeled_point>& placed_labels,
-    const std::vector<std::pair<point_t, std::string>>& all_points) {
-    const int IMAGE_SIZE = 600;  // Reduced image size for better density
-    const double SCALE = 80.0;   // Increased scale to spread out points more
-    const int POINT_RADIUS = 6;
+// One phase as a JSON object: raw counters, IPC and per-label rates
+void writePerfJson(std::ostream& out, const perf_sample& sample, size_t labels) {
+    const double per = static_cast<double>(labels);
+    out << "{\"wall_ms\": " << sample.wall_ms << ", \"labels\": " << labels
+        << ", \"cycles\": " << jsonCount(sample.cycles) << ", \"instructions\": " << jsonCount(sample.instructions)
+        << ", \"ipc\": " << (sample.cycles > 0 ? jsonRatio(sample.instructions, static_cast<double>(sample.cycles)) : "null")
+        << ", \"l1d_misses\": " << jsonCount(sample.l1d_misses) << ", \"llc_misses\": " << jsonCount(sample.llc_misses)
+        << ", \"branch_misses\": " << jsonCount(sample.branch_misses)
+        << ", \"l1d_misses_per_label\": " << jsonRatio(sample.l1d_misses, per)
+        << ", \"llc_misses_per_label\": " << jsonRatio(sample.llc_misses, per)
+        << ", \"branch_misses_per_label\": " << jsonRatio(sample.branch_misses, per) << "}";
+}
 
-    // Create a white image
-    cv::Mat image(IMAGE_SIZE, IMAGE_SIZE, CV_8UC3, cv::Scalar(255, 255, 255));
+// Uniformly scattered points at a density where most candidates collide
+std::vector<std::pair<point_t, std::string>> makeBenchmarkPoints(size_t count, unsigned seed = 42) {
+    std::mt19937 rng(seed);
+    const double side = std::sqrt(static_cast<double>(count)) * 0.5;
+    std::uniform_real_distribution<double> coord(0.0, side);
+    std::vector<std::pair<point_t, std::string>> points;
+    points.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        points.emplace_back(point_t(coord(rng), coord(rng)), "P" + std::to_string(i));
+    }
+    return points;
+}
 
-    // First draw all potential points in light gray
-    for (const auto& point_pair : all_points) {
-        cv::Point img_point = worldToImage(point_pair.first, SCALE, IMAGE_SIZE);
-        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(200, 200, 200), -1);
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Viewer frames rendered at the interactive budget until the view is fully refined
+struct viewer_frame_stats {
+    size_t frames = 0;
+    double first_ms = 0.0;
+    double max_ms = 0.0;
+    double total_ms = 0.0;
+};
+
+viewer_frame_stats measureViewerFrames(viewer_state& state) {
+    viewer_frame_stats stats;
+    do {
+        auto start = std::chrono::steady_clock::now();
+        renderViewerFrame(state, VIEWER_FRAME_BUDGET_MS);
+        const double ms = elapsedMs(start);
+        stats.first_ms = stats.frames == 0 ? ms : stats.first_ms;
+        stats.max_ms = std::max(stats.max_ms, ms);
+        stats.total_ms += ms;
+        ++stats.frames;
+    } while (state.refinement_pending);
+    return stats;
+}
+
+void writeViewerFramesJson(std::ostream& out, const viewer_frame_stats& stats) {
+    out << "{\"frames\": " << stats.frames << ", \"first_ms\": " << stats.first_ms << ", \"max_ms\": " << stats.max_ms
+        << ", \"mean_ms\": " << (stats.frames ? stats.total_ms / stats.frames : 0.0) << "}";
+}
+
+// Compare collision backends on the hasOverlap pattern: a full greedy
+// placement (query + insert), then a static query phase where every candidate
+// box of every input point is tested and most of them hit. Prints JSON.
+void runCollisionBenchmark(size_t count) {
+    auto points = makeBenchmarkPoints(count);
+    const bool run_linear = count <= 20000; // quadratic, only for small inputs
+
+    std::cout << "{\n  \"points\": " << count << ",\n  \"backends\": [";
+    const char* separator = "\n";
+    auto report = [&](const char* name, double place_ms, size_t placed, double query_ms, size_t queries, size_t hits) {
+        std::cout << separator << "    {\"backend\": \"" << name << "\", \"place_ms\": " << place_ms
+            << ", \"placed\": " << placed << ", \"query_ns\": " << (queries ? query_ms * 1e6 / queries : 0.0)
+            << ", \"queries\": " << queries << ", \"hit_rate\": " << (queries ? static_cast<double>(hits) / queries : 0.0) << "}";
+        separator = ",\n";
+    };
+    const std::vector<label_extent> extents = measureLabels(points);
+    auto query_all = [&](const auto& index, size_t& hits) {
+        hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < points.size(); ++i) {
+            for (size_t j = 0; j < LABEL_SIDES.size(); ++j) {
+                hits += index.findOverlap(candidateBox(points[i].first, j, extents[i])) != NO_OVERLAP;
+            }
+        }
+        return elapsedMs(start);
+    };
+    const size_t queries = points.size() * LABEL_SIDES.size();
+
+    if (run_linear) {
+        collision_index index;
+        auto start = std::chrono::steady_clock::now();
+        size_t placed = placeLabelsWithIndex(points, index, nullptr).size();
+        double place_ms = elapsedMs(start);
+        size_t hits;
+        double query_ms = query_all(index, hits);
+        report("linear", place_ms, placed, query_ms, queries, hits);
     }
+    {
+        rtree_collision_index index;
+        auto start = std::chrono::steady_clock::now();
+        size_t placed = placeLabelsWithIndex(points, index, nullptr).size();
+        double place_ms = elapsedMs(start);
+        size_t hits;
+        double query_ms = query_all(index, hits);
+        report("rtree", place_ms, placed, query_ms, queries, hits);
 
-    // Draw successfully placed labels
-    for (const auto& lp : placed_labels) {
-        // Draw the point in blue
-        cv::Point img_point = worldToImage(lp.point, SCALE, IMAGE_SIZE);
-        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(255, 0, 0), -1);
-        cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 0), 1); // Black border
+        // Static index from the same boxes with packing
+        std::vector<std::pair<box_t, size_t>> entries(index.tree.begin(), index.tree.end());
+        rtree_collision_index packed;
+        packed.tree = decltype(packed.tree)(entries.begin(), entries.end());
+        query_ms = query_all(packed, hits);
+        report("rtree_packed", 0.0, placed, query_ms, queries, hits);
+    }
+    {
+        // Integer pixel-space placement on its grid, next to the double
+        // backends. Placement includes snapping every candidate; queries snap
+        // the same world boxes the double backends are queried with.
+        auto start = std::chrono::steady_clock::now();
+        std::vector<labeled_point> placed = placeLabelsPixelAligned(points, SCALE, IMAGE_SIZE);
+        double place_ms = elapsedMs(start);
+        pixel_rect_grid grid;
+        for (const auto& lp : placed) {
+            grid.insert(toPixelRect(worldBoxToImageRect(lp.label_box, SCALE, IMAGE_SIZE)));
+        }
+        struct snapped_grid {
+            const pixel_rect_grid& grid;
+            size_t findOverlap(const box_t& box) const { return grid.findOverlap(toPixelRect(worldBoxToImageRect(box, SCALE, IMAGE_SIZE))); }
+        } snapped{ grid };
+        size_t hits;
+        double query_ms = query_all(snapped, hits);
+        report("pixel_aligned", place_ms, placed.size(), query_ms, queries, hits);
+    }
+    {
+        wide_bvh index;
+        auto start = std::chrono::steady_clock::now();
+        size_t placed = placeLabelsWithIndex(points, index, nullptr).size();
+        double place_ms = elapsedMs(start);
+        index.refit();
+        size_t hits;
+        double query_ms = query_all(index, hits);
+        report("wide_bvh", place_ms, placed, query_ms, queries, hits);
 
-        // Draw the label box in green
-        cv::Rect box_rect = worldBoxToImageRect(lp.label_box, SCALE, IMAGE_SIZE);
-        cv::rectangle(image, box_rect, cv::Scalar(0, 255, 0), 2);
+        wide_bvh packed;
+        packed.build(index.items);
+        query_ms = query_all(packed, hits);
+        report("wide_bvh_packed", 0.0, placed, query_ms, queries, hits);
 
-        // Draw connection line from point to label box center
-        cv::Point box_center(box_rect.x + box_rect.width / 2, box_rect.y + box_rect.height / 2);
-        cv::line(image, img_point, box_center, cv::Scalar(0, 0, 255), 1, cv::LINE_AA);
+        // Same static index in both layouts, with cache misses where counters are readable
+        std::cout << "\n  ],\n  \"static_layouts\": [";
+        separator = "\n";
+        for (bvh_layout layout : { bvh_layout::breadth_first, bvh_layout::van_emde_boas }) {
+            wide_bvh laid_out;
+            laid_out.build(index.items, layout);
+            perf_counter l1_misses(PERF_CACHE_TYPE, PERF_L1D_READ_MISSES);
+            perf_counter llc_misses(PERF_CACHE_TYPE, PERF_LLC_READ_MISSES);
+            perf_counter tlb_misses(PERF_CACHE_TYPE, PERF_DTLB_READ_MISSES);
+            l1_misses.start();
+            llc_misses.start();
+            tlb_misses.start();
+            query_ms = query_all(laid_out, hits);
+            int64_t l1 = l1_misses.stop();
+            int64_t llc = llc_misses.stop();
+            int64_t tlb = tlb_misses.stop();
+            std::cout << separator << "    {\"layout\": \""
+                << (layout == bvh_layout::van_emde_boas ? "van_emde_boas" : "breadth_first")
+                << "\", \"nodes\": " << laid_out.nodes.size() << ", \"query_ns\": " << query_ms * 1e6 / queries
+                << ", \"l1d_read_misses\": " << (l1 < 0 ? std::string("null") : std::to_string(l1))
+                << ", \"llc_read_misses\": " << (llc < 0 ? std::string("null") : std::to_string(llc))
+                << ", \"dtlb_read_misses\": " << (tlb < 0 ? std::string("null") : std::to_string(tlb)) << "}";
+            separator = ",\n";
+        }
+    }
+
+    // Full scans of the SoA coordinate columns, the case huge pages are for.
+    // Run with --huge-pages off|thp|explicit to compare the backings.
+    {
+        point_columns columns = toPointColumns(points);
+        huge_vector<int32_t> px(columns.size()), py(columns.size());
+        const size_t passes = 8;
+        perf_counter tlb_misses(PERF_CACHE_TYPE, PERF_DTLB_READ_MISSES);
+        tlb_misses.start();
+        auto start = std::chrono::steady_clock::now();
+        for (size_t pass = 0; pass < passes; ++pass) {
+            worldToImageBatch(columns.x.data(), columns.y.data(), columns.size(), 0.5 * pass, 0.0,
+                SCALE, IMAGE_SIZE, px.data(), py.data());
+        }
+        double scan_ms = elapsedMs(start);
+        int64_t tlb = tlb_misses.stop();
+        const huge_page_mode mode = hugePageMode();
+        std::cout << "\n  ],\n  \"huge_pages\": {\"mode\": \""
+            << (mode == huge_page_mode::explicit_pages ? "explicit" : mode == huge_page_mode::transparent ? "thp" : "off")
+            << "\", \"explicit_bytes\": " << hugePageStats().explicit_bytes
+            << ", \"transparent_bytes\": " << hugePageStats().transparent_bytes
+            << ", \"heap_bytes\": " << hugePageStats().heap_bytes
+            << ", \"column_scan_ns\": " << scan_ms * 1e6 / (passes * columns.size())
+            << ", \"dtlb_read_misses\": " << (tlb < 0 ? std::string("null") : std::to_string(tlb)) << "}";
+    }
 
-        // Put the label text centered inside the box
-        int baseline = 0;
-        cv::Size text_size = cv::getTextSize(lp.label, cv::FONT_HERSHEY_SIMPLEX, 0.3, 1, &baseline);
-        cv::Point text_org(box_rect.x + (box_rect.width - text_size.width) / 2,
-            box_rect.y + (box_rect.height + text_size.height) / 2);
-
-        // Draw semi-transparent background for text
-        cv::Mat overlay;
-        image.copyTo(overlay);
-        cv::rectangle(overlay,
-            cv::Point(text_org.x - 2, text_org.y - text_size.height - 2),
-            cv::Point(text_org.x + text_size.width + 2, text_org.y + baseline + 2),
-            cv::Scalar(255, 255, 255), -1);
-        cv::addWeighted(overlay, 0.7, image, 0.3, 0, image);
+    // Counters around the three phases of a normal run
+    const collision_backend phase_backend = run_linear ? collision_backend::linear : collision_backend::wide_bvh;
+    perf_counter_set counters;
+    counters.start();
+    std::vector<labeled_point> placed = placeLabels(points, nullptr, phase_backend);
+    perf_sample place_sample = counters.stop();
 
-        // Draw the text
-        cv::putText(image, lp.label, text_org,
-            cv::FONT_HERSHEY_SIMPLEX, 0.3, cv::Scalar(0, 0, 0), 1);
+    // hasOverlap is linear in the placed labels, so it is sampled on a prefix of the input
+    const size_t overlap_queries = std::min<size_t>(points.size(), run_linear ? points.size() : 2000);
+    size_t overlap_hits = 0;
+    counters.start();
+    for (size_t i = 0; i < overlap_queries; ++i) {
+        overlap_hits += hasOverlap(candidateBox(points[i].first, 0, extents[i]), placed);
     }
+    perf_sample overlap_sample = counters.stop();
 
-    // Draw unlabeled points in red
-    for (const auto& point_pair : all_points) {
-        bool has_label = false;
-        for (const auto& lp : placed_labels) {
-            if (bg::equals(lp.point, point_pair.first)) {
-                has_label = true;
-                break;
+    counters.start();
+    cv::Mat image = renderPlacementImage(placed, points);
+    perf_sample render_sample = counters.stop();
+
+    // The interactive viewer on the same placement at its frame budget: the
+    // fitted view and then 8 zoom steps in, each until fully refined, and one
+    // unbudgeted headless screenshot of the fitted view
+    placement_view_index view_index = buildViewIndex(placed, points);
+    viewer_state viewer;
+    viewer.index = &view_index;
+    viewer.view = fitViewport(view_index, 800, 600);
+    viewer.cached_zoom = viewer.view.zoom;
+    const viewer_frame_stats fitted_frames = measureViewerFrames(viewer);
+    zoomViewer(viewer, 8, viewer.view.width / 2, viewer.view.height / 2);
+    const viewer_frame_stats zoomed_frames = measureViewerFrames(viewer);
+    const std::string screenshot_path = "label_placer_bench_view.png";
+    auto screenshot_start = std::chrono::steady_clock::now();
+    const bool screenshot_saved = saveViewerScreenshot(view_index, fitViewport(view_index, 800, 600), screenshot_path);
+    const double screenshot_ms = elapsedMs(screenshot_start);
+    std::remove(screenshot_path.c_str());
+
+    std::cout << ",\n  \"phases\": {\n    \"place_labels\": ";
+    writePerfJson(std::cout, place_sample, points.size());
+    std::cout << ",\n    \"has_overlap\": ";
+    writePerfJson(std::cout, overlap_sample, overlap_queries);
+    std::cout << ",\n    \"render\": ";
+    writePerfJson(std::cout, render_sample, placed.size());
+    std::cout << "\n  },\n  \"phase_backend\": \"" << (run_linear ? "linear" : "wide_bvh")
+        << "\",\n  \"has_overlap_hits\": " << overlap_hits << ",\n  \"counters_available\": "
+        << (counters.cycles.available() ? "true" : "false");
+    std::cout << ",\n  \"viewer\": {\n    \"budget_ms\": " << VIEWER_FRAME_BUDGET_MS << ",\n    \"fitted\": ";
+    writeViewerFramesJson(std::cout, fitted_frames);
+    std::cout << ",\n    \"zoomed_in\": ";
+    writeViewerFramesJson(std::cout, zoomed_frames);
+    std::cout << ",\n    \"screenshot_ms\": " << screenshot_ms << ", \"screenshot_saved\": " << (screenshot_saved ? "true" : "false")
+        << "\n  }\n}\n";
+}
+
+// Whole-argument numeric parsing for the command line: false on trailing
+// junk, overflow or a value outside [min, max]
+bool parseIntArg(const char* text, long min, long max, long& value) {
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0 && value >= min && value <= max;
+}
+
+bool parseCountArg(const char* text, size_t& value) {
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long parsed = std::strtoull(text, &end, 10);
+    value = static_cast<size_t>(parsed);
+    return end != text && *end == '\0' && errno == 0 && text[0] != '-' && parsed > 0
+        && parsed <= std::numeric_limits<size_t>::max();
+}
+
+bool parseDoubleArg(const char* text, double min, double& value) {
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtod(text, &end);
+    return end != text && *end == '\0' && errno == 0 && std::isfinite(value) && value >= min;
+}
+
+// Point features of the "labels" layer of one vector tile, as written by
+// encodeVectorTiles, with their tags resolved. Only used by the self-check;
+// throws std::runtime_error on malformed input.
+struct mvt_feature {
+    uint64_t id = 0;
+    int64_t x = 0, y = 0;
+    std::string text;
+    uint64_t offset = 0;
+    std::string anchor;
+};
+
+std::vector<mvt_feature> decodeVectorTile(const std::vector<uint8_t>& data, uint32_t& extent) {
+    struct mvt_value {
+        std::string text;
+        uint64_t number = 0;
+    };
+    std::vector<mvt_feature> features;
+    pbf_reader tile(data.data(), data.data() + data.size());
+    while (tile.next()) {
+        if (tile.field != 3 || tile.wire_type != 2) {
+            tile.skip();
+            continue;
+        }
+        pbf_reader layer = tile.bytes();
+        std::string name;
+        std::vector<std::string> keys;
+        std::vector<mvt_value> values;
+        std::vector<std::vector<uint64_t>> tags;
+        std::vector<mvt_feature> layer_features;
+        uint64_t version = 0;
+        extent = 0;
+        while (layer.next()) {
+            if (layer.field == 1 && layer.wire_type == 2) {
+                pbf_reader bytes = layer.bytes();
+                name.assign(reinterpret_cast<const char*>(bytes.p), bytes.end - bytes.p);
+            } else if (layer.field == 2 && layer.wire_type == 2) {
+                pbf_reader message = layer.bytes();
+                mvt_feature feature;
+                std::vector<uint64_t> feature_tags, geometry;
+                uint64_t type = 0;
+                while (message.next()) {
+                    if (message.field == 1 && message.wire_type == 0) {
+                        feature.id = message.varint();
+                    } else if ((message.field == 2 || message.field == 4) && message.wire_type == 2) {
+                        pbf_reader packed = message.bytes();
+                        std::vector<uint64_t>& column = message.field == 2 ? feature_tags : geometry;
+                        while (packed.p != packed.end) {
+                            column.push_back(packed.varint());
+                        }
+                    } else if (message.field == 3 && message.wire_type == 0) {
+                        type = message.varint();
+                    } else {
+                        message.skip();
+                    }
+                }
+                if (type != 1 || geometry.size() != 3 || geometry[0] != ((1u << 3) | 1u)) {
+                    throw std::runtime_error("feature is not a single MoveTo point");
+                }
+                feature.x = zigzagDecode(geometry[1]);
+                feature.y = zigzagDecode(geometry[2]);
+                layer_features.push_back(feature);
+                tags.push_back(feature_tags);
+            } else if (layer.field == 3 && layer.wire_type == 2) {
+                pbf_reader bytes = layer.bytes();
+                keys.emplace_back(reinterpret_cast<const char*>(bytes.p), bytes.end - bytes.p);
+            } else if (layer.field == 4 && layer.wire_type == 2) {
+                pbf_reader message = layer.bytes();
+                mvt_value value;
+                while (message.next()) {
+                    if (message.field == 1 && message.wire_type == 2) {
+                        pbf_reader bytes = message.bytes();
+                        value.text.assign(reinterpret_cast<const char*>(bytes.p), bytes.end - bytes.p);
+                    } else if (message.field == 5 && message.wire_type == 0) {
+                        value.number = message.varint();
+                    } else {
+                        message.skip();
+                    }
+                }
+                values.push_back(value);
+            } else if (layer.field == 5 && layer.wire_type == 0) {
+                extent = static_cast<uint32_t>(layer.varint());
+            } else if (layer.field == 15 && layer.wire_type == 0) {
+                version = layer.varint();
+            } else {
+                layer.skip();
             }
         }
-        if (!has_label) {
-            cv::Point img_point = worldToImage(point_pair.first, SCALE, IMAGE_SIZE);
-            cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 255), -1);
-            cv::circle(image, img_point, POINT_RADIUS, cv::Scalar(0, 0, 0), 1); // Black border
+        if (name != MVT_LAYER_NAME || version != 2) {
+            throw std::runtime_error("unexpected layer '" + name + "' or version");
         }
+        for (size_t f = 0; f < layer_features.size(); ++f) {
+            if (tags[f].size() % 2 != 0) {
+                throw std::runtime_error("odd tag list");
+            }
+            for (size_t t = 0; t < tags[f].size(); t += 2) {
+                if (tags[f][t] >= keys.size() || tags[f][t + 1] >= values.size()) {
+                    throw std::runtime_error("tag outside the key or value table");
+                }
+                const std::string& key = keys[tags[f][t]];
+                const mvt_value& value = values[tags[f][t + 1]];
+                if (key == "text") {
+                    layer_features[f].text = value.text;
+                } else if (key == "offset") {
+                    layer_features[f].offset = value.number;
+                } else if (key == "anchor") {
+                    layer_features[f].anchor = value.text;
+                }
+            }
+        }
+        features.insert(features.end(), layer_features.begin(), layer_features.end());
     }
+    return features;
+}
 
-    // Add legend
-    cv::putText(image, "Blue: Labeled points", cv::Point(20, 30),
-        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(255, 0, 0), 2);
-    cv::putText(image, "Red: Unlabeled points (overlap)", cv::Point(20, 55),
-        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 2);
-    cv::putText(image, "Green: Label boxes", cv::Point(20, 80),
-        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 255, 0), 2);
-    cv::putText(image, "Red lines: Point-label connections", cv::Point(20, 105),
-        cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255), 2);
+// Archive written to path and read back must equal the encoded one, and both
+// whole-archive and single-tile decoding must give every label back, tile by
+// tile in placement order, within one quantum
+bool checkArchiveRoundTrip(const std::vector<labeled_point>& labels, const std::string& path) {
+    const columnar_archive archive = encodeColumnarArchive(labels, 1.0);
+    columnar_archive read;
+    const bool written = writeColumnarArchive(archive, path);
+    const bool loaded = written && readColumnarArchive(path, read);
+    std::remove(path.c_str());
+    if (!loaded) {
+        std::cerr << "archive: could not write and read back " << path << "\n";
+        return false;
+    }
+    auto same_shape = [](const columnar_archive::label_shape& a, const columnar_archive::label_shape& b) {
+        return !(a < b) && !(b < a);
+    };
+    auto same_entry = [](const columnar_archive::tile_entry& a, const columnar_archive::tile_entry& b) {
+        return a.tile == b.tile && a.count == b.count && a.offset == b.offset && a.size == b.size;
+    };
+    if (read.grid.origin_x != archive.grid.origin_x || read.grid.origin_y != archive.grid.origin_y
+        || read.grid.tile_size != archive.grid.tile_size || read.quantum != archive.quantum
+        || read.dictionary != archive.dictionary || read.blocks != archive.blocks
+        || !std::equal(read.shapes.begin(), read.shapes.end(), archive.shapes.begin(), archive.shapes.end(), same_shape)
+        || !std::equal(read.directory.begin(), read.directory.end(), archive.directory.begin(), archive.directory.end(), same_entry)) {
+        std::cerr << "archive: file read back differs from the encoded archive\n";
+        return false;
+    }
 
-    // Add title
-    cv::putText(image, "Automatic Label Placement Algorithm", cv::Point(IMAGE_SIZE / 2 - 180, 30),
-        cv::FONT_HERSHEY_SIMPLEX, 0.6, cv::Scalar(0, 0, 0), 2);
+    const tile_buckets buckets = bucketByTile(labels, archive.grid);
+    const std::vector<labeled_point> decoded = decodeColumnarArchive(read);
+    if (decoded.size() != labels.size() || buckets.tiles.size() != read.directory.size()) {
+        std::cerr << "archive: decoded " << decoded.size() << " of " << labels.size() << " labels\n";
+        return false;
+    }
+    auto near = [&](const point_t& a, const point_t& b) {
+        return std::abs(bg::get<0>(a) - bg::get<0>(b)) <= read.quantum && std::abs(bg::get<1>(a) - bg::get<1>(b)) <= read.quantum;
+    };
+    for (size_t k = 0; k < decoded.size(); ++k) {
+        const labeled_point& original = labels[buckets.order[k]];
+        const labeled_point& copy = decoded[k];
+        if (copy.label != original.label || copy.offset_index != original.offset_index || !near(copy.point, original.point)
+            || !near(copy.label_box.min_corner(), original.label_box.min_corner())
+            || !near(copy.label_box.max_corner(), original.label_box.max_corner())) {
+            std::cerr << "archive: label " << buckets.order[k] << " ('" << original.label << "') decodes differently\n";
+            return false;
+        }
+    }
+    for (size_t b = 0; b < buckets.tiles.size(); b += std::max<size_t>(1, buckets.tiles.size() / 16)) {
+        const std::vector<labeled_point> tile = decodeColumnarTile(read, buckets.tiles[b]);
+        if (tile.size() != buckets.start[b + 1] - buckets.start[b]
+            || !std::equal(tile.begin(), tile.end(), decoded.begin() + buckets.start[b], [](const labeled_point& a, const labeled_point& c) {
+                return a.label == c.label && bg::equals(a.label_box, c.label_box) && bg::equals(a.point, c.point);
+            })) {
+            std::cerr << "archive: tile " << buckets.tiles[b] << " decodes differently on its own\n";
+            return false;
+        }
+    }
+    std::cout << "archive: " << labels.size() << " labels, " << read.shapes.size() << " shapes, "
+        << read.directory.size() << " tiles round-trip" << std::endl;
+    return true;
+}
+
+// Every vector tile must decode to its labels in order: ids, text, offset
+// and anchor tags, and the anchor within half an extent unit of the point
+bool checkVectorTiles(const std::vector<labeled_point>& labels) {
+    const tile_grid grid = makeTileGrid(labels, 1.0);
+    const tile_buckets buckets = bucketByTile(labels, grid);
+    const std::vector<encoded_vector_tile> tiles = encodeVectorTiles(labels, grid);
+    if (tiles.size() != buckets.tiles.size()) {
+        std::cerr << "mvt: " << tiles.size() << " tiles for " << buckets.tiles.size() << " occupied grid tiles\n";
+        return false;
+    }
+    size_t features = 0;
+    for (size_t b = 0; b < tiles.size(); ++b) {
+        uint32_t extent = 0;
+        std::vector<mvt_feature> decoded;
+        try {
+            decoded = decodeVectorTile(tiles[b].data, extent);
+        } catch (const std::runtime_error& error) {
+            std::cerr << "mvt: tile " << tiles[b].tile << ": " << error.what() << "\n";
+            return false;
+        }
+        const uint32_t count = buckets.start[b + 1] - buckets.start[b];
+        if (tiles[b].tile != buckets.tiles[b] || extent != MVT_EXTENT || decoded.size() != count) {
+            std::cerr << "mvt: tile " << tiles[b].tile << " has " << decoded.size() << " features, expected " << count << "\n";
+            return false;
+        }
+        const point_t origin = grid.tileOrigin(tiles[b].tile);
+        const double units = extent / grid.tile_size;
+        for (uint32_t k = 0; k < count; ++k) {
+            const uint32_t i = buckets.order[buckets.start[b] + k];
+            const labeled_point& label = labels[i];
+            const mvt_feature& feature = decoded[k];
+            const double x = bg::get<0>(origin) + feature.x / units;
+            const double y = bg::get<1>(origin) + (extent - feature.y) / units;
+            if (feature.id != i + 1u || feature.text != label.label || feature.offset != label.offset_index
+                || feature.anchor != MVT_ANCHORS[mvtAnchor(label)]
+                || std::abs(x - bg::get<0>(label.point)) > 0.5 / units || std::abs(y - bg::get<1>(label.point)) > 0.5 / units) {
+                std::cerr << "mvt: label " << i << " ('" << label.label << "') decodes differently\n";
+                return false;
+            }
+        }
+        features += decoded.size();
+    }
+    std::cout << "mvt: " << features << " features in " << tiles.size() << " tiles decode" << std::endl;
+    return true;
+}
 
-    // Display and save the image
-    cv::imshow("Automatic Label Placement Results", image);
-    cv::imwrite("label_placement_results.png", image);
+// A hand-built extract must import to known names and coordinates: an
+// OSMHeader blob to skip, then the same PrimitiveBlock as a raw blob and,
+// with zlib, a zlib blob. The block has a plain node, "Alpha", and three
+// dense nodes of which the first and third are named, "Beta" and "Gamma".
+bool checkPbfImport(const std::string& path) {
+    auto message = [](std::vector<uint8_t>& out, uint32_t field, const std::vector<uint8_t>& body) {
+        putBytesField(out, field, reinterpret_cast<const char*>(body.data()), body.size());
+    };
+    auto varintField = [](std::vector<uint8_t>& out, uint32_t field, uint64_t value) {
+        putTag(out, field, 0);
+        putVarint(out, value);
+    };
+    auto packed = [](std::vector<uint8_t>& out, uint32_t field, std::initializer_list<uint64_t> values) {
+        std::vector<uint8_t> body;
+        for (uint64_t value : values) {
+            putVarint(body, value);
+        }
+        putBytesField(out, field, reinterpret_cast<const char*>(body.data()), body.size());
+    };
 
-    std::cout << "Image saved as 'label_placement_results.png'\n";
-    std::cout << "Placed " << placed_labels.size() << " out of " << all_points.size() << " labels.\n";
-    std::cout << "Press any key to close the window...\n";
-    cv::waitKey(0);
+    std::vector<uint8_t> strings;
+    for (const char* text : { "", "name", "Alpha", "amenity", "cafe", "Beta", "Gamma" }) {
+        putBytesField(strings, 1, text, std::strlen(text));
+    }
+    std::vector<uint8_t> node, dense, group, block;
+    varintField(node, 1, zigzagEncode(1));
+    packed(node, 2, { 3, 1 });
+    packed(node, 3, { 4, 2 });
+    varintField(node, 8, zigzagEncode(515000000));
+    varintField(node, 9, zigzagEncode(-1200000));
+    packed(dense, 1, { zigzagEncode(2), zigzagEncode(1), zigzagEncode(1) });
+    packed(dense, 8, { zigzagEncode(488000000), zigzagEncode(-10000000), zigzagEncode(5000000) });
+    packed(dense, 9, { zigzagEncode(23500000), zigzagEncode(100000), zigzagEncode(-200000) });
+    packed(dense, 10, { 1, 5, 0, 3, 4, 0, 3, 4, 1, 6, 0 });
+    message(group, 1, node);
+    message(group, 2, dense);
+    message(block, 1, strings);
+    message(block, 2, group);
+    varintField(block, 17, 100);
+
+    std::vector<uint8_t> file;
+    auto addBlob = [&](const char* type, const std::vector<uint8_t>& blob) {
+        std::vector<uint8_t> header;
+        putBytesField(header, 1, type, std::strlen(type));
+        varintField(header, 3, blob.size());
+        const uint32_t size = static_cast<uint32_t>(header.size());
+        const uint8_t prefix[4] = { uint8_t(size >> 24), uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size) };
+        file.insert(file.end(), prefix, prefix + 4);
+        file.insert(file.end(), header.begin(), header.end());
+        file.insert(file.end(), blob.begin(), blob.end());
+    };
+    std::vector<uint8_t> header_blob, raw_blob;
+    message(header_blob, 1, strings); // not a PrimitiveBlock; must be skipped by type
+    message(raw_blob, 1, block);
+    addBlob("OSMHeader", header_blob);
+    addBlob("OSMData", raw_blob);
+    size_t copies = 1;
+#if defined(LABEL_PLACER_HAVE_ZLIB)
+    std::vector<uint8_t> compressed(compressBound(static_cast<uLong>(block.size())));
+    uLongf compressed_size = static_cast<uLongf>(compressed.size());
+    if (compress(compressed.data(), &compressed_size, block.data(), static_cast<uLong>(block.size())) == Z_OK) {
+        compressed.resize(compressed_size);
+        std::vector<uint8_t> zlib_blob;
+        varintField(zlib_blob, 2, block.size());
+        message(zlib_blob, 3, compressed);
+        addBlob("OSMData", zlib_blob);
+        ++copies;
+    }
+#endif
+
+    osm_points imported;
+    const bool written = threadBulkIo().writeFiles({ file_write{ path, { { file.data(), file.size() } } } });
+    const bool read = written && readOsmPbf(path, imported);
+    std::remove(path.c_str());
+    if (!read) {
+        std::cerr << "pbf: could not write and import " << path << "\n";
+        return false;
+    }
+    const struct {
+        const char* name;
+        double lat, lon;
+    } expected[3] = { { "Alpha", 51.5, -0.12 }, { "Beta", 48.8, 2.35 }, { "Gamma", 48.3, 2.34 } };
+    if (imported.size() != 3 * copies || imported.labels.size() != 3) {
+        std::cerr << "pbf: imported " << imported.size() << " nodes (" << imported.labels.size()
+            << " names), expected " << 3 * copies << " (3)\n";
+        return false;
+    }
+    for (size_t i = 0; i < imported.size(); ++i) {
+        const auto& node_expected = expected[i % 3];
+        if (imported.labels.label(imported.label_ids[i]) != node_expected.name
+            || std::abs(imported.lonlat.y[i] - node_expected.lat) > 1e-9 || std::abs(imported.lonlat.x[i] - node_expected.lon) > 1e-9) {
+            std::cerr << "pbf: node " << i << " imported as '" << imported.labels.label(imported.label_ids[i]) << "' at "
+                << imported.lonlat.y[i] << ", " << imported.lonlat.x[i] << ", expected '" << node_expected.name << "' at "
+                << node_expected.lat << ", " << node_expected.lon << "\n";
+            return false;
+        }
+    }
+    std::cout << "pbf: " << imported.size() << " named nodes from " << copies << " data blob(s) import" << std::endl;
+    return true;
+}
+
+// Headless checks of the binary formats on a benchmark placement: one with
+// the four plain box shapes (packed shape column) and a layered one with
+// more. Returns false if any check failed.
+bool runSelfCheck() {
+    const std::vector<std::pair<point_t, std::string>> points = makeBenchmarkPoints(20000);
+    std::vector<labeled_point> plain = placeLabels(points);
+
+    placement_layer cities, places;
+    cities.name = "cities";
+    cities.width = 0.6;
+    cities.height = 0.25;
+    cities.offsets = cornerOffsets(cities.width, cities.height, 0.15);
+    places.name = "places";
+    places.priority = 1;
+    places.overlap_tolerance = 0.1;
+    for (size_t i = 0; i < points.size(); ++i) {
+        (i % 3 == 0 ? cities : places).points.push_back(points[i]);
+    }
+    std::vector<labeled_point> layered;
+    for (auto& layer : placeLayers({ cities, places }).labels) {
+        std::move(layer.begin(), layer.end(), std::back_inserter(layered));
+    }
+
+    bool ok = true;
+    for (const std::vector<labeled_point>* labels : { &plain, &layered }) {
+        ok = checkArchiveRoundTrip(*labels, "label_placer_self_check.lpc") && ok;
+        ok = checkVectorTiles(*labels) && ok;
+    }
+    ok = checkPbfImport("label_placer_self_check.osm.pbf") && ok;
+    std::cout << (ok ? "Self-check passed" : "Self-check FAILED") << std::endl;
+    return ok;
 }
 
-int main() {
+void printUsage(std::ostream& out, const char* program) {
+    out << "Usage: " << program << " [options]\n"
+        "  --headless <file.png> renders the viewer once to a file instead of opening a window\n"
+        "  --heatmap records rejected candidates and overlays their congestion\n"
+        "      (default, --deadline and --pixel-aligned placement only)\n"
+        "  --pixel-aligned places labels in integer pixel space of the output image\n"
+        "  --archive <file> writes the placement as a columnar archive\n"
+        "  --async-encode writes the result image on an encoder pool while the program goes on\n"
+        "  --image-format png|webp|qoi, --png-compression <0-9>, --webp-quality <1-101> choose the result\n"
+        "    image encoding; a WebP quality above 100 is lossless\n"
+        "  --io-uring routes file reads and writes through batched io_uring submissions\n"
+        "  --external-sort <dir> places in Hilbert order via an external sort spilling to dir and streams\n"
+        "    the placed labels to label_placement_results.tsv instead of the in-memory outputs\n"
+        "  --font <file.ttf> [pixels] draws and measures label text with a TrueType font\n"
+        "  --icons places every point as an icon plus text POI, keeping the icon when the text does not fit\n"
+        "  --glyph-masks lets label boxes overlap where their text does not\n"
+        "  --layers places the sample as a \"cities\" layer above a \"places\" layer that tolerates 10% overlap\n"
+        "  --style <file> places with compiled style rules over the attributes \"index\" and \"length\"\n"
+        "  --mvt <prefix> writes one vector tile per 1x1 tile as <prefix>-<x>-<y>.mvt\n"
+        "  --mbtiles <file> [raster|vector] writes a raster or vector tile pyramid (zoom 0-3)\n"
+        "  --overwrite lets --mbtiles replace an existing file\n"
+        "  --tile-local float|int32 collides in tile-local compact coordinates\n"
+        "  --backend linear|rtree|bvh selects the collision index of the default placer\n"
+        "  --parallel places tiles on all cores; --no-numa disables node pinning\n"
+        "  --deadline <ms> stops placement after the given time, keeping what was placed\n"
+        "  --huge-pages off|thp|explicit backs the large arrays with huge pages\n"
+        "  --osm <file.osm.pbf> places the named nodes of an OpenStreetMap extract\n"
+        "  --bench [points] runs the collision backend benchmark and exits\n"
+        "  --self-check round-trips the archive and vector tile formats and imports a known PBF, then exits\n"
+        "  --help prints this list\n";
+}
+
+int main(int argc, char** argv) {
+    // Every flag is listed in printUsage; all of them are parsed before any work starts
+    std::string screenshot_path;
+    std::string osm_path;
+    collision_backend backend = collision_backend::linear;
+    std::string tile_local;
+    bool parallel = false;
+    double deadline_ms = -1.0;
+    bool numa_aware = true;
+    std::string archive_path;
+    std::string mvt_prefix;
+    std::string spill_dir;
+    bool layered = false;
+    bool glyph_masks = false;
+    bool icons = false;
+    std::string style_path;
+    bool async_encode = false;
+    std::string image_format = "png";
+    image_encode_options encode_options;
+    std::string mbtiles_path;
+    bool mbtiles_vector = false;
+    bool overwrite = false;
+    bool heatmap = false;
+    bool pixel_aligned = false;
+    size_t bench_points = 0; // nonzero: run the benchmark instead
+    bool self_check = false;
+    auto usageError = [&](const std::string& message) {
+        std::cerr << message << "\n";
+        printUsage(std::cerr, argv[0]);
+        return 1;
+    };
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--headless" && i + 1 < argc) {
+            screenshot_path = argv[++i];
+        } else if (arg == "--heatmap") {
+            heatmap = true;
+        } else if (arg == "--pixel-aligned") {
+            pixel_aligned = true;
+        } else if (arg == "--archive" && i + 1 < argc) {
+            archive_path = argv[++i];
+        } else if (arg == "--mbtiles" && i + 1 < argc) {
+            mbtiles_path = argv[++i];
+            if (i + 1 < argc && (std::string(argv[i + 1]) == "vector" || std::string(argv[i + 1]) == "raster")) {
+                mbtiles_vector = std::string(argv[++i]) == "vector";
+            }
+        } else if (arg == "--overwrite") {
+            overwrite = true;
+        } else if (arg == "--external-sort" && i + 1 < argc) {
+            spill_dir = argv[++i];
+        } else if (arg == "--style" && i + 1 < argc) {
+            style_path = argv[++i];
+        } else if (arg == "--font" && i + 1 < argc) {
+            labelFont().path = argv[++i];
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+                long pixels = 0;
+                if (!parseIntArg(argv[++i], 1, 1000, pixels)) {
+                    return usageError("--font: pixel height must be 1-1000, got '" + std::string(argv[i]) + "'");
+                }
+                labelFont().height = static_cast<int>(pixels);
+            }
+            if (!text_run_cache::instance().loadsTrueType(labelFont())) {
+                std::cerr << "TrueType text unavailable, using the Hershey font\n";
+            }
+        } else if (arg == "--icons") {
+            icons = true;
+        } else if (arg == "--glyph-masks") {
+            glyph_masks = true;
+        } else if (arg == "--layers") {
+            layered = true;
+        } else if (arg == "--io-uring") {
+            ioBackend() = io_backend::io_uring;
+        } else if (arg == "--async-encode") {
+            async_encode = true;
+        } else if (arg == "--image-format" && i + 1 < argc) {
+            image_format = argv[++i];
+            if (image_format != "png" && image_format != "webp" && image_format != "qoi") {
+                return usageError("--image-format: unknown format '" + image_format + "'");
+            }
+        } else if (arg == "--png-compression" && i + 1 < argc) {
+            long level = 0;
+            if (!parseIntArg(argv[++i], 0, 9, level)) {
+                return usageError("--png-compression: level must be 0-9, got '" + std::string(argv[i]) + "'");
+            }
+            encode_options.png_compression = static_cast<int>(level);
+        } else if (arg == "--webp-quality" && i + 1 < argc) {
+            long quality = 0;
+            if (!parseIntArg(argv[++i], 1, 101, quality)) {
+                return usageError("--webp-quality: quality must be 1-101, got '" + std::string(argv[i]) + "'");
+            }
+            encode_options.webp_quality = static_cast<int>(quality);
+        } else if (arg == "--mvt" && i + 1 < argc) {
+            mvt_prefix = argv[++i];
+        } else if (arg == "--tile-local" && i + 1 < argc) {
+            tile_local = argv[++i];
+            if (tile_local != "float" && tile_local != "int32") {
+                return usageError("--tile-local: unknown precision '" + tile_local + "'");
+            }
+        } else if (arg == "--deadline" && i + 1 < argc) {
+            if (!parseDoubleArg(argv[++i], 0.0, deadline_ms)) {
+                return usageError("--deadline: expected milliseconds, got '" + std::string(argv[i]) + "'");
+            }
+        } else if (arg == "--parallel") {
+            parallel = true;
+        } else if (arg == "--no-numa") {
+            numa_aware = false;
+        } else if (arg == "--backend" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name != "linear" && name != "rtree" && name != "bvh") {
+                return usageError("--backend: unknown backend '" + name + "'");
+            }
+            backend = name == "rtree" ? collision_backend::rtree
+                : name == "bvh" ? collision_backend::wide_bvh : collision_backend::linear;
+        } else if (arg == "--huge-pages" && i + 1 < argc) {
+            std::string mode = argv[++i];
+            if (mode != "off" && mode != "thp" && mode != "explicit") {
+                return usageError("--huge-pages: unknown mode '" + mode + "'");
+            }
+            hugePageMode() = mode == "explicit" ? huge_page_mode::explicit_pages
+                : mode == "thp" ? huge_page_mode::transparent : huge_page_mode::off;
+        } else if (arg == "--osm" && i + 1 < argc) {
+            osm_path = argv[++i];
+        } else if (arg == "--bench") {
+            bench_points = 100000;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))
+                && !parseCountArg(argv[++i], bench_points)) {
+                return usageError("--bench: expected a point count, got '" + std::string(argv[i]) + "'");
+            }
+        } else if (arg == "--self-check") {
+            self_check = true;
+        } else if (arg == "--help" || arg == "-h") {
+            printUsage(std::cout, argv[0]);
+            return 0;
+        } else {
+            return usageError("Unknown or incomplete option '" + arg + "'");
+        }
+    }
+
+    if (!spill_dir.empty() && (!archive_path.empty() || !mvt_prefix.empty() || !mbtiles_path.empty())) {
+        return usageError("--external-sort streams its labels and cannot feed --archive, --mvt or --mbtiles");
+    }
+    // The mode chain in order: only these placers record placement_diagnostics
+    const bool records_rejections = pixel_aligned || (style_path.empty() && !layered && spill_dir.empty()
+        && (deadline_ms >= 0.0 || (!parallel && !icons && !glyph_masks && tile_local.empty())));
+    if (heatmap && !records_rejections) {
+        return usageError("--heatmap works with the default, --deadline and --pixel-aligned placers only, not with "
+            "--style, --layers, --external-sort, --parallel, --icons, --glyph-masks or --tile-local");
+    }
+
+    if (bench_points) {
+        runCollisionBenchmark(bench_points);
+        return 0;
+    }
+    if (self_check) {
+        return runSelfCheck() ? 0 : 1;
+    }
+
     // Create sample data with more realistic distribution
     std::vector<std::pair<point_t, std::string>> points;
 
@@ -198,7 +6871,163 @@ int main() {
     points.push_back(std::make_pair(point_t(5.5, 1.0), "I"));
     points.push_back(std::make_pair(point_t(1.0, 5.0), "J"));
 
-    auto results = placeLabels(points);
+    if (!osm_path.empty()) {
+        osm_points osm;
+        if (!readOsmPbf(osm_path, osm) || osm.size() == 0) {
+            std::cerr << "Could not import named nodes from " << osm_path << std::endl;
+            return 1;
+        }
+        // Web Mercator, fitted into the rendered area
+        lonLatToMercator(osm.lonlat);
+        auto x_range = std::minmax_element(osm.lonlat.x.begin(), osm.lonlat.x.end());
+        auto y_range = std::minmax_element(osm.lonlat.y.begin(), osm.lonlat.y.end());
+        double extent = std::max({ *x_range.second - *x_range.first, *y_range.second - *y_range.first, 1e-9 });
+        double fit = (IMAGE_SIZE / SCALE - 1.0) / extent;
+        double min_x = *x_range.first, min_y = *y_range.first;
+        for (size_t i = 0; i < osm.size(); ++i) {
+            osm.lonlat.x[i] = 0.5 + (osm.lonlat.x[i] - min_x) * fit;
+            osm.lonlat.y[i] = 0.5 + (osm.lonlat.y[i] - min_y) * fit;
+        }
+        if (osm.size() > compact_label::MAX_INPUTS) {
+            std::cerr << osm_path << " has " << osm.size() << " named nodes; at most "
+                << compact_label::MAX_INPUTS << " can be placed" << std::endl;
+            return 1;
+        }
+        points = toPlacementInput(osm);
+        std::cout << "Imported " << osm.size() << " named nodes (" << osm.labels.size() << " distinct names)" << std::endl;
+    }
+
+    placement_diagnostics diagnostics;
+    image_coordinate_cache coords; // shared by pixel-aligned placement and rendering
+    std::vector<labeled_point> results;
+    std::vector<std::pair<point_t, box_t>> poi_icons; // composite placement only
+    if (pixel_aligned) {
+        results = placeLabelsPixelAligned(points, SCALE, IMAGE_SIZE, &coords, heatmap ? &diagnostics : nullptr);
+    } else if (!style_path.empty()) {
+        feature_columns features;
+        features.names = { "index", "length" };
+        features.values.resize(2);
+        for (size_t i = 0; i < points.size(); ++i) {
+            features.values[0].push_back(static_cast<double>(i));
+            features.values[1].push_back(static_cast<double>(points[i].second.size()));
+        }
+        std::ifstream file(style_path);
+        if (!file) {
+            std::cerr << "Failed to open style '" << style_path << "'\n";
+            return 1;
+        }
+        std::stringstream source;
+        source << file.rdbuf();
+        try {
+            style_program program = compileStyle(source.str(), features);
+            results = placeStyledLabels(points, evaluateStyle(program, features), backend);
+        } catch (const std::runtime_error& error) {
+            std::cerr << "Invalid style '" << style_path << "': " << error.what() << "\n";
+            return 1;
+        }
+    } else if (layered) {
+        // Every third point is a city with a larger label that goes first
+        placement_layer cities, places;
+        cities.name = "cities";
+        cities.width = 0.6;
+        cities.height = 0.25;
+        cities.offsets = cornerOffsets(cities.width, cities.height, 0.15);
+        places.name = "places";
+        places.priority = 1;
+        places.overlap_tolerance = 0.1;
+        for (size_t i = 0; i < points.size(); ++i) {
+            (i % 3 == 0 ? cities : places).points.push_back(points[i]);
+        }
+        layered_placement placement = placeLayers({ cities, places }, backend);
+        for (size_t l = 0; l < placement.labels.size(); ++l) {
+            const layer_stats& stats = placement.stats[l];
+            std::cout << "Layer '" << stats.name << "': placed " << stats.placed << " of " << stats.points
+                << ", " << stats.rejected_candidates << " candidates rejected (" << stats.blocked_by_earlier_layers
+                << " by earlier layers), " << stats.tolerated_overlaps << " placed within overlap budget, " << stats.place_ms << " ms" << std::endl;
+            results.insert(results.end(), placement.labels[l].begin(), placement.labels[l].end());
+        }
+    } else if (!spill_dir.empty()) {
+        box_t bounds;
+        bg::assign_inverse(bounds);
+        for (const auto& input : points) {
+            bg::expand(bounds, input.first);
+        }
+        external_sorter sorter(spill_dir);
+        for (const auto& input : points) {
+            if (!sorter.add(hilbertKey(input.first, bounds), input.first, input.second)) {
+                std::cerr << "Failed to spill sort run to '" << spill_dir << "'\n";
+                return 1;
+            }
+        }
+        // Labels go straight from the placer to the file; only the placed
+        // boxes and the file buffer stay in memory
+        const std::string labels_path = "label_placement_results.tsv";
+        std::ofstream labels_file(labels_path, std::ios::binary);
+        labels_file << "x\ty\tlabel\tmin_x\tmin_y\tmax_x\tmax_y\n";
+        labels_file.precision(17);
+        size_t placed = 0;
+        const size_t runs = sorter.runCount();
+        const bool merged = placeLabelsStreaming(sorter, [&](const labeled_point& lp) {
+            std::string label = lp.label;
+            std::replace_if(label.begin(), label.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+            labels_file << bg::get<0>(lp.point) << '\t' << bg::get<1>(lp.point) << '\t' << label << '\t'
+                << bg::get<0>(lp.label_box.min_corner()) << '\t' << bg::get<1>(lp.label_box.min_corner()) << '\t'
+                << bg::get<0>(lp.label_box.max_corner()) << '\t' << bg::get<1>(lp.label_box.max_corner()) << '\n';
+            ++placed;
+        }) != 0;
+        if (points.size() && !merged) {
+            std::cerr << "Failed to merge sort runs in '" << spill_dir << "'\n";
+            return 1;
+        }
+        labels_file.close();
+        if (!labels_file) {
+            std::cerr << "Failed to write '" << labels_path << "'\n";
+            return 1;
+        }
+        std::cout << "Placed " << placed << " of " << points.size() << " labels in Hilbert order from " << runs
+            << " spilled runs, streamed to '" << labels_path << "'" << std::endl;
+        return 0;
+    } else if (deadline_ms >= 0.0) {
+        placement_budget budget;
+        budget.deadline = std::chrono::steady_clock::now()
+            + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(deadline_ms));
+        anytime_placement anytime = placeLabelsAnytime(points, budget, backend, heatmap ? &diagnostics : nullptr);
+        for (compact_label label : anytime.labels) {
+            results.push_back(expandLabel(points, label));
+        }
+        if (!anytime.complete) {
+            std::cout << "Deadline reached: " << anytime.unprocessed << " points not processed" << std::endl;
+        }
+    } else if (parallel) {
+        parallel_placement_options options;
+        options.numa_aware = numa_aware;
+        for (compact_label label : placeLabelsParallel(points, options)) {
+            results.push_back(expandLabel(points, label));
+        }
+    } else if (icons) {
+        size_t icon_only = 0;
+        std::vector<composite_label> pois = placeCompositeLabels(points, defaultCompositeStyle(), backend);
+        poi_icons = compositeIcons(pois);
+        for (const composite_label& poi : pois) {
+            if (poi.has_text) {
+                results.push_back(poi.text);
+            } else {
+                ++icon_only;
+            }
+        }
+        std::cout << "POIs: " << results.size() << " with text, " << icon_only << " icon only" << std::endl;
+    } else if (glyph_masks) {
+        for (compact_label label : placeLabelsGlyphMasked(points)) {
+            results.push_back(expandLabel(points, label));
+        }
+    } else if (!tile_local.empty()) {
+        local_precision precision = tile_local == "int32" ? local_precision::int32 : local_precision::float32;
+        for (compact_label label : placeLabelsTileLocal(points, 2.0, precision)) {
+            results.push_back(expandLabel(points, label));
+        }
+    } else {
+        results = placeLabels(points, heatmap ? &diagnostics : nullptr, backend);
+    }
 
     // Console output with more details
     std::cout << "\n=== LABEL PLACEMENT RESULTS ===\n";
@@ -225,7 +7054,112 @@ int main() {
     }
 
     // OpenCV visualization - FIXED: pass the correct variables
-    visualizeWithOpenCV(results, points);
+    if (heatmap) {
+        size_t worst = 0;
+        for (size_t i = 1; i < diagnostics.blocked_by.size(); ++i) {
+            if (diagnostics.blocked_by[i] > diagnostics.blocked_by[worst]) {
+                worst = i;
+            }
+        }
+        std::cout << "Rejected candidates: " << diagnostics.rejected_candidates
+            << ", unplaced points: " << diagnostics.unplaced_points << "\n";
+        if (!diagnostics.blocked_by.empty() && diagnostics.blocked_by[worst] > 0) {
+            std::cout << "Worst blocker: '" << results[worst].label << "' rejected "
+                << diagnostics.blocked_by[worst] << " candidates\n";
+        }
+    }
+
+    placement_render_options render_options;
+    render_options.decorations = !glyph_masks;
+    render_options.icons = std::move(poi_icons);
+
+    if (!archive_path.empty()) {
+        columnar_archive archive = encodeColumnarArchive(results, 1.0);
+        columnar_archive reloaded;
+        if (!writeColumnarArchive(archive, archive_path) || !readColumnarArchive(archive_path, reloaded)) {
+            std::cerr << "Failed to write '" << archive_path << "'\n";
+            return 1;
+        }
+        std::cout << "Archive saved as '" << archive_path << "': " << results.size() << " labels in "
+            << reloaded.directory.size() << " tiles, " << reloaded.blocks.size() << " block bytes\n";
+    }
+
+    if (!mvt_prefix.empty()) {
+        tile_grid grid = makeTileGrid(results, 1.0);
+        std::vector<encoded_vector_tile> tiles = encodeVectorTiles(results, grid);
+        std::vector<file_write> files;
+        const uint32_t top_row = tiles.empty() ? 0 : tile_grid::row(tiles.back().tile);
+        for (const auto& tile : tiles) {
+            // XYZ numbering: y counts rows from the north
+            std::string path = mvt_prefix + "-" + std::to_string(tile_grid::column(tile.tile)) + "-"
+                + std::to_string(top_row - tile_grid::row(tile.tile)) + ".mvt";
+            files.push_back(file_write{ path, { { tile.data.data(), tile.data.size() } } });
+        }
+        if (!threadBulkIo().writeFiles(files)) {
+            std::cerr << "Failed to write vector tiles with '" << mvt_prefix << "-' prefix\n";
+            return 1;
+        }
+        std::cout << "Vector tiles written: " << tiles.size() << " tiles with '" << mvt_prefix << "-' prefix\n";
+    }
+
+    if (!mbtiles_path.empty()) {
+        if (std::ifstream(mbtiles_path)) {
+            if (!overwrite) {
+                std::cerr << "'" << mbtiles_path << "' exists; pass --overwrite to replace it\n";
+                return 1;
+            }
+            std::remove(mbtiles_path.c_str());
+        }
+        const int max_zoom = 3;
+        mbtiles_writer writer(mbtiles_path, mbtiles_vector ? "pbf" : "png", "Label placement");
+        setPyramidMetadata(writer, buildViewIndex(results, points).bounds, max_zoom);
+        if (mbtiles_vector) {
+            writer.setMetadata("json", "{\"vector_layers\":[{\"id\":\"labels\",\"fields\":"
+                "{\"text\":\"String\",\"offset\":\"Number\",\"anchor\":\"String\"},"
+                "\"minzoom\":0,\"maxzoom\":" + std::to_string(max_zoom) + "}]}");
+            const size_t outside = writeVectorTilesToMbtiles(writer, results, max_zoom);
+            if (outside > 0) {
+                std::cout << "MBTiles: " << outside << " labels outside the world square left out\n";
+            }
+        } else if (!writeRasterPyramidToMbtiles(writer, results, points, max_zoom, render_options)) {
+            writer.close();
+            std::cerr << "Failed to encode raster tiles for '" << mbtiles_path << "'\n";
+            return 1;
+        }
+        if (!writer.close()) {
+            std::cerr << "Failed to write '" << mbtiles_path << "': " << writer.error() << "\n";
+            return 1;
+        }
+        std::cout << "MBTiles saved as '" << mbtiles_path << "': " << writer.written() << " tiles\n";
+    }
+
+    // Other encodings go through the encoder pool; without --async-encode it is drained right away
+    std::unique_ptr<async_image_writer> image_writer;
+    const std::string image_path = "label_placement_results." + image_format;
+    if (async_encode || image_format != "png" || encode_options.png_compression != image_encode_options().png_compression) {
+        image_writer.reset(new async_image_writer(encode_options));
+    }
+    visualizeWithOpenCV(results, points, heatmap ? &diagnostics : nullptr, &coords, image_writer.get(), image_path, render_options);
+    if (image_writer && !async_encode && !image_writer->finish()) {
+        std::cerr << "Failed to write '" << image_path << "'\n";
+        return 1;
+    }
 
+    placement_view_index view_index = buildViewIndex(results, points, render_options);
+    viewport view = fitViewport(view_index, 800, 600);
+    if (!screenshot_path.empty()) {
+        if (!saveViewerScreenshot(view_index, view, screenshot_path)) {
+            std::cerr << "Failed to write '" << screenshot_path << "'\n";
+            return 1;
+        }
+        std::cout << "Viewer screenshot saved as '" << screenshot_path << "'\n";
+    } else {
+        runInteractiveViewer(view_index, view);
+    }
+
+    if (image_writer && !image_writer->finish()) {
+        std::cerr << "Failed to write '" << image_path << "'\n";
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file